@@ -0,0 +1,204 @@
+#include "admission.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "event_loop.h"
+#include "tls.h"
+
+#define BUCKET_GROUP 8       // Slots a client can live in, probed together
+#define BUCKET_STRIPES 64    // Locks over the groups
+#define MILLI_TOKEN 1000     // Tokens are counted in thousandths, so refills need no division
+
+/*
+ * One client's bucket. 32 bytes: two per cache line, the whole table for the default 16384
+ * clients is 512 KB.
+ */
+struct bucket {
+    uint64_t hi;
+    uint64_t lo;
+    uint64_t refilled_ms; // 0: slot unused
+    uint32_t tokens;      // Milli-tokens
+    uint32_t padding;
+};
+
+/*
+ * A fixed table instead of a map that grows: a flood from many addresses must not grow the
+ * server's memory. A client hashes to one group of BUCKET_GROUP slots; when all are taken by
+ * others, the one refilled longest ago is reused. Its bucket was most likely full again, and a
+ * full bucket is exactly what the new client would start with, so nothing is forgotten that
+ * mattered. The hash is keyed with a random seed, so nobody can aim addresses at one group.
+ */
+static struct bucket *buckets = NULL;
+static size_t group_mask = 0;
+static pthread_mutex_t stripes[BUCKET_STRIPES];
+static uint64_t hash_seed = 0;
+
+static uint32_t refill_per_ms = 0; // Milli-tokens per millisecond == tokens per second
+static uint32_t burst_tokens = 0;  // Milli-tokens
+
+static atomic_ullong accepted = 0;
+static atomic_ullong rejected_connections = 0; // ADMIN_MAX_CONNECTIONS reached
+static atomic_ullong rejected_clients = 0;     // Rate limited at accept
+static atomic_ullong limited_requests = 0;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+void client_addr_from(struct client_addr *client, const struct sockaddr_storage *addr) {
+    unsigned char bytes[16] = { 0 };
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(bytes, &in6->sin6_addr, 8); // IPv4-mapped addresses keep the mapping prefix
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) memcpy(bytes + 8, (const char *)&in6->sin6_addr + 8, 8);
+    } else if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        bytes[10] = bytes[11] = 0xff; // Same key as the IPv4-mapped form
+        memcpy(bytes + 12, &in->sin_addr, 4);
+    }
+    memcpy(&client->hi, bytes, 8);
+    memcpy(&client->lo, bytes + 8, 8);
+}
+
+int admission_init(void) {
+    if (server_config.rate_limit_rps == 0) return 0;
+
+    size_t groups = 1;
+    while (groups * BUCKET_GROUP < server_config.rate_limit_clients) groups <<= 1;
+    buckets = calloc(groups * BUCKET_GROUP, sizeof(*buckets));
+    if (!buckets) return -1;
+    group_mask = groups - 1;
+
+    for (size_t i = 0; i < BUCKET_STRIPES; ++i) pthread_mutex_init(&stripes[i], NULL);
+    if (getrandom(&hash_seed, sizeof(hash_seed), 0) != sizeof(hash_seed)) hash_seed = (uint64_t)monotonic_ms();
+
+    refill_per_ms = (uint32_t)server_config.rate_limit_rps;
+    burst_tokens = (uint32_t)server_config.rate_limit_burst * MILLI_TOKEN;
+    return 0;
+}
+
+/*
+ * Takes `cost` milli-tokens if the bucket holds at least one whole token.
+ * Returns: 0 if it did, otherwise the seconds until it will.
+ */
+static unsigned bucket_take(const struct client_addr *client, uint32_t cost) {
+    if (!buckets) return 0;
+
+    // Never 0, that marks an unused slot
+    uint64_t now = (uint64_t)monotonic_ms() + 1;
+    size_t group = (size_t)mix64(client->hi ^ mix64(client->lo ^ hash_seed)) & group_mask;
+    struct bucket *slots = &buckets[group * BUCKET_GROUP];
+    pthread_mutex_t *stripe = &stripes[group % BUCKET_STRIPES];
+
+    pthread_mutex_lock(stripe);
+    struct bucket *b = NULL;
+    struct bucket *oldest = &slots[0];
+    for (size_t i = 0; i < BUCKET_GROUP; ++i) {
+        if (slots[i].refilled_ms != 0 && slots[i].hi == client->hi && slots[i].lo == client->lo) {
+            b = &slots[i];
+            break;
+        }
+        if (slots[i].refilled_ms < oldest->refilled_ms) oldest = &slots[i];
+    }
+    if (!b) {
+        b = oldest;
+        *b = (struct bucket){ .hi = client->hi, .lo = client->lo, .refilled_ms = now, .tokens = burst_tokens };
+    }
+
+    uint64_t refill = (now - b->refilled_ms) * refill_per_ms;
+    b->tokens = refill >= burst_tokens - b->tokens ? burst_tokens : b->tokens + (uint32_t)refill;
+    b->refilled_ms = now;
+
+    unsigned retry_after_s = 0;
+    if (b->tokens >= MILLI_TOKEN) {
+        b->tokens -= cost;
+    } else {
+        uint32_t missing_ms = (MILLI_TOKEN - b->tokens + refill_per_ms - 1) / refill_per_ms;
+        retry_after_s = (missing_ms + 999) / 1000;
+    }
+    pthread_mutex_unlock(stripe);
+    return retry_after_s;
+}
+
+/*
+ * Written with a single send() on a socket that was just accepted: its send buffer is empty,
+ * so the few bytes are taken at once and the loop thread never waits. Nothing was read, the
+ * request isn't even looked at.
+ */
+static void reject(int client_fd, const char *status, unsigned retry_after_s) {
+    if (!tls_enabled()) {
+        char head[160];
+        int n = snprintf(head, sizeof(head),
+                         "HTTP/1.1 %s\r\nRetry-After: %u\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                         status, retry_after_s);
+        if (send(client_fd, head, (size_t)n, MSG_DONTWAIT | MSG_NOSIGNAL) == n) shutdown(client_fd, SHUT_WR);
+    }
+    close(client_fd);
+}
+
+int admission_accept(int client_fd, const struct client_addr *client, size_t open_connections) {
+    if (server_config.max_connections > 0 && open_connections >= server_config.max_connections) {
+        atomic_fetch_add_explicit(&rejected_connections, 1, memory_order_relaxed);
+        reject(client_fd, "503 Service Unavailable", 1);
+        return 0;
+    }
+
+    // Only checked: the token is taken by the client's request, a connection alone costs nothing
+    unsigned retry_after_s = bucket_take(client, 0);
+    if (retry_after_s > 0) {
+        atomic_fetch_add_explicit(&rejected_clients, 1, memory_order_relaxed);
+        reject(client_fd, "429 Too Many Requests", retry_after_s);
+        return 0;
+    }
+
+    atomic_fetch_add_explicit(&accepted, 1, memory_order_relaxed);
+    return 1;
+}
+
+unsigned admission_charge_request(const struct client_addr *client) {
+    unsigned retry_after_s = bucket_take(client, MILLI_TOKEN);
+    if (retry_after_s > 0) atomic_fetch_add_explicit(&limited_requests, 1, memory_order_relaxed);
+    return retry_after_s;
+}
+
+void admission_render(telemetry_append append, void *ctx) {
+    // Only the sampler renders, so the previous reading needs no lock
+    static unsigned long long last_accepted = 0, last_rejected = 0;
+    static long long last_ms = 0;
+
+    unsigned long long now_accepted = atomic_load_explicit(&accepted, memory_order_relaxed);
+    unsigned long long full = atomic_load_explicit(&rejected_connections, memory_order_relaxed);
+    unsigned long long limited = atomic_load_explicit(&rejected_clients, memory_order_relaxed);
+    unsigned long long requests = atomic_load_explicit(&limited_requests, memory_order_relaxed);
+    unsigned long long now_rejected = full + limited + requests;
+
+    long long now_ms = monotonic_ms();
+    double elapsed_s = last_ms ? (double)(now_ms - last_ms) / 1000.0 : 0.0;
+    double accept_rate = elapsed_s > 0 ? (double)(now_accepted - last_accepted) / elapsed_s : 0.0;
+    double reject_rate = elapsed_s > 0 ? (double)(now_rejected - last_rejected) / elapsed_s : 0.0;
+    last_accepted = now_accepted;
+    last_rejected = now_rejected;
+    last_ms = now_ms;
+
+    append(ctx,
+        "admin_http_connections_accepted_total %llu\n"
+        "admin_http_connections_rejected_total{reason=\"max_connections\"} %llu\n"
+        "admin_http_connections_rejected_total{reason=\"rate_limit\"} %llu\n"
+        "admin_http_requests_rate_limited_total %llu\n"
+        "admin_http_accept_rate %.3f\n"
+        "admin_http_shed_rate %.3f\n"
+        "admin_http_max_connections %zu\n",
+        now_accepted, full, limited, requests, accept_rate, reject_rate, server_config.max_connections);
+}
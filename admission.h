@@ -0,0 +1,47 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "telemetry.h"
+
+// The source a client is rate limited by: its IPv4 address, or the /64
+// prefix of its IPv6 address (one host usually owns a whole /64).
+struct client_addr {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+// Function to derive the rate limiting key of a peer address.
+void client_addr_from(struct client_addr *client, const struct sockaddr_storage *addr);
+
+// Function to set up admission control: the connection limit from
+// ADMIN_MAX_CONNECTIONS and the per-client token buckets from
+// ADMIN_RATE_LIMIT_RPS and ADMIN_RATE_LIMIT_BURST.
+//
+// Returns: 0 on success, -1 if the bucket table could not be allocated.
+int admission_init(void);
+
+// Function to admit or turn away a freshly accepted client before anything is
+// read from it: when `open_connections` reached the limit, or the client used
+// up its request budget. A rejected client gets a canned 503 or 429 with
+// Retry-After (nothing over TLS, where it would need a handshake first) and is
+// closed.
+//
+// Returns: 1 if the client was admitted, 0 if it was rejected and closed.
+int admission_accept(int client_fd, const struct client_addr *client, size_t open_connections);
+
+// Function to take one request from a client's token bucket.
+//
+// Returns: 0 if the request may be served, otherwise the seconds until the
+//          client has a token again, for Retry-After.
+unsigned admission_charge_request(const struct client_addr *client);
+
+// Function to write the admission counters and the accept and rejection rates
+// since the previous call in the Prometheus text format. Called by the metrics
+// sampler only.
+void admission_render(telemetry_append append, void *ctx);
+
+#endif // ADMISSION_H
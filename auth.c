@@ -1,25 +1,80 @@
 #include "auth.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <jansson.h>
 #include <signal.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
+#include <openssl/sha.h>
 
 #include "base64.h"
+#include "token_cache.h"
+
+// base64url of an HMAC-SHA256 digest, without padding
+#define SIGNATURE_B64_LEN 43
+// Expiry of a token without an "exp" claim
+#define NEVER_EXPIRES ((time_t)LLONG_MAX)
 
 static const char *HMAC_SECRET = NULL;
+static EVP_MAC *hmac = NULL;
+
+/*
+ * Each thread keys its own HMAC context once. For every further token the context is only
+ * reset, which reuses the precomputed key schedule instead of hashing the secret again.
+ * Contexts live as long as the threads that serve requests, i.e. as long as the server.
+ */
+static _Thread_local EVP_MAC_CTX *hmac_ctx = NULL;
 
 void init_auth_or_exit() {
     HMAC_SECRET = getenv("JWT_SECRET");
     if (!HMAC_SECRET) {
         fprintf(stderr, "[FATAL] JWT_SECRET not set. Shutting down.\n");
         raise(SIGTERM);
+        return;
+    }
+
+    hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    if (!hmac) {
+        fprintf(stderr, "[FATAL] HMAC is not available. Shutting down.\n");
+        HMAC_SECRET = NULL;
+        raise(SIGTERM);
+        return;
+    }
+    token_cache_init();
+}
+
+// HMAC-SHA256 of data with the server secret. Returns 0 on success, -1 on failure.
+static int hmac_sha256(const char *data, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    if (!hmac_ctx) {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+            OSSL_PARAM_construct_end()
+        };
+        EVP_MAC_CTX *ctx = EVP_MAC_CTX_new(hmac);
+        if (!ctx || !EVP_MAC_init(ctx, (const unsigned char *)HMAC_SECRET, strlen(HMAC_SECRET), params)) {
+            EVP_MAC_CTX_free(ctx);
+            return -1;
+        }
+        hmac_ctx = ctx;
+    } else if (!EVP_MAC_init(hmac_ctx, NULL, 0, NULL)) {
+        return -1;
     }
+
+    size_t digest_len;
+    if (!EVP_MAC_update(hmac_ctx, (const unsigned char *)data, len) ||
+        !EVP_MAC_final(hmac_ctx, digest, &digest_len, SHA256_DIGEST_LENGTH)) {
+        return -1;
+    }
+    return 0;
 }
 
 char *generate_jwt(const char *username) {
+    if (!HMAC_SECRET) return NULL; // init_auth_or_exit() was not called
+
     // 1. Create header JSON string
     const char *header_json = "{\"alg\":\"HS256\",\"typ\":\"JWT\"}";
 
@@ -37,121 +92,120 @@ char *generate_jwt(const char *username) {
 
     // 3. base64url encode header and payload
     char header_b64[256], payload_b64[1024];
-    base64url_encode((const unsigned char *)header_json, strlen(header_json), header_b64, sizeof(header_b64));
-    base64url_encode((const unsigned char *)payload_json, strlen(payload_json), payload_b64, sizeof(payload_b64));
+    int header_len = base64url_encode((const unsigned char *)header_json, strlen(header_json),
+                                      header_b64, sizeof(header_b64));
+    int payload_len = base64url_encode((const unsigned char *)payload_json, strlen(payload_json),
+                                       payload_b64, sizeof(payload_b64));
     free(payload_json);
+    if (header_len < 0 || payload_len < 0) return NULL; // Claims too long for a token
 
     // 4. Create signing input = header_b64 + "." + payload_b64
-    size_t signing_input_len = strlen(header_b64) + 1 + strlen(payload_b64);
+    size_t signing_input_len = (size_t)header_len + 1 + (size_t)payload_len;
     char *signing_input = malloc(signing_input_len + 1);
+    if (!signing_input) return NULL;
     snprintf(signing_input, signing_input_len + 1, "%s.%s", header_b64, payload_b64);
 
     // 5. HMAC SHA256 sign
-    unsigned char digest[EVP_MAX_MD_SIZE];
-    unsigned int digest_len = 0;
-    HMAC(EVP_sha256(), HMAC_SECRET, strlen(HMAC_SECRET),
-         (unsigned char *)signing_input, signing_input_len,
-         digest, &digest_len);
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int signed_ok = hmac_sha256(signing_input, signing_input_len, digest) == 0;
+    free(signing_input);
+    if (!signed_ok) return NULL;
 
     // 6. base64url encode signature
-    char signature_b64[256];
-    base64url_encode(digest, digest_len, signature_b64, sizeof(signature_b64));
-
-    free(signing_input);
+    char signature_b64[SIGNATURE_B64_LEN + 1];
+    base64url_encode(digest, sizeof(digest), signature_b64, sizeof(signature_b64));
 
     // 7. Compose final JWT string
-    size_t jwt_len = strlen(header_b64) + 1 + strlen(payload_b64) + 1 + strlen(signature_b64);
+    size_t jwt_len = signing_input_len + 1 + SIGNATURE_B64_LEN;
     char *jwt = malloc(jwt_len + 1);
+    if (!jwt) return NULL;
     snprintf(jwt, jwt_len + 1, "%s.%s.%s", header_b64, payload_b64, signature_b64);
 
     return jwt;
 }
 
-/// Extracts the Bearer token value from the HTTP headers.
+/// Extracts the Bearer token from the value of an Authorization header.
 /// Returns a heap-allocated string containing the token (must be freed by caller),
-/// or NULL if the token is not found or is malformed.
-char *extract_bearer_token(const char *headers) {
-    const char *auth_prefix = "Authorization: Bearer ";
-    const char *auth_start = strstr(headers, auth_prefix);
-    if (!auth_start) return NULL;
-
-    auth_start += strlen(auth_prefix);
-    const char *line_end = strstr(auth_start, "\r\n");
-    if (!line_end) return NULL;
-
-    size_t token_len = line_end - auth_start;
-    if (token_len == 0) return NULL;
+/// or NULL if the header is missing or is not a Bearer credential.
+char *extract_bearer_token(const char *authorization, size_t len) {
+    const char *scheme = "Bearer ";
+    size_t scheme_len = strlen(scheme);
+    if (!authorization || len <= scheme_len || strncasecmp(authorization, scheme, scheme_len) != 0) return NULL;
 
+    size_t token_len = len - scheme_len;
     char *token = malloc(token_len + 1);
     if (!token) return NULL;
 
-    strncpy(token, auth_start, token_len);
+    memcpy(token, authorization + scheme_len, token_len);
     token[token_len] = '\0';
     return token;
 }
 
+/*
+ * Checks the signature and the expiry of a token of `len` bytes. The token is
+ * taken apart in place: the signing input is the token up to the second '.', so nothing is
+ * copied or allocated for the signature check.
+ */
+static bool verify_token(const char *token, size_t len, time_t now, time_t *expires) {
+    const char *first_dot = memchr(token, '.', len);
+    if (!first_dot) return false;
+    const char *second_dot = memchr(first_dot + 1, '.', len - (size_t)(first_dot + 1 - token));
+    if (!second_dot) return false;
+
+    const char *signature_b64 = second_dot + 1;
+    size_t signature_len = len - (size_t)(signature_b64 - token);
+    if (signature_len != SIGNATURE_B64_LEN || memchr(signature_b64, '.', signature_len)) return false;
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (hmac_sha256(token, (size_t)(second_dot - token), digest) != 0) return false;
+
+    // Compared as bytes in constant time, so the timing doesn't tell how much of a forgery was right
+    unsigned char signature[SHA256_DIGEST_LENGTH + 3];
+    if (base64url_decode(signature_b64, signature_len, signature, sizeof(signature)) != SHA256_DIGEST_LENGTH ||
+        CRYPTO_memcmp(signature, digest, SHA256_DIGEST_LENGTH) != 0) {
+        return false;
+    }
+
+    // Payload claims, only parsed once per token thanks to the cache
+    *expires = NEVER_EXPIRES;
+    const char *payload_b64 = first_dot + 1;
+    size_t payload_len = (size_t)(second_dot - payload_b64);
+    unsigned char payload[1024];
+    int decoded = base64url_decode(payload_b64, payload_len, payload, sizeof(payload));
+    json_error_t err;
+    json_t *json = decoded > 0 ? json_loadb((const char *)payload, (size_t)decoded, 0, &err) : NULL;
+    if (json) {
+        json_t *exp = json_object_get(json, "exp");
+        if (exp && json_is_integer(exp)) *expires = (time_t)json_integer_value(exp);
+        json_decref(json);
+    }
+
+    return now <= *expires; // Token expired otherwise
+}
+
 /// Validates the given token against an expected value.
 /// Returns true if the token is valid; false otherwise.
 bool validate_token(const char *token) {
-    if (!token) return false;
-
-    // Split token into parts
-    char *token_copy = strdup(token);
-    if (!token_copy) return false;
+    if (!token || !HMAC_SECRET) return false;
 
-    char *header_b64 = strtok(token_copy, ".");
-    char *payload_b64 = strtok(NULL, ".");
-    char *signature_b64 = strtok(NULL, ".");
+    size_t len = strlen(token);
+    time_t now = time(NULL);
 
-    if (!header_b64 || !payload_b64 || !signature_b64) {
-        free(token_copy);
-        return false;
-    }
+    // A client polling with the same token pays for one lookup instead of HMAC and JSON parsing
+    if (token_cache_lookup(token, len, now)) return true;
 
-    // Reconstruct signing input: header.payload
-    size_t signing_input_len = strlen(header_b64) + 1 + strlen(payload_b64);
-    char *signing_input = malloc(signing_input_len + 1);
-    if (!signing_input) {
-        free(token_copy);
-        return false;
-    }
-    snprintf(signing_input, signing_input_len + 1, "%s.%s", header_b64, payload_b64);
+    time_t expires;
+    if (!verify_token(token, len, now, &expires)) return false;
+    return token_cache_insert(token, len, expires) == 0; // Fails for a revoked token
+}
 
-    // Compute HMAC SHA256
-    unsigned char digest[EVP_MAX_MD_SIZE];
-    unsigned int digest_len = 0;
-    HMAC(EVP_sha256(), HMAC_SECRET, strlen(HMAC_SECRET),
-         (unsigned char *)signing_input, signing_input_len,
-         digest, &digest_len);
-
-    // Base64url encode the digest
-    char encoded_sig[256];
-    base64url_encode(digest, digest_len, encoded_sig, sizeof(encoded_sig));
-
-    // Compare with signature from token
-    bool valid = strcmp(encoded_sig, signature_b64) == 0;
-
-    // Optionally check payload claims
-    if (valid) {
-        unsigned char decoded_payload[2048];
-        if (base64url_decode(payload_b64, decoded_payload, sizeof(decoded_payload)) > 0) {
-            decoded_payload[sizeof(decoded_payload) - 1] = '\0';
-            json_error_t err;
-            json_t *json = json_loads((const char *)decoded_payload, 0, &err);
-            if (json) {
-                json_t *exp = json_object_get(json, "exp");
-                if (exp && json_is_integer(exp)) {
-                    time_t now = time(NULL);
-                    if (now > (time_t)json_integer_value(exp)) {
-                        valid = false;  // Token expired
-                    }
-                }
-                json_decref(json);
-            }
-        }
-    }
+/// Revokes a valid token for the rest of its lifetime.
+/// Returns true if it was revoked; false if it is not valid or can't be revoked.
+bool revoke_token(const char *token) {
+    if (!token || !HMAC_SECRET) return false;
 
-    free(signing_input);
-    free(token_copy);
-    return valid;
+    size_t len = strlen(token);
+    time_t expires;
+    if (!verify_token(token, len, time(NULL), &expires)) return false;
+    return token_cache_revoke(token, len, expires) == 0;
 }
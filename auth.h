@@ -1,10 +1,12 @@
 #ifndef AUTH_H
 #define AUTH_H
 #include <stdbool.h>
+#include <stddef.h>
 
 void init_auth_or_exit();
 char *generate_jwt(const char *username);
-char *extract_bearer_token(const char *headers);
+char *extract_bearer_token(const char *authorization, size_t len);
 bool validate_token(const char *token);
+bool revoke_token(const char *token);
 
 #endif
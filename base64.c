@@ -1,55 +1,108 @@
 // base64url.c
 #include "base64.h"
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
-#include <string.h>
-
-void base64url_encode(const unsigned char *in, size_t in_len, char *out, size_t out_len) {
-    BIO *b64, *bmem;
-    BUF_MEM *bptr;
-    b64 = BIO_new(BIO_f_base64());
-    bmem = BIO_new(BIO_s_mem());
-    b64 = BIO_push(b64, bmem);
-
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(b64, in, in_len);
-    BIO_flush(b64);
-    BIO_get_mem_ptr(b64, &bptr);
-
-    size_t len = bptr->length;
-    if (len >= out_len) len = out_len - 1;
-
-    strncpy(out, bptr->data, len);
-    out[len] = '\0';
-
-    // Convert base64 → base64url
-    for (size_t i = 0; i < len; ++i) {
-        if (out[i] == '+') out[i] = '-';
-        else if (out[i] == '/') out[i] = '_';
+#include <stdint.h>
+
+static const char ENCODE[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/*
+ * Sextet of every input byte, INVALID for bytes outside the base64url alphabet. Built at
+ * compile time, so the decoder needs neither an initialization call nor a branch per character:
+ * invalid bytes are collected with an OR and checked once per group.
+ */
+#define INVALID 0xFF
+#define X INVALID
+static const uint8_t DECODE[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, 62, X, X,          // '-'
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, X, X, X, X, X, X,  // '0'-'9'
+    X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,       // 'A'-'O'
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, 63, // 'P'-'Z', '_'
+    X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, // 'a'-'o'
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, X, X, X, X, X,  // 'p'-'z'
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+int base64url_encode(const unsigned char *in, size_t in_len, char *out, size_t out_len) {
+    size_t encoded_len = in_len / 3 * 4 + (in_len % 3 ? in_len % 3 + 1 : 0);
+    if (encoded_len >= out_len || encoded_len > INT32_MAX) return -1;
+
+    char *o = out;
+    size_t i = 0;
+    for (; i + 3 <= in_len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2];
+        o[0] = ENCODE[v >> 18];
+        o[1] = ENCODE[(v >> 12) & 63];
+        o[2] = ENCODE[(v >> 6) & 63];
+        o[3] = ENCODE[v & 63];
+        o += 4;
+    }
+
+    // Unpadded tail: 1 byte gives 2 characters, 2 bytes give 3
+    if (in_len - i == 1) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        *o++ = ENCODE[v >> 18];
+        *o++ = ENCODE[(v >> 12) & 63];
+    } else if (in_len - i == 2) {
+        uint32_t v = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8;
+        *o++ = ENCODE[v >> 18];
+        *o++ = ENCODE[(v >> 12) & 63];
+        *o++ = ENCODE[(v >> 6) & 63];
     }
-    while (len > 0 && out[len - 1] == '=') len--;
-    out[len] = '\0';
 
-    BIO_free_all(b64);
+    *o = '\0';
+    return (int)encoded_len;
 }
 
-int base64url_decode(const char *in, unsigned char *out, size_t out_len) {
-    char buf[1024];
-    size_t len = strlen(in);
-    strncpy(buf, in, sizeof(buf));
-    for (size_t i = 0; i < len; i++) {
-        if (buf[i] == '-') buf[i] = '+';
-        else if (buf[i] == '_') buf[i] = '/';
+int base64url_decode(const char *in, size_t in_len, unsigned char *out, size_t out_len) {
+    // Tolerate standard padding, although base64url in JWTs never has any
+    if (in_len % 4 == 0) {
+        if (in_len > 0 && in[in_len - 1] == '=') in_len--;
+        if (in_len > 0 && in[in_len - 1] == '=') in_len--;
     }
-    while (len % 4) buf[len++] = '=';
+    if (in_len % 4 == 1) return -1; // A single character can't encode a whole byte
 
-    BIO *b64 = BIO_new(BIO_f_base64());
-    BIO *bmem = BIO_new_mem_buf(buf, len);
-    b64 = BIO_push(b64, bmem);
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    size_t decoded_len = in_len / 4 * 3 + (in_len % 4 ? in_len % 4 - 1 : 0);
+    if (decoded_len > out_len || decoded_len > INT32_MAX) return -1;
+
+    const unsigned char *s = (const unsigned char *)in;
+    unsigned char *o = out;
+    uint8_t invalid = 0;
+    size_t i = 0;
+    for (; i + 4 <= in_len; i += 4) {
+        uint8_t a = DECODE[s[i]], b = DECODE[s[i + 1]], c = DECODE[s[i + 2]], d = DECODE[s[i + 3]];
+        invalid |= a | b | c | d;
+        uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | d;
+        o[0] = (unsigned char)(v >> 16);
+        o[1] = (unsigned char)(v >> 8);
+        o[2] = (unsigned char)v;
+        o += 3;
+    }
+
+    if (in_len - i >= 2) {
+        uint8_t a = DECODE[s[i]], b = DECODE[s[i + 1]];
+        uint8_t c = in_len - i == 3 ? DECODE[s[i + 2]] : 0;
+        invalid |= a | b | c;
+        uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6;
+        *o++ = (unsigned char)(v >> 16);
+        if (in_len - i == 3) *o++ = (unsigned char)(v >> 8);
+
+        // The bits past the last byte must be zero: otherwise up to 16 spellings decode to the
+        // same bytes, and a signature could be altered without invalidating it
+        uint8_t unused = in_len - i == 3 ? (uint8_t)v : (uint8_t)(v >> 8);
+        if (unused != 0) return -1;
+    }
 
-    int decoded = BIO_read(b64, out, out_len);
-    BIO_free_all(b64);
-    return decoded;
+    // Valid sextets are below 64, so bit 7 is only set if an INVALID entry was seen
+    if (invalid & 0x80) return -1;
+    return (int)decoded_len;
 }
@@ -3,7 +3,26 @@
 #define BASE64URL_H
 #include <stddef.h>
 
-int base64url_decode(const char *in, unsigned char *out, size_t out_len);
-void base64url_encode(const unsigned char *in, size_t in_len, char *out, size_t out_len);
+// Function to decode unpadded base64url (trailing '=' padding is tolerated).
+// Does not allocate and does not need `in` to be NUL-terminated.
+//
+// const char *in, size_t in_len: The encoded text.
+// unsigned char *out, size_t out_len: Buffer for the decoded bytes.
+//
+// Returns: The number of decoded bytes, or -1 if the input is not valid
+//          base64url, is not the canonical encoding (unused bits of the
+//          last character set), or the output does not fit into out_len
+//          bytes.
+int base64url_decode(const char *in, size_t in_len, unsigned char *out, size_t out_len);
 
-#endif
\ No newline at end of file
+// Function to encode bytes as unpadded base64url, followed by a NUL.
+// Does not allocate.
+//
+// const unsigned char *in, size_t in_len: The bytes to encode.
+// char *out, size_t out_len: Buffer for the text, including the NUL.
+//
+// Returns: The length of the text, or -1 if it does not fit into out_len
+//          bytes; nothing is written then.
+int base64url_encode(const unsigned char *in, size_t in_len, char *out, size_t out_len);
+
+#endif
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE // For getopt() and strcasestr()
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Open-loop load generator for the admin server.
+ *
+ * Every connection sends its requests on a fixed schedule, the configured rate spread evenly
+ * over all connections, and keeps its connection alive between them. Latency is measured from
+ * the time a request was scheduled, not from when it could actually be sent: when the server
+ * stalls, the requests that queue up behind the stall are charged for their wait, instead of
+ * silently not being sent (coordinated omission). The latency from the actual send is reported
+ * too, as service time.
+ *
+ * The results are written as one JSON object, so runs on different versions and concurrency
+ * modes can be compared by a script.
+ */
+
+#define HEAD_BUF 8192
+#define SUB_BITS 5 // 32 sub-buckets per power of two: each bucket is at most ~3% wide
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_VALUE_BITS 40 // Latencies up to 2^40 us, about 12 days
+#define BUCKETS ((MAX_VALUE_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct histogram {
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+};
+
+enum conn_state { CONN_DOWN, CONN_CONNECTING, CONN_IDLE, CONN_SENDING, CONN_READING };
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    uint64_t intended_ns; // When the next (or the current) request is due
+    uint64_t sent_ns;     // When the current request actually went out
+    size_t written;
+
+    char head[HEAD_BUF];  // Response head, the body is only counted
+    size_t head_len;
+    int head_done;
+    uint64_t body_left;
+    int status;
+    int close_after;
+};
+
+struct worker {
+    pthread_t thread;
+    size_t first_conn; // Index of its first connection among all of them
+    size_t conn_count;
+    struct conn *conns;
+
+    struct histogram latency;      // From the scheduled time, corrected for coordinated omission
+    struct histogram service_time; // From the actual send
+    uint64_t completed;
+    uint64_t non_2xx;
+    uint64_t errors;
+    uint64_t unfinished;
+    uint64_t bytes_read;
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *path;
+    const char *header;
+    const char *label;
+    const char *output;
+    size_t connections;
+    size_t threads;
+    double rate;
+    double duration_s;
+    double warmup_s;
+} opts = { "127.0.0.1", "8080", "/metrics", NULL, "", NULL, 64, 2, 1000.0, 10.0, 2.0 };
+
+static struct addrinfo *target = NULL;
+static char request[1024];
+static size_t request_len = 0;
+static uint64_t start_ns, measure_ns, end_ns, interval_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t value) {
+    if (value >= (1ULL << MAX_VALUE_BITS)) value = (1ULL << MAX_VALUE_BITS) - 1;
+    if (value < SUB_BUCKETS) return (size_t)value;
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (size_t)(shift + 1) * SUB_BUCKETS + (size_t)((value >> shift) - SUB_BUCKETS);
+}
+
+// The highest value that lands in the bucket, so percentiles never flatter
+static uint64_t bucket_top(size_t index) {
+    if (index < SUB_BUCKETS) return index;
+    int shift = (int)(index / SUB_BUCKETS) - 1;
+    return ((uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *h, uint64_t value_us) {
+    h->counts[bucket_of(value_us)]++;
+    if (h->total == 0 || value_us < h->min) h->min = value_us;
+    if (value_us > h->max) h->max = value_us;
+    h->total++;
+    h->sum += value_us;
+}
+
+static void histogram_merge(struct histogram *into, const struct histogram *h) {
+    for (size_t i = 0; i < BUCKETS; ++i) into->counts[i] += h->counts[i];
+    if (h->total > 0 && (into->total == 0 || h->min < into->min)) into->min = h->min;
+    if (h->max > into->max) into->max = h->max;
+    into->total += h->total;
+    into->sum += h->sum;
+}
+
+static uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen >= rank) return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+static void conn_watch(int epoll_fd, struct conn *c, uint32_t events, int op) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epoll_fd, op, c->fd, &ev);
+}
+
+// A connection that can't connect gives up its next request and tries again at the one after
+static void conn_down(struct worker *w, struct conn *c) {
+    w->errors++;
+    c->state = CONN_DOWN;
+    c->intended_ns += interval_ns;
+}
+
+static void conn_open(struct worker *w, int epoll_fd, struct conn *c) {
+    c->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        conn_down(w, c);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, target->ai_addr, target->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        conn_down(w, c);
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    conn_watch(epoll_fd, c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+// A connection that failed or was closed by the server: its request, if any, is lost
+static void conn_reset(struct worker *w, int epoll_fd, struct conn *c, int failed) {
+    close(c->fd);
+    c->fd = -1;
+    c->head_len = 0;
+    c->head_done = 0;
+    if (failed && c->state == CONN_CONNECTING) {
+        conn_down(w, c); // Refused, retried on schedule rather than in a loop
+        return;
+    }
+    if (failed) {
+        w->errors++;
+        if (c->state == CONN_SENDING || c->state == CONN_READING) c->intended_ns += interval_ns;
+    }
+    conn_open(w, epoll_fd, c);
+}
+
+static void conn_send(struct worker *w, int epoll_fd, struct conn *c, uint64_t now) {
+    if (c->state == CONN_IDLE) {
+        c->state = CONN_SENDING;
+        c->written = 0;
+        c->sent_ns = now;
+    }
+    while (c->written < request_len) {
+        ssize_t n = send(c->fd, request + c->written, request_len - c->written, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->written += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_watch(epoll_fd, c, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+            return;
+        }
+        conn_reset(w, epoll_fd, c, 1);
+        return;
+    }
+    c->state = CONN_READING;
+    c->head_len = 0;
+    c->head_done = 0;
+    conn_watch(epoll_fd, c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+static void conn_finish_response(struct worker *w, int epoll_fd, struct conn *c, uint64_t now) {
+    if (c->intended_ns >= measure_ns) {
+        w->completed++;
+        if (c->status < 200 || c->status > 299) w->non_2xx++;
+        histogram_record(&w->latency, (now - c->intended_ns) / 1000);
+        histogram_record(&w->service_time, (now - c->sent_ns) / 1000);
+    }
+    c->intended_ns += interval_ns;
+    c->state = CONN_IDLE;
+    if (c->close_after) conn_reset(w, epoll_fd, c, 0);
+}
+
+// Returns: 0 once the head is complete and parsed, 1 if more is needed, -1 if it is invalid
+static int parse_head(struct conn *c) {
+    char *end = memmem(c->head, c->head_len, "\r\n\r\n", 4);
+    if (!end) return c->head_len == HEAD_BUF ? -1 : 1;
+
+    *end = '\0';
+    if (sscanf(c->head, "HTTP/1.%*d %d", &c->status) != 1) return -1;
+    const char *length = strcasestr(c->head, "\r\nContent-Length:");
+    if (!length) return -1; // Streams without a length are not what this tool measures
+    c->body_left = strtoull(length + 17, NULL, 10);
+    c->close_after = strcasestr(c->head, "\r\nConnection: close") != NULL;
+
+    size_t body_bytes = c->head_len - (size_t)(end + 4 - c->head);
+    c->body_left = body_bytes >= c->body_left ? 0 : c->body_left - body_bytes;
+    c->head_done = 1;
+    return 0;
+}
+
+static void conn_read(struct worker *w, int epoll_fd, struct conn *c) {
+    char scratch[65536];
+    while (c->state == CONN_READING) {
+        char *buf = c->head_done ? scratch : c->head + c->head_len;
+        size_t room = c->head_done ? sizeof(scratch) : HEAD_BUF - c->head_len;
+        if (c->head_done && c->body_left < room) room = (size_t)c->body_left;
+
+        ssize_t n = room > 0 ? recv(c->fd, buf, room, 0) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0 && room > 0) {
+            conn_reset(w, epoll_fd, c, 1);
+            return;
+        }
+        w->bytes_read += (size_t)n;
+
+        if (!c->head_done) {
+            c->head_len += (size_t)n;
+            int status = parse_head(c);
+            if (status > 0) continue;
+            if (status < 0) {
+                conn_reset(w, epoll_fd, c, 1);
+                return;
+            }
+        } else {
+            c->body_left -= (size_t)n;
+        }
+        if (c->body_left == 0) conn_finish_response(w, epoll_fd, c, now_ns());
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev);
+
+    // Staggered, so the connections don't all fire at the same instant
+    for (size_t i = 0; i < w->conn_count; ++i) {
+        struct conn *c = &w->conns[i];
+        c->intended_ns = start_ns + (w->first_conn + i) * (interval_ns / opts.connections);
+        conn_open(w, epoll_fd, c);
+    }
+
+    struct epoll_event events[256];
+    while (1) {
+        uint64_t now = now_ns();
+        uint64_t next_due = UINT64_MAX;
+        size_t busy = 0;
+        for (size_t i = 0; i < w->conn_count; ++i) {
+            struct conn *c = &w->conns[i];
+            if (c->state == CONN_DOWN && c->intended_ns < end_ns) {
+                if (c->intended_ns <= now) conn_open(w, epoll_fd, c);
+                else if (c->intended_ns < next_due) next_due = c->intended_ns;
+            }
+            if (c->state == CONN_IDLE && c->intended_ns < end_ns) {
+                if (c->intended_ns <= now) conn_send(w, epoll_fd, c, now);
+                else if (c->intended_ns < next_due) next_due = c->intended_ns;
+            }
+            if (c->state == CONN_SENDING || c->state == CONN_READING ||
+                (c->state == CONN_CONNECTING && c->intended_ns < end_ns)) busy++;
+        }
+
+        // Past the end, responses still on their way get a grace period, then count as unfinished
+        if (now >= end_ns && (busy == 0 || now >= end_ns + 2000000000ULL)) break;
+        if (next_due == UINT64_MAX || next_due > end_ns + 2000000000ULL) next_due = end_ns + 2000000000ULL;
+
+        struct itimerspec due = { .it_value = { .tv_sec = (time_t)(next_due / 1000000000ULL),
+                                                .tv_nsec = (long)(next_due % 1000000000ULL) } };
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &due, NULL);
+
+        int n = epoll_wait(epoll_fd, events, 256, -1);
+        for (int i = 0; i < n; ++i) {
+            struct conn *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    // Already consumed
+                }
+                continue;
+            }
+            if (c->state == CONN_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    conn_reset(w, epoll_fd, c, 1);
+                    continue;
+                }
+                c->state = CONN_IDLE;
+                conn_watch(epoll_fd, c, EPOLLIN, EPOLL_CTL_MOD);
+            } else if (c->state == CONN_SENDING && (events[i].events & EPOLLOUT)) {
+                conn_send(w, epoll_fd, c, now_ns());
+            } else if (c->state == CONN_READING) {
+                conn_read(w, epoll_fd, c);
+            } else if (c->state == CONN_IDLE && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                conn_reset(w, epoll_fd, c, 0); // Closed by the server while idle
+            }
+        }
+    }
+
+    // Requests still unanswered were scheduled and are late by at least this much
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < w->conn_count; ++i) {
+        struct conn *c = &w->conns[i];
+        if ((c->state == CONN_SENDING || c->state == CONN_READING) && c->intended_ns >= measure_ns) {
+            w->unfinished++;
+            histogram_record(&w->latency, (now - c->intended_ns) / 1000);
+        }
+        if (c->fd >= 0) close(c->fd);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+    return NULL;
+}
+
+static void write_histogram(FILE *out, const char *name, const struct histogram *h) {
+    static const double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99 };
+    static const char *const labels[] = { "p50", "p75", "p90", "p99", "p99_9", "p99_99" };
+
+    fprintf(out, "  \"%s\": {\"min\": %llu, \"mean\": %.1f", name, (unsigned long long)h->min,
+            h->total ? (double)h->sum / (double)h->total : 0.0);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+        fprintf(out, ", \"%s\": %llu", labels[i], (unsigned long long)histogram_percentile(h, percentiles[i]));
+    }
+    fprintf(out, ", \"max\": %llu}", (unsigned long long)h->max);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-P path] [-H header] [-c connections] [-t threads]\n"
+            "          [-r requests/s] [-d seconds] [-w warmup seconds] [-l label] [-o output.json]\n",
+            argv0);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:P:H:c:t:r:d:w:l:o:")) != -1) {
+        switch (opt) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'P': opts.path = optarg; break;
+        case 'H': opts.header = optarg; break;
+        case 'c': opts.connections = strtoul(optarg, NULL, 10); break;
+        case 't': opts.threads = strtoul(optarg, NULL, 10); break;
+        case 'r': opts.rate = strtod(optarg, NULL); break;
+        case 'd': opts.duration_s = strtod(optarg, NULL); break;
+        case 'w': opts.warmup_s = strtod(optarg, NULL); break;
+        case 'l': opts.label = optarg; break;
+        case 'o': opts.output = optarg; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (opts.connections == 0 || opts.threads == 0 || opts.rate <= 0 || opts.duration_s <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (opts.threads > opts.connections) opts.threads = opts.connections;
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int err = getaddrinfo(opts.host, opts.port, &hints, &target);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s%s\r\n", opts.path,
+                       opts.host, opts.port, opts.header ? opts.header : "", opts.header ? "\r\n" : "");
+    if (len < 0 || (size_t)len >= sizeof(request)) {
+        fprintf(stderr, "Request too long\n");
+        return EXIT_FAILURE;
+    }
+    request_len = (size_t)len;
+
+    interval_ns = (uint64_t)((double)opts.connections * 1e9 / opts.rate);
+    start_ns = now_ns() + 100000000ULL; // Time to connect
+    measure_ns = start_ns + (uint64_t)(opts.warmup_s * 1e9);
+    end_ns = measure_ns + (uint64_t)(opts.duration_s * 1e9);
+
+    struct worker *workers = calloc(opts.threads, sizeof(*workers));
+    struct conn *conns = calloc(opts.connections, sizeof(*conns));
+    if (!workers || !conns) return EXIT_FAILURE;
+
+    size_t first = 0;
+    for (size_t i = 0; i < opts.threads; ++i) {
+        struct worker *w = &workers[i];
+        w->first_conn = first;
+        w->conn_count = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        w->conns = conns + first;
+        first += w->conn_count;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct histogram *latency = calloc(1, sizeof(*latency));
+    struct histogram *service_time = calloc(1, sizeof(*service_time));
+    uint64_t completed = 0, non_2xx = 0, errors = 0, unfinished = 0, bytes_read = 0;
+    for (size_t i = 0; i < opts.threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        histogram_merge(latency, &workers[i].latency);
+        histogram_merge(service_time, &workers[i].service_time);
+        completed += workers[i].completed;
+        non_2xx += workers[i].non_2xx;
+        errors += workers[i].errors;
+        unfinished += workers[i].unfinished;
+        bytes_read += workers[i].bytes_read;
+    }
+
+    FILE *out = opts.output ? fopen(opts.output, "w") : stdout;
+    if (!out) {
+        perror(opts.output);
+        return EXIT_FAILURE;
+    }
+    fprintf(out,
+            "{\n"
+            "  \"tool\": \"admin_loadgen\",\n"
+            "  \"label\": \"%s\",\n"
+            "  \"target\": \"%s:%s%s\",\n"
+            "  \"connections\": %zu,\n"
+            "  \"threads\": %zu,\n"
+            "  \"target_rate\": %.1f,\n"
+            "  \"duration_s\": %.1f,\n"
+            "  \"requests\": %llu,\n"
+            "  \"non_2xx\": %llu,\n"
+            "  \"errors\": %llu,\n"
+            "  \"unfinished\": %llu,\n"
+            "  \"throughput_rps\": %.1f,\n"
+            "  \"bytes_per_s\": %.1f,\n"
+            "  \"latency_unit\": \"us\",\n",
+            opts.label, opts.host, opts.port, opts.path, opts.connections, opts.threads, opts.rate,
+            opts.duration_s, (unsigned long long)completed, (unsigned long long)non_2xx,
+            (unsigned long long)errors, (unsigned long long)unfinished, (double)completed / opts.duration_s,
+            (double)bytes_read / (opts.duration_s + opts.warmup_s));
+    write_histogram(out, "latency", latency);
+    fprintf(out, ",\n");
+    write_histogram(out, "service_time", service_time);
+    fprintf(out, "\n}\n");
+    if (out != stdout) fclose(out);
+
+    freeaddrinfo(target);
+    return errors > 0 || unfinished > 0 ? 2 : 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Hot-upgrades the server three times under open-loop keep-alive load and checks that no request
+# was dropped, the service kept its PID and no descriptor leaked.
+#
+# Usage: bench/upgrade_under_load.sh <build directory> [port]
+# The loadgen report is written to upgrade_under_load.json in the build directory.
+set -u
+
+build=${1:?Usage: $0 <build directory> [port]}
+port=${2:-18080}
+rate=300
+duration=20
+
+cd "$build" || exit 1
+JWT_SECRET=${JWT_SECRET:-bench} ./ThreadedAdminServer "$port" sh -c 'while :; do echo tick; sleep 0.01; done' \
+    >upgrade_under_load.log 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null' EXIT
+sleep 1
+
+service_before=$(pgrep -P $server)
+fds_before=$(ls /proc/$server/fd | wc -l)
+
+./admin_loadgen -p "$port" -P /metrics -c 8 -t 2 -r $rate -d $duration -l upgrade \
+    -o upgrade_under_load.json &
+loadgen=$!
+for _ in 1 2 3; do
+    sleep 5
+    kill -USR2 $server
+done
+wait $loadgen
+loadgen_status=$?
+sleep 2 # Let the keep-alive connections of the load generator close
+
+service_after=$(pgrep -P $server)
+fds_after=$(ls /proc/$server/fd | wc -l)
+cat upgrade_under_load.json
+echo "service pid: $service_before -> $service_after, server fds: $fds_before -> $fds_after"
+
+[ $loadgen_status -eq 0 ] && [ "$service_before" = "$service_after" ] && [ "$fds_before" -eq "$fds_after" ]
@@ -0,0 +1,82 @@
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct server_config server_config;
+
+static size_t env_size(const char *name, size_t default_value, size_t min_value) {
+    const char *value = getenv(name);
+    if (!value || *value == '\0') return default_value;
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '\0' || parsed < min_value) {
+        fprintf(stderr, "Ignoring invalid %s=%s, using %zu\n", name, value, default_value);
+        return default_value;
+    }
+    return (size_t)parsed;
+}
+
+void load_server_config(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+
+    server_config.worker_threads = env_size("ADMIN_WORKER_THREADS", (size_t)cpus, 1);
+    server_config.worker_stack_size = env_size("ADMIN_WORKER_STACK_KB", 256, 64) * 1024;
+    server_config.work_queue_capacity = env_size("ADMIN_WORK_QUEUE_CAPACITY", 1024, 1);
+
+    server_config.reactors = env_size("ADMIN_REACTORS", 0, 0);
+    server_config.reactor_cpus = getenv("ADMIN_REACTOR_CPUS");
+    server_config.reuseport_cbpf = env_size("ADMIN_REUSEPORT_CBPF", 0, 0) != 0;
+    server_config.reserved_cpus = getenv("ADMIN_RESERVED_CPUS");
+
+    server_config.listen_backlog = env_size("ADMIN_LISTEN_BACKLOG", 1024, 1);
+    server_config.max_connections = env_size("ADMIN_MAX_CONNECTIONS", 4096, 0);
+    server_config.rate_limit_rps = env_size("ADMIN_RATE_LIMIT_RPS", 0, 0);
+    server_config.rate_limit_burst = env_size("ADMIN_RATE_LIMIT_BURST", server_config.rate_limit_rps * 2, 1);
+    server_config.rate_limit_clients = env_size("ADMIN_RATE_LIMIT_CLIENTS", 16384, 64);
+
+    server_config.header_timeout_ms = env_size("ADMIN_HEADER_TIMEOUT_MS", 10000, 1);
+    server_config.body_timeout_ms = env_size("ADMIN_BODY_TIMEOUT_MS", 30000, 1);
+    server_config.keepalive_timeout_ms = env_size("ADMIN_KEEPALIVE_TIMEOUT_MS", 5000, 1);
+    server_config.keepalive_max_requests = env_size("ADMIN_KEEPALIVE_MAX_REQUESTS", 1000, 1);
+    server_config.max_idle_connections = env_size("ADMIN_MAX_IDLE_CONNECTIONS", 10000, 0);
+
+    server_config.max_header_bytes = env_size("ADMIN_MAX_HEADER_BYTES", 8192, 256);
+    server_config.max_body_bytes = env_size("ADMIN_MAX_BODY_BYTES", 1024 * 1024, 0);
+    server_config.max_upload_bytes = env_size("ADMIN_MAX_UPLOAD_BYTES", 256 * 1024 * 1024, 0);
+
+    server_config.compress_min_bytes = env_size("ADMIN_COMPRESS_MIN_BYTES", 1024, 0);
+    server_config.send_timeout_ms = env_size("ADMIN_SEND_TIMEOUT_MS", 10000, 1);
+    server_config.zerocopy_min_bytes = env_size("ADMIN_ZEROCOPY_MIN_BYTES", 64 * 1024, 0);
+    server_config.files_dir = getenv("ADMIN_FILES_DIR");
+
+    server_config.tls_cert = getenv("ADMIN_TLS_CERT");
+    server_config.tls_key = getenv("ADMIN_TLS_KEY");
+    server_config.tls_session_cache = env_size("ADMIN_TLS_SESSION_CACHE", 20480, 0);
+    server_config.tls_session_timeout_s = env_size("ADMIN_TLS_SESSION_TIMEOUT_S", 3600, 1);
+
+    server_config.metrics_interval_ms = env_size("ADMIN_METRICS_INTERVAL_MS", 1000, 10);
+    server_config.metrics_history_file = getenv("ADMIN_METRICS_HISTORY_FILE");
+    server_config.metrics_thread_cpu = env_size("ADMIN_METRICS_THREAD_CPU", 0, 0) != 0;
+
+    server_config.log_buffer_bytes = env_size("ADMIN_LOG_BUFFER_KB", 1024, 16) * 1024;
+
+    server_config.services_file = getenv("ADMIN_SERVICES_FILE");
+    server_config.restart_backoff_ms = env_size("ADMIN_RESTART_BACKOFF_MS", 100, 1);
+    server_config.restart_backoff_max_ms = env_size("ADMIN_RESTART_BACKOFF_MAX_MS", 30000, 1);
+    if (server_config.restart_backoff_max_ms < server_config.restart_backoff_ms) {
+        server_config.restart_backoff_max_ms = server_config.restart_backoff_ms;
+    }
+    server_config.service_stop_timeout_ms = env_size("ADMIN_SERVICE_STOP_TIMEOUT_MS", 10000, 0);
+
+    server_config.drain_timeout_ms = env_size("ADMIN_DRAIN_TIMEOUT_MS", 10000, 0);
+
+    server_config.rebuild_command = getenv("ADMIN_REBUILD_COMMAND");
+    server_config.job_workers = env_size("ADMIN_JOB_WORKERS", 1, 1);
+    server_config.job_queue_capacity = env_size("ADMIN_JOB_QUEUE_CAPACITY", 16, 1);
+    server_config.job_output_bytes = env_size("ADMIN_JOB_OUTPUT_KB", 1024, 1) * 1024;
+}
@@ -0,0 +1,73 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h> // For size_t
+
+/*
+ * Runtime tunables of the admin server. Like JWT_SECRET and AUTH_USERNAME they are read from
+ * the environment, so the command line stays "<port> <service> [service args...]".
+ */
+struct server_config {
+    size_t worker_threads;      // ADMIN_WORKER_THREADS, default: number of online CPUs
+    size_t worker_stack_size;   // ADMIN_WORKER_STACK_KB, default: 256 KB
+    size_t work_queue_capacity; // ADMIN_WORK_QUEUE_CAPACITY, default: 1024 (rounded up to a power of two)
+
+    size_t reactors;           // ADMIN_REACTORS, default: 0 (one accept loop feeding the worker pool)
+    const char *reactor_cpus;  // ADMIN_REACTOR_CPUS, e.g. "0-3", default: the CPUs left to the admin server
+    int reuseport_cbpf;        // ADMIN_REUSEPORT_CBPF, default: 0 (the kernel hashes connections to reactors), ignored when reactors share a CPU
+    const char *reserved_cpus; // ADMIN_RESERVED_CPUS, e.g. "4-7", default: none (the service's, kept free of admin threads)
+
+    size_t listen_backlog;     // ADMIN_LISTEN_BACKLOG, default: 1024 (capped by net.core.somaxconn)
+    size_t max_connections;    // ADMIN_MAX_CONNECTIONS, default: 4096 open at once (0: unlimited), more get a 503
+    size_t rate_limit_rps;     // ADMIN_RATE_LIMIT_RPS, default: 0 (off), requests per second per client address
+    size_t rate_limit_burst;   // ADMIN_RATE_LIMIT_BURST, default: twice ADMIN_RATE_LIMIT_RPS
+    size_t rate_limit_clients; // ADMIN_RATE_LIMIT_CLIENTS, default: 16384 client addresses tracked
+
+    size_t header_timeout_ms;      // ADMIN_HEADER_TIMEOUT_MS, default: 10000 (for a whole request head, TLS handshake included)
+    size_t body_timeout_ms;        // ADMIN_BODY_TIMEOUT_MS, default: 30000 (without receiving any of a request body)
+    size_t keepalive_timeout_ms;   // ADMIN_KEEPALIVE_TIMEOUT_MS, default: 5000
+    size_t keepalive_max_requests; // ADMIN_KEEPALIVE_MAX_REQUESTS, default: 1000 requests per connection
+    size_t max_idle_connections;   // ADMIN_MAX_IDLE_CONNECTIONS, default: 10000
+
+    size_t max_header_bytes; // ADMIN_MAX_HEADER_BYTES, default: 8192 (request line and headers)
+    size_t max_body_bytes;   // ADMIN_MAX_BODY_BYTES, default: 1 MB (bodies buffered in memory)
+    size_t max_upload_bytes; // ADMIN_MAX_UPLOAD_BYTES, default: 256 MB (bodies streamed to a handler)
+
+    size_t compress_min_bytes; // ADMIN_COMPRESS_MIN_BYTES, default: 1024 (smaller bodies are sent uncompressed)
+    size_t send_timeout_ms;    // ADMIN_SEND_TIMEOUT_MS, default: 10000 (for a client to take a whole response)
+    size_t zerocopy_min_bytes; // ADMIN_ZEROCOPY_MIN_BYTES, default: 65536 (smaller ones are copied, 0: never zerocopy)
+    const char *files_dir;     // ADMIN_FILES_DIR, default: none (GET /files/{name} answers 404)
+
+    const char *tls_cert;         // ADMIN_TLS_CERT, PEM certificate chain, default: none (plaintext HTTP)
+    const char *tls_key;          // ADMIN_TLS_KEY, PEM private key, default: none
+    size_t tls_session_cache;     // ADMIN_TLS_SESSION_CACHE, default: 20480 sessions kept for resumption
+    size_t tls_session_timeout_s; // ADMIN_TLS_SESSION_TIMEOUT_S, default: 3600 (for cached sessions and tickets)
+
+    size_t metrics_interval_ms;       // ADMIN_METRICS_INTERVAL_MS, default: 1000
+    const char *metrics_history_file; // ADMIN_METRICS_HISTORY_FILE, default: none (history kept in memory only)
+    int metrics_thread_cpu;           // ADMIN_METRICS_THREAD_CPU, default: 0 (no per-thread-name CPU breakdown)
+
+    size_t log_buffer_bytes; // ADMIN_LOG_BUFFER_KB, default: 1024 KB per output stream (rounded up to a power of two)
+
+    const char *services_file;        // ADMIN_SERVICES_FILE, default: none (only the service from the command line)
+    size_t restart_backoff_ms;        // ADMIN_RESTART_BACKOFF_MS, default: 100 (delay before the first restart)
+    size_t restart_backoff_max_ms;    // ADMIN_RESTART_BACKOFF_MAX_MS, default: 30000
+    size_t service_stop_timeout_ms;   // ADMIN_SERVICE_STOP_TIMEOUT_MS, default: 10000 (from SIGTERM to SIGKILL on shutdown)
+
+    size_t drain_timeout_ms; // ADMIN_DRAIN_TIMEOUT_MS, default: 10000 (for requests in flight on shutdown and upgrade)
+
+    const char *rebuild_command; // ADMIN_REBUILD_COMMAND, run with /bin/sh -c, default: none (rebuilds answer 503)
+    size_t job_workers;          // ADMIN_JOB_WORKERS, default: 1 (jobs running at the same time)
+    size_t job_queue_capacity;   // ADMIN_JOB_QUEUE_CAPACITY, default: 16 (rounded up to a power of two)
+    size_t job_output_bytes;     // ADMIN_JOB_OUTPUT_KB, default: 1024 KB kept per job, the rest is dropped
+};
+
+extern struct server_config server_config;
+
+// Function to fill server_config from the environment.
+// Unset variables take their defaults, invalid values are reported on stderr
+// and replaced by the default as well. Call once at startup, before any
+// thread is started.
+void load_server_config(void);
+
+#endif // CONFIG_H
@@ -0,0 +1,546 @@
+#include "connection.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h> // For offsetof()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "config.h"
+#include "event_loop.h"
+#include "http_parser.h"
+#include "request.h"
+#include "response.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+#include "timer_wheel.h"
+#include "tls.h"
+
+#define CLIENT_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+/*
+ * A persistent client connection. Exactly one party owns it at any time:
+ *   - while it is idle, the loop (it sits in the idle list and is armed in epoll),
+ *   - while it is being served, the worker running connection_process().
+ * EPOLLONESHOT guarantees the handover: a readable event disarms the socket, so a second
+ * worker can't pick up the same connection while the first one is still writing responses.
+ */
+struct connection {
+    int fd;
+    struct connection_group *group;
+    struct client_addr client; // Whose token bucket its requests are charged to
+    unsigned requests_served;
+
+    struct connection *idle_prev;
+    struct connection *idle_next;
+    struct timer_node timer;              // Pending exactly while the connection is in the idle list
+    enum telemetry_timeout timeout_phase; // What the timer is waiting for, see watch_deadline_ms()
+    long long head_started_ms;            // Since when the next request head is awaited, 0 while idle
+
+    struct http_parser parser; // State of the request at the start of buf
+    int reading_body;          // The head was handled, buf now starts inside its body
+    int keep_alive;            // Decided by the handler, applied once the body is consumed
+    int detached;              // The socket was handed over by connection_detach()
+    int handshaking;           // TLS handshake not completed yet, nothing to answer in plaintext
+    struct http_body_decoder body_decoder;
+    struct request_body body;  // on_complete is NULL when the body is skipped
+    struct request_telemetry telemetry;
+
+    size_t len;
+    size_t capacity;           // ADMIN_MAX_HEADER_BYTES: a complete request head always fits
+    char buf[];
+};
+
+/*
+ * The connections of one event loop. Idle ones, those parked in epoll waiting for the client,
+ * are kept in the order they became idle, so evicting the oldest when there are too many is
+ * O(1). Their deadlines differ with what they wait for (a request head, more of a body, the next
+ * request), so the list is not sorted by expiry: each also has a timer in the group's wheel,
+ * started and stopped in O(1) every time it is parked and picked up again. A client that trickles
+ * its request in a byte at a time costs one timer, and is closed when the head or body timeout
+ * runs out however busy it keeps the socket.
+ */
+struct connection_group {
+    struct event_loop *loop;
+    struct thread_pool *pool; // NULL: requests are served on the loop thread itself
+    size_t max_idle;          // This group's share of ADMIN_MAX_IDLE_CONNECTIONS
+
+    pthread_mutex_t idle_lock;
+    struct connection *idle_head;
+    struct connection *idle_tail;
+    size_t idle_count;
+    struct timer_wheel timers; // In ticks of CONNECTION_TIMER_TICK_MS
+};
+
+// Opened by the loops, closed by whichever thread owns the connection at the time
+static atomic_size_t open_connections = 0;
+
+// Set for a shutdown or upgrade: connections close after the request they are serving
+static atomic_int draining = 0;
+
+// The connection whose requests the calling thread is serving, for connection_detach()
+static _Thread_local struct connection *serving = NULL;
+
+static uint64_t timer_tick(long long ms) {
+    return (uint64_t)ms / CONNECTION_TIMER_TICK_MS;
+}
+
+static struct connection *timer_connection(struct timer_node *node) {
+    return (struct connection *)((char *)node - offsetof(struct connection, timer));
+}
+
+/*
+ * When a parked connection is timed out, by what it waits for:
+ *   - a request head: ADMIN_HEADER_TIMEOUT_MS after its first byte (after the accept for the
+ *     first request, so the TLS handshake counts too), however many reads it took so far,
+ *   - more of a body: ADMIN_BODY_TIMEOUT_MS after the last read,
+ *   - the next request: ADMIN_KEEPALIVE_TIMEOUT_MS after the last one.
+ */
+static long long watch_deadline_ms(struct connection *conn, long long now_ms) {
+    if (conn->reading_body) {
+        conn->timeout_phase = TELEMETRY_TIMEOUT_BODY;
+        return now_ms + (long long)server_config.body_timeout_ms;
+    }
+    if (conn->head_started_ms == 0 && conn->len > 0) conn->head_started_ms = now_ms;
+    if (conn->head_started_ms != 0) {
+        conn->timeout_phase = TELEMETRY_TIMEOUT_HEADER;
+        return conn->head_started_ms + (long long)server_config.header_timeout_ms;
+    }
+    conn->timeout_phase = TELEMETRY_TIMEOUT_IDLE;
+    return now_ms + (long long)server_config.keepalive_timeout_ms;
+}
+
+// Adds the connection to the idle list and starts its timer. Call with idle_lock held.
+static void connection_watch(struct connection *conn, long long deadline_ms) {
+    struct connection_group *group = conn->group;
+    conn->idle_prev = group->idle_tail;
+    conn->idle_next = NULL;
+    if (group->idle_tail) group->idle_tail->idle_next = conn;
+    else group->idle_head = conn;
+    group->idle_tail = conn;
+    group->idle_count++;
+
+    // Rounded up, a timer never fires before its deadline
+    timer_wheel_add(&group->timers, &conn->timer, timer_tick(deadline_ms + CONNECTION_TIMER_TICK_MS - 1));
+}
+
+// Takes the connection out of the idle list and stops its timer, if it is idle. Call with idle_lock held.
+static void connection_unwatch(struct connection *conn) {
+    struct connection_group *group = conn->group;
+    if (!timer_node_pending(&conn->timer)) return;
+    timer_wheel_remove(&conn->timer);
+
+    if (conn->idle_prev) conn->idle_prev->idle_next = conn->idle_next;
+    else group->idle_head = conn->idle_next;
+    if (conn->idle_next) conn->idle_next->idle_prev = conn->idle_prev;
+    else group->idle_tail = conn->idle_prev;
+
+    conn->idle_prev = conn->idle_next = NULL;
+    group->idle_count--;
+}
+
+static void connection_close(struct connection *conn) {
+    if (conn->body.on_abort) conn->body.on_abort(conn->body.ctx);
+    telemetry_request_finish(&conn->telemetry); // A request cut short still counts
+    telemetry_connection_closed();
+    atomic_fetch_sub_explicit(&open_connections, 1, memory_order_relaxed);
+    if (!conn->detached) {
+        tls_close(conn->fd);
+        close(conn->fd); // Also removes the fd from the epoll set
+    }
+    free(conn);
+}
+
+static void connection_process(void *arg);
+
+static void on_connection_ready(struct event_loop *loop, int client_fd, uint32_t events, void *arg) {
+    struct connection *conn = arg;
+    struct connection_group *group = conn->group;
+
+    pthread_mutex_lock(&group->idle_lock);
+    connection_unwatch(conn);
+    pthread_mutex_unlock(&group->idle_lock);
+
+    if (!group->pool) {
+        connection_process(conn);
+        return;
+    }
+    if (thread_pool_submit(group->pool, connection_process, conn) != 0) {
+        // Backpressure: every worker is busy and the queue is full, shed instead of piling up
+        if (!conn->handshaking) send_503(client_fd);
+        telemetry_connection_shed();
+        connection_close(conn);
+    }
+}
+
+/*
+ * Hands the connection back to the loop. It has to be in the idle list before the socket is
+ * rearmed: once rearmed, the loop may report it readable (and take it out of the list again)
+ * at any moment. Both happen under idle_lock, so the sweep never sees a connection that is
+ * listed but not armed yet, which it would close and free while this worker still uses it.
+ * A connection already past its deadline, a request head trickled in too slowly, is closed
+ * right here instead.
+ */
+static void connection_park(struct connection *conn) {
+    struct connection_group *group = conn->group;
+    long long now_ms = monotonic_ms();
+    long long deadline_ms = watch_deadline_ms(conn, now_ms);
+    if (deadline_ms <= now_ms) {
+        telemetry_connection_timeout(conn->timeout_phase);
+        connection_close(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&group->idle_lock);
+    connection_watch(conn, deadline_ms);
+    if (event_loop_rearm(group->loop, conn->fd, CLIENT_EVENTS) != 0) {
+        connection_unwatch(conn);
+        pthread_mutex_unlock(&group->idle_lock);
+        connection_close(conn);
+        return;
+    }
+    pthread_mutex_unlock(&group->idle_lock);
+}
+
+// Returned by receive_body() when the body consumer gave up, it already answered if it wanted to
+#define BODY_ABORTED_BY_HANDLER (-100)
+
+static void reject_request(int client_fd, int parse_status) {
+    if (parse_status == HTTP_PARSE_HEAD_TOO_LARGE) send_431(client_fd);
+    else if (parse_status == HTTP_PARSE_VERSION_UNSUPPORTED) send_505(client_fd);
+    else if (parse_status == HTTP_PARSE_BODY_TOO_LARGE) send_413(client_fd);
+    else if (parse_status == HTTP_PARSE_NOT_IMPLEMENTED) send_501(client_fd);
+    else send_400(client_fd);
+}
+
+static int expects_continue(const struct http_request *req) {
+    struct http_slice expect = http_request_header(req, "Expect");
+    return req->minor_version >= 1 && expect.len == 12 && strncasecmp(expect.data, "100-continue", 12) == 0;
+}
+
+/*
+ * Runs the handler for a complete head and prepares for its body.
+ * Returns: 0 if the connection goes on with the body (possibly empty), -1 if it must be
+ *          closed right away.
+ */
+static int start_request(struct connection *conn, const struct http_request *req) {
+    int status = http_body_decoder_init(&conn->body_decoder, req);
+    if (status != 0) {
+        reject_request(conn->fd, status);
+        return -1;
+    }
+
+    conn->body = (struct request_body){ 0 };
+    conn->keep_alive = handle_request(conn->fd, req, &conn->body);
+    int has_body = !http_body_decoder_done(&conn->body_decoder);
+
+    if (conn->body.on_complete) {
+        status = http_body_decoder_set_limit(&conn->body_decoder, conn->body.max_len);
+        if (status != 0) {
+            // Known to be too large from Content-Length alone, don't read any of it
+            reject_request(conn->fd, status);
+            return -1;
+        }
+        if (has_body && expects_continue(req)) send_100_continue(conn->fd);
+    } else if (has_body) {
+        /*
+         * The response is already out, the body only has to be skipped to reach the next
+         * request. A client waiting for "100 Continue" won't send it at all, and a large
+         * body is cheaper to cut off than to read.
+         */
+        if (!conn->keep_alive || expects_continue(req)) return -1;
+        http_body_decoder_set_limit(&conn->body_decoder, server_config.max_body_bytes);
+    }
+
+    conn->reading_body = 1;
+    return 0;
+}
+
+/*
+ * Feeds the buffered body bytes to the consumer, straight out of the receive buffer.
+ * Returns: HTTP_BODY_DONE, HTTP_BODY_INCOMPLETE, BODY_ABORTED_BY_HANDLER or a negative
+ *          http_parse_status.
+ */
+static int receive_body(struct connection *conn, size_t *offset) {
+    while (!http_body_decoder_done(&conn->body_decoder)) {
+        if (*offset == conn->len) return HTTP_BODY_INCOMPLETE;
+
+        size_t used, piece_len;
+        const char *piece;
+        int status = http_body_decoder_execute(&conn->body_decoder, conn->buf + *offset, conn->len - *offset,
+                                               &used, &piece, &piece_len);
+        if (status < 0) return status;
+        *offset += used;
+        telemetry_request_body(&conn->telemetry, used);
+
+        if (piece_len > 0 && conn->body.on_data && conn->body.on_data(conn->body.ctx, piece, piece_len) != 0) {
+            return BODY_ABORTED_BY_HANDLER;
+        }
+    }
+    return HTTP_BODY_DONE;
+}
+
+static void finish_request(struct connection *conn) {
+    struct request_body body = conn->body;
+
+    // Cleared first: from here on the consumer owns ctx, connection_close() must not abort it
+    conn->body = (struct request_body){ 0 };
+    conn->reading_body = 0;
+    if (body.on_complete) body.on_complete(conn->fd, body.ctx);
+    telemetry_request_finish(&conn->telemetry);
+}
+
+/*
+ * Serves every complete request that is already buffered, in order. A client may pipeline
+ * several requests into one segment; answering them one after another on the same socket
+ * keeps the responses in request order, as HTTP/1.1 requires.
+ *
+ * Returns: 1 if the connection stays open, 0 if it must be closed.
+ */
+static int serve_buffered(struct connection *conn) {
+    size_t offset = 0;
+    int keep_alive = 1;
+
+    // Responses written from here on, by handlers too, are accounted to this connection's request
+    telemetry_bind(&conn->telemetry);
+    serving = conn;
+
+    while (keep_alive) {
+        if (conn->reading_body) {
+            int status = receive_body(conn, &offset);
+            if (status == HTTP_BODY_INCOMPLETE) break;
+            if (status != HTTP_BODY_DONE) {
+                // A skipped body belongs to a request that was already answered
+                if (conn->body.on_complete && status != BODY_ABORTED_BY_HANDLER) reject_request(conn->fd, status);
+                keep_alive = 0;
+                break;
+            }
+
+            finish_request(conn);
+            keep_alive = conn->keep_alive;
+            conn->requests_served++;
+            if (conn->requests_served >= server_config.keepalive_max_requests) keep_alive = 0;
+            if (atomic_load_explicit(&draining, memory_order_relaxed)) keep_alive = 0;
+            continue;
+        }
+
+        if (offset == conn->len) break;
+
+        // Only the bytes after the parser's position are scanned, earlier reads are not re-parsed
+        int status = http_parser_execute(&conn->parser, conn->buf + offset, conn->len - offset);
+        if (status == HTTP_PARSE_INCOMPLETE) break;
+        if (status != HTTP_PARSE_DONE) {
+            // Rejected before any handler runs, the rest of the stream can't be trusted
+            telemetry_request_start(&conn->telemetry, conn->len - offset);
+            reject_request(conn->fd, status);
+            keep_alive = 0;
+            break;
+        }
+
+        struct http_request req;
+        http_parser_result(&conn->parser, conn->buf + offset, &req);
+        telemetry_request_start(&conn->telemetry, req.head_len);
+        conn->head_started_ms = 0;
+
+        unsigned retry_after_s = admission_charge_request(&conn->client);
+        if (retry_after_s > 0) {
+            send_429(conn->fd, retry_after_s);
+            keep_alive = 0;
+            break;
+        }
+        if (start_request(conn, &req) != 0 || conn->detached) keep_alive = 0;
+
+        offset += req.head_len;
+        http_parser_init(&conn->parser, conn->capacity);
+    }
+
+    // Keep a partially received request for the next read, the parser state stays valid
+    // because it only records offsets from the start of the request
+    memmove(conn->buf, conn->buf + offset, conn->len - offset);
+    conn->len -= offset;
+    telemetry_bind(NULL);
+    serving = NULL;
+    return keep_alive;
+}
+
+static void connection_process(void *arg) {
+    struct connection *conn = arg;
+    int peer_closed = 0;
+    int keep_alive;
+    int buffer_full;
+
+    /*
+     * The handshake runs in steps, one per flight the client sends, and the connection is
+     * parked in between like any idle one: a client that stalls mid-handshake holds no worker
+     * and is timed out like one that stalls in its request head.
+     */
+    if (conn->handshaking) {
+        int status = tls_handshake(conn->fd);
+        if (status < 0) {
+            connection_close(conn);
+            return;
+        }
+        if (status == 0) {
+            connection_park(conn);
+            return;
+        }
+        conn->handshaking = 0;
+    }
+
+    /*
+     * A body larger than the buffer arrives in several rounds. As long as the buffer was
+     * filled completely there may be more waiting in the socket, so the worker keeps going
+     * instead of paying an epoll round trip for every buffer of an upload.
+     */
+    do {
+        // Drain what the socket has right now; MSG_DONTWAIT so a slow client never blocks a worker
+        while (conn->len < conn->capacity) {
+            ssize_t n = tls_recv(conn->fd, conn->buf + conn->len, conn->capacity - conn->len);
+            if (n > 0) {
+                conn->len += (size_t)n;
+                continue;
+            }
+            if (n == 0) peer_closed = 1;
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) peer_closed = 1;
+            break;
+        }
+        buffer_full = conn->len == conn->capacity;
+
+        keep_alive = serve_buffered(conn);
+    } while (keep_alive && buffer_full && !peer_closed);
+
+    if (!keep_alive || peer_closed) {
+        connection_close(conn);
+        return;
+    }
+
+    connection_park(conn);
+}
+
+struct connection_group *connection_group_create(struct event_loop *loop, struct thread_pool *pool, size_t groups) {
+    struct connection_group *group = calloc(1, sizeof(*group));
+    if (!group) return NULL;
+
+    group->loop = loop;
+    group->pool = pool;
+    group->max_idle = server_config.max_idle_connections / (groups ? groups : 1);
+    if (group->max_idle == 0 && server_config.max_idle_connections > 0) group->max_idle = 1;
+    pthread_mutex_init(&group->idle_lock, NULL);
+    timer_wheel_init(&group->timers, timer_tick(monotonic_ms()));
+    return group;
+}
+
+void connections_drain(int enable) {
+    atomic_store_explicit(&draining, enable, memory_order_relaxed);
+}
+
+size_t connections_open_count(void) {
+    return atomic_load_explicit(&open_connections, memory_order_relaxed);
+}
+
+int connection_open(struct connection_group *group, int client_fd, const struct client_addr *client) {
+    size_t capacity = server_config.max_header_bytes;
+    struct connection *conn = malloc(sizeof(*conn) + capacity);
+    if (!conn) {
+        close(client_fd);
+        return -1;
+    }
+    telemetry_connection_opened();
+    atomic_fetch_add_explicit(&open_connections, 1, memory_order_relaxed);
+    conn->fd = client_fd;
+    conn->group = group;
+    conn->client = *client;
+    conn->requests_served = 0;
+    conn->idle_prev = conn->idle_next = NULL;
+    timer_node_init(&conn->timer);
+    conn->head_started_ms = monotonic_ms();
+    conn->len = 0;
+    conn->capacity = capacity;
+    conn->reading_body = 0;
+    conn->detached = 0;
+    conn->handshaking = tls_enabled();
+    conn->body = (struct request_body){ 0 };
+    conn->telemetry = (struct request_telemetry){ 0 };
+    http_parser_init(&conn->parser, capacity);
+
+    // Every response leaves in one sendmsg(), Nagle's algorithm could only hold back its tail.
+    // A response sent in parts marks all but the last with MSG_MORE instead.
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (conn->handshaking && tls_accept(client_fd) != 0) {
+        connection_close(conn);
+        return -1;
+    }
+
+    // The socket is idle until the client sends its request, it costs no thread until then
+    pthread_mutex_lock(&group->idle_lock);
+    connection_watch(conn, watch_deadline_ms(conn, conn->head_started_ms));
+    if (event_loop_add(group->loop, client_fd, CLIENT_EVENTS, on_connection_ready, conn) != 0) {
+        perror("epoll_ctl");
+        connection_unwatch(conn);
+        pthread_mutex_unlock(&group->idle_lock);
+        connection_close(conn);
+        return -1;
+    }
+    pthread_mutex_unlock(&group->idle_lock);
+    return 0;
+}
+
+/*
+ * The socket is taken out of the loop's epoll set before it changes hands. It is disarmed
+ * (EPOLLONESHOT fired to get here), so the loop holds no event for it, and once removed it
+ * won't report any; the connection itself is freed as usual when its worker is done.
+ */
+int connection_detach(void) {
+    struct connection *conn = serving;
+    if (!conn || conn->detached) return -1;
+
+    if (event_loop_remove(conn->group->loop, conn->fd) != 0) return -1;
+    conn->detached = 1;
+    return conn->fd;
+}
+
+/*
+ * Idle connections are only ever closed here, on the loop thread of their group, between two
+ * epoll_wait() calls. That way the loop can never be holding an already reported event for a
+ * connection that was freed behind its back.
+ */
+void connections_sweep_idle(struct event_loop *loop, void *arg) {
+    struct connection_group *group = arg;
+    int close_all = atomic_load_explicit(&draining, memory_order_relaxed);
+
+    struct timer_node expired;
+    timer_list_init(&expired);
+    pthread_mutex_lock(&group->idle_lock);
+    timer_wheel_advance(&group->timers, timer_tick(monotonic_ms()), &expired);
+    while (expired.next != &expired) {
+        struct connection *conn = timer_connection(expired.next);
+        connection_unwatch(conn);
+        pthread_mutex_unlock(&group->idle_lock);
+
+        telemetry_connection_timeout(conn->timeout_phase);
+        connection_close(conn);
+        pthread_mutex_lock(&group->idle_lock);
+    }
+
+    while (group->idle_head && (close_all || group->idle_count > group->max_idle)) {
+        struct connection *conn = group->idle_head;
+        connection_unwatch(conn);
+        pthread_mutex_unlock(&group->idle_lock);
+
+        connection_close(conn);
+        pthread_mutex_lock(&group->idle_lock);
+    }
+    pthread_mutex_unlock(&group->idle_lock);
+}
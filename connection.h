@@ -0,0 +1,58 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h> // For size_t
+
+#define CONNECTION_TIMER_TICK_MS 100 // Resolution of the connection timeouts
+
+struct client_addr;
+struct connection_group;
+struct event_loop;
+struct thread_pool;
+
+// Function to set up the connections of one event loop.
+//
+// struct thread_pool *pool: Where requests of readable connections are
+//                           executed, or NULL to execute them on the loop
+//                           thread itself.
+// size_t groups: How many groups there are, each gets its share of
+//                ADMIN_MAX_IDLE_CONNECTIONS.
+// Returns: The group, or NULL if it could not be allocated.
+struct connection_group *connection_group_create(struct event_loop *loop, struct thread_pool *pool, size_t groups);
+
+// Function to take ownership of a freshly accepted client socket and start
+// watching it on the loop of `group`. The socket is closed on failure.
+//
+// const struct client_addr *client: The peer, its requests are rate limited
+//                                   by this address.
+// Returns: 0 on success, -1 if the connection could not be registered.
+int connection_open(struct connection_group *group, int client_fd, const struct client_addr *client);
+
+// Function to count the client connections currently open, idle or busy.
+size_t connections_open_count(void);
+
+// Function to wind the connections down for a shutdown or an upgrade: once
+// enabled, a connection is closed after the response it is sending, and idle
+// ones are closed by the next sweep. Disabling it (an upgrade that failed)
+// keeps connections alive again.
+void connections_drain(int enable);
+
+// Function to take the socket of the request being served by the calling
+// thread away from the connection layer, for responses that outlive the
+// request such as event streams. Only valid while a handler runs. The
+// connection stops watching the socket and is released without closing it
+// once the handler returns; requests pipelined after this one are dropped.
+//
+// Returns: The socket, owned by the caller from now on, or -1 on failure.
+int connection_detach(void);
+
+// Function to close the connections that timed out waiting for the client:
+// for a request head (ADMIN_HEADER_TIMEOUT_MS), for more of a body
+// (ADMIN_BODY_TIMEOUT_MS) or for the next request on a kept alive connection
+// (ADMIN_KEEPALIVE_TIMEOUT_MS), and the oldest idle ones while there are more
+// than the group's maximum. While draining, every idle connection is closed.
+// Must be called every CONNECTION_TIMER_TICK_MS from the loop thread, with
+// the group as `arg`.
+void connections_sweep_idle(struct event_loop *loop, void *arg);
+
+#endif // CONNECTION_H
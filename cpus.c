@@ -0,0 +1,115 @@
+#define _GNU_SOURCE // For cpu_set_t and sched_setaffinity()
+#include "cpus.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+static cpu_set_t started_with; // The affinity the server was started with, for the services
+static cpu_set_t admin_cpus;   // What is left to the admin server
+static int reactor_cpus[CPU_SETSIZE];
+static size_t reactor_cpu_count = 0;
+
+/*
+ * Parses a list in the format of /sys/devices/system/cpu/online and taskset -c: "0-3,8,10-11".
+ * Returns: 0 on success, -1 if it is malformed or names a CPU beyond CPU_SETSIZE.
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set, int *order, size_t *count) {
+    CPU_ZERO(set);
+    if (count) *count = 0;
+
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (order && !CPU_ISSET(cpu, set)) order[(*count)++] = (int)cpu;
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return 0;
+}
+
+int cpus_init(void) {
+    if (sched_getaffinity(0, sizeof(started_with), &started_with) != 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    admin_cpus = started_with;
+
+    cpu_set_t set;
+    const char *reserved = server_config.reserved_cpus;
+    if (reserved && *reserved) {
+        if (parse_cpu_list(reserved, &set, NULL, NULL) != 0) {
+            fprintf(stderr, "Ignoring invalid ADMIN_RESERVED_CPUS=%s\n", reserved);
+        } else {
+            cpu_set_t remaining;
+            CPU_XOR(&remaining, &started_with, &set);
+            CPU_AND(&remaining, &remaining, &started_with);
+            if (CPU_COUNT(&remaining) == 0) {
+                fprintf(stderr, "Ignoring ADMIN_RESERVED_CPUS=%s, it leaves no CPU to the admin server\n", reserved);
+            } else if (sched_setaffinity(0, sizeof(remaining), &remaining) != 0) {
+                perror("sched_setaffinity");
+            } else {
+                admin_cpus = remaining;
+            }
+        }
+    }
+
+    const char *reactors = server_config.reactor_cpus;
+    if (reactors && *reactors && parse_cpu_list(reactors, &set, reactor_cpus, &reactor_cpu_count) != 0) {
+        fprintf(stderr, "Ignoring invalid ADMIN_REACTOR_CPUS=%s\n", reactors);
+        reactor_cpu_count = 0;
+    }
+
+    /*
+     * A reactor pinned to a reserved CPU would compete with the service, and one outside the
+     * affinity the server was started with could not even be created. Only the listed CPUs left
+     * to the admin server are kept.
+     */
+    size_t kept = 0;
+    for (size_t i = 0; i < reactor_cpu_count; ++i) {
+        if (CPU_ISSET(reactor_cpus[i], &admin_cpus)) {
+            reactor_cpus[kept++] = reactor_cpus[i];
+        } else {
+            fprintf(stderr, "Ignoring CPU %d of ADMIN_REACTOR_CPUS, it is not left to the admin server\n",
+                    reactor_cpus[i]);
+        }
+    }
+    if (kept == 0 && reactor_cpu_count > 0) {
+        fprintf(stderr, "Ignoring ADMIN_REACTOR_CPUS=%s, it names no CPU left to the admin server\n", reactors);
+    }
+    reactor_cpu_count = kept;
+    return 0;
+}
+
+size_t cpus_reactor_cpu_count(void) {
+    return reactor_cpu_count;
+}
+
+int cpus_reactor_cpu(size_t index) {
+    if (reactor_cpu_count > 0) return reactor_cpus[index % reactor_cpu_count];
+
+    size_t wanted = index % (size_t)CPU_COUNT(&admin_cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &admin_cpus) && wanted-- == 0) return cpu;
+    }
+    return -1;
+}
+
+void cpus_restore_for_child(void) {
+    sched_setaffinity(0, sizeof(started_with), &started_with);
+}
@@ -0,0 +1,28 @@
+#ifndef CPUS_H
+#define CPUS_H
+
+#include <stddef.h> // For size_t
+
+// Function to keep the admin server off the CPUs in ADMIN_RESERVED_CPUS, the
+// ones the monitored service runs on. Restricts the calling thread, and with
+// it every thread started afterwards, so call it first thing in main().
+//
+// Returns: 0 on success (a list that can't be parsed, or that leaves no CPU,
+//          is reported and ignored), -1 if the affinity could not be read.
+int cpus_init(void);
+
+// Function to count the CPUs listed in ADMIN_REACTOR_CPUS. Listed CPUs that are
+// reserved or outside the affinity the server was started with are dropped.
+size_t cpus_reactor_cpu_count(void);
+
+// Function to pick the CPU an event loop thread is pinned to: the index-th of
+// ADMIN_REACTOR_CPUS if set, otherwise the index-th CPU left to the admin
+// server, wrapping around when there are more loops than CPUs.
+int cpus_reactor_cpu(size_t index);
+
+// Function to give a freshly forked service process every CPU the server was
+// started with, reserved ones included. Async-signal-safe, for use between
+// fork() and exec().
+void cpus_restore_for_child(void);
+
+#endif // CPUS_H
@@ -0,0 +1,124 @@
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS_PER_WAIT 256
+
+/*
+ * The loop keeps one slot per file descriptor number instead of allocating a
+ * small struct per registration. File descriptors are small dense integers
+ * handed out lowest-first by the kernel, so an array indexed by fd is both the
+ * cheapest lookup and the smallest structure for thousands of sockets.
+ *
+ * The table is only resized on the loop thread (event_loop_add), which is also
+ * the only thread that reads it, so it needs no lock.
+ */
+struct event_slot {
+    event_callback callback;
+    void *arg;
+};
+
+struct event_loop {
+    int epoll_fd;
+    struct event_slot *slots;
+    size_t slot_count;
+
+    int timer_interval_ms;
+    long long timer_due_ms;
+    event_timer_callback timer_callback;
+    void *timer_arg;
+};
+
+struct event_loop *event_loop_create(void) {
+    struct event_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop) return NULL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+static int ensure_slot(struct event_loop *loop, int fd) {
+    if ((size_t)fd < loop->slot_count) return 0;
+
+    size_t new_count = loop->slot_count ? loop->slot_count : 64;
+    while (new_count <= (size_t)fd) new_count *= 2;
+
+    struct event_slot *slots = realloc(loop->slots, new_count * sizeof(*slots));
+    if (!slots) return -1;
+    memset(slots + loop->slot_count, 0, (new_count - loop->slot_count) * sizeof(*slots));
+
+    loop->slots = slots;
+    loop->slot_count = new_count;
+    return 0;
+}
+
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events, event_callback callback, void *arg) {
+    if (fd < 0 || ensure_slot(loop, fd) != 0) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    loop->slots[fd].callback = callback;
+    loop->slots[fd].arg = arg;
+
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int event_loop_rearm(struct event_loop *loop, int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_loop_remove(struct event_loop *loop, int fd) {
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void event_loop_set_timer(struct event_loop *loop, int interval_ms, event_timer_callback callback, void *arg) {
+    loop->timer_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    loop->timer_due_ms = monotonic_ms() + loop->timer_interval_ms;
+    loop->timer_callback = callback;
+    loop->timer_arg = arg;
+}
+
+static int run_due_timer(struct event_loop *loop) {
+    if (!loop->timer_callback) return -1; // No timer: sleep in the kernel until something is ready
+
+    long long now = monotonic_ms();
+    if (now >= loop->timer_due_ms) {
+        loop->timer_callback(loop, loop->timer_arg);
+        loop->timer_due_ms = now + loop->timer_interval_ms;
+    }
+    return (int)(loop->timer_due_ms - now > 0 ? loop->timer_due_ms - now : 0);
+}
+
+void event_loop_run(struct event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS_PER_WAIT];
+
+    while (1) {
+        int timeout_ms = run_due_timer(loop);
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS_PER_WAIT, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if ((size_t)fd >= loop->slot_count || !loop->slots[fd].callback) continue;
+
+            struct event_slot slot = loop->slots[fd];
+            slot.callback(loop, fd, events[i].events, slot.arg);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h> // For the EPOLL* event flags passed to event_loop_add()
+#include <time.h>
+
+struct event_loop;
+
+// Function to read the monotonic clock, which the loop's timers and every
+// timeout and deadline of the server are measured with.
+// Returns: Milliseconds since an arbitrary starting point.
+static inline long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to read the same clock at full resolution, for request latencies.
+// Returns: Nanoseconds since the same starting point as monotonic_ms().
+static inline long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Callback invoked by the loop thread when a registered file descriptor
+// becomes ready.
+//
+// struct event_loop *loop: The loop that observed the event.
+// int fd: The ready file descriptor.
+// uint32_t events: The epoll event mask reported by the kernel.
+// void *arg: The opaque pointer given to event_loop_add().
+typedef void (*event_callback)(struct event_loop *loop, int fd, uint32_t events, void *arg);
+
+// Function to create a new epoll-backed event loop.
+// Returns: A pointer to the loop, or NULL if epoll_create1 or the
+//          allocation failed.
+struct event_loop *event_loop_create(void);
+
+// Function to register a file descriptor with the loop.
+// Must be called from the loop thread (or before event_loop_run()).
+//
+// int fd: The descriptor to watch.
+// uint32_t events: The epoll event mask (EPOLLIN, EPOLLET, EPOLLONESHOT, ...).
+// event_callback callback: Function invoked when the descriptor is ready.
+// void *arg: Opaque pointer handed back to the callback.
+//
+// Returns: 0 on success, -1 on failure (errno is set).
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events, event_callback callback, void *arg);
+
+// Function to re-enable a descriptor that was registered with EPOLLONESHOT.
+// Safe to call from any thread, the callback and arg are left untouched.
+//
+// Returns: 0 on success, -1 on failure (errno is set).
+int event_loop_rearm(struct event_loop *loop, int fd, uint32_t events);
+
+// Function to unregister a descriptor. Closing a descriptor removes it from
+// epoll implicitly, so this is only needed when the fd stays open.
+//
+// Returns: 0 on success, -1 on failure (errno is set).
+int event_loop_remove(struct event_loop *loop, int fd);
+
+// Callback invoked periodically on the loop thread, see event_loop_set_timer().
+typedef void (*event_timer_callback)(struct event_loop *loop, void *arg);
+
+// Function to install a periodic callback on the loop, replacing any previous
+// one. The loop only wakes up for it while it is installed, so housekeeping
+// such as closing idle connections needs no extra thread.
+//
+// int interval_ms: Minimum time between two invocations.
+// event_timer_callback callback: Function to invoke, or NULL to remove the timer.
+void event_loop_set_timer(struct event_loop *loop, int interval_ms, event_timer_callback callback, void *arg);
+
+// Function to run the loop on the calling thread. Blocks in epoll_wait()
+// until events arrive or the periodic timer is due, so an idle server
+// consumes no CPU. Never returns.
+void event_loop_run(struct event_loop *loop);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,149 @@
+#include "file_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+#define FILE_CACHE_SLOTS 32
+#define FILE_CACHE_REVALIDATE_MS 1000
+
+/*
+ * The most recently used files, each holding its fd open. A file replaced in the cache is only
+ * closed once the last request sending from it let go, so a download in progress keeps the
+ * version it started with, even after a log rotation renamed it away.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cached_file *slots[FILE_CACHE_SLOTS];
+static long long last_used[FILE_CACHE_SLOTS];
+static long long uses = 0;
+
+// Caller holds cache_lock
+static void file_unref(struct cached_file *file) {
+    if (--file->refs > 0) return;
+    close(file->fd);
+    free(file->path);
+    free(file);
+}
+
+static struct cached_file *file_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = ENOENT; // Directories and devices are never served
+        return NULL;
+    }
+
+    struct cached_file *file = calloc(1, sizeof(*file));
+    if (file) file->path = strdup(path);
+    if (!file || !file->path) {
+        free(file);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    file->fd = fd;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim.tv_sec;
+    file->mtime_nsec = st.st_mtim.tv_nsec;
+    file->refs = 1;
+    file->checked_ms = monotonic_ms();
+    // Nanoseconds included: a file rewritten within the same second gets a new tag
+    snprintf(file->etag, sizeof(file->etag), "\"%llx-%llx-%llx\"", (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + (unsigned long long)st.st_mtim.tv_nsec);
+    struct tm tm;
+    gmtime_r(&file->mtime, &tm);
+    strftime(file->last_modified, sizeof(file->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return file;
+}
+
+// Whether the file at `path` is still the one that was opened, unchanged
+static int file_current(const struct cached_file *file) {
+    struct stat path_st, fd_st;
+    if (stat(file->path, &path_st) != 0 || fstat(file->fd, &fd_st) != 0) return 0;
+    return path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev && fd_st.st_size == file->size &&
+           fd_st.st_mtim.tv_sec == file->mtime && fd_st.st_mtim.tv_nsec == file->mtime_nsec;
+}
+
+// Caller holds cache_lock. Returns: The slot of `path`, with *found set, or else an empty or the least recently used one
+static size_t slot_for(const char *path, int *found) {
+    size_t victim = 0;
+    for (size_t i = 0; i < FILE_CACHE_SLOTS; ++i) {
+        struct cached_file *file = slots[i];
+        if (!file) {
+            if (slots[victim]) victim = i;
+            continue;
+        }
+        if (strcmp(file->path, path) == 0) {
+            *found = 1;
+            return i;
+        }
+        if (slots[victim] && last_used[i] < last_used[victim]) victim = i;
+    }
+    *found = 0;
+    return victim;
+}
+
+/*
+ * The file system is only touched without the lock: a slow or hung mount must not hold up the
+ * requests for other files, nor file_cache_release(). While one request revalidates a file, the
+ * others keep being served the cached version.
+ */
+const struct cached_file *file_cache_open(const char *path) {
+    long long now = monotonic_ms();
+
+    pthread_mutex_lock(&cache_lock);
+    uses++;
+    int found;
+    size_t slot = slot_for(path, &found);
+    struct cached_file *cached = found ? slots[slot] : NULL;
+    if (cached) {
+        cached->refs++; // The caller's if it is still current, keeps it alive while it is checked
+        last_used[slot] = uses;
+        if (now - cached->checked_ms < FILE_CACHE_REVALIDATE_MS) {
+            pthread_mutex_unlock(&cache_lock);
+            return cached;
+        }
+        cached->checked_ms = now;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (cached && file_current(cached)) return cached;
+
+    struct cached_file *file = file_open(path);
+    int saved_errno = errno;
+
+    pthread_mutex_lock(&cache_lock);
+    slot = slot_for(path, &found);
+    // Another request may have reopened it meanwhile, the newest open wins
+    if (slots[slot] && (file || slots[slot] == cached)) {
+        file_unref(slots[slot]);
+        slots[slot] = NULL;
+    }
+    if (file) {
+        file->refs++; // The caller's
+        slots[slot] = file;
+        last_used[slot] = uses;
+    }
+    if (cached) file_unref(cached);
+    pthread_mutex_unlock(&cache_lock);
+
+    errno = saved_errno;
+    return file;
+}
+
+void file_cache_release(const struct cached_file *file) {
+    pthread_mutex_lock(&cache_lock);
+    file_unref((struct cached_file *)file);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h> // For off_t
+#include <time.h>
+
+// An open file with the metadata its responses need, shared by every request
+// for it. Read-only for holders.
+struct cached_file {
+    char *path;
+    int fd;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;        // A rewrite within the same second changes only this
+    char etag[48];          // Quoted, from inode, size and modification time
+    char last_modified[32]; // HTTP date
+    int refs;               // Holders, plus one while it is in the cache
+    long long checked_ms;   // When it was last compared with the file system
+};
+
+// Function to get a regular file, opened and stat'ed. A file that is served
+// again and again is opened once and re-checked with one stat() per
+// FILE_CACHE_REVALIDATE_MS, so a replaced or rewritten file (e.g. a rotated
+// log) is picked up within that time.
+//
+// const char *path: The file.
+// Returns: The file with a reference the caller must give back with
+//          file_cache_release(), or NULL with errno set.
+const struct cached_file *file_cache_open(const char *path);
+
+// Function to give back a file obtained from file_cache_open().
+void file_cache_release(const struct cached_file *file);
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,466 @@
+#include "http_parser.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+enum parser_state {
+    S_METHOD,
+    S_PATH,
+    S_QUERY,
+    S_VERSION,
+    S_REQUEST_LINE_LF,
+    S_HEADER_START,
+    S_HEADER_NAME,
+    S_HEADER_VALUE_START,
+    S_HEADER_VALUE,
+    S_HEADER_LF,
+    S_HEAD_END_LF,
+    S_DONE
+};
+
+// RFC 9110 token characters, allowed in methods and header names
+static int is_token_char(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+    return c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+// Visible ASCII, allowed in the request target
+static int is_target_char(unsigned char c) {
+    return c > 0x20 && c < 0x7f;
+}
+
+static struct http_span span(size_t start, size_t end) {
+    return (struct http_span){ .offset = (uint32_t)start, .len = (uint32_t)(end - start) };
+}
+
+static int parse_version(struct http_parser *parser, const char *version, size_t len) {
+    if (len != 8 || memcmp(version, "HTTP/", 5) != 0 || version[6] != '.' ||
+        version[5] < '0' || version[5] > '9' || version[7] < '0' || version[7] > '9') {
+        return HTTP_PARSE_BAD_REQUEST;
+    }
+    if (version[5] != '1') return HTTP_PARSE_VERSION_UNSUPPORTED;
+
+    parser->minor_version = version[7] - '0';
+    return 0;
+}
+
+void http_parser_init(struct http_parser *parser, size_t max_head_len) {
+    parser->state = S_METHOD;
+    parser->pos = 0;
+    parser->max_head_len = max_head_len < UINT32_MAX ? max_head_len : UINT32_MAX;
+    parser->mark = 0;
+    parser->value_end = 0;
+    parser->minor_version = 0;
+    parser->method = parser->path = parser->query = (struct http_span){ 0, 0 };
+    parser->header_count = 0;
+}
+
+/*
+ * One pass over the bytes that arrived since the last call. The parser never goes back to
+ * bytes it has already seen, so a head that trickles in over many reads still costs O(n)
+ * in total. Anything that does not look like HTTP/1.x is rejected at the first bad byte.
+ */
+int http_parser_execute(struct http_parser *parser, const char *data, size_t len) {
+    if (parser->state == S_DONE) return HTTP_PARSE_DONE;
+
+    size_t end = len < parser->max_head_len ? len : parser->max_head_len;
+    size_t pos = parser->pos;
+
+    for (; pos < end; ++pos) {
+        unsigned char c = (unsigned char)data[pos];
+
+        switch (parser->state) {
+        case S_METHOD:
+            if (c == ' ') {
+                if (pos == 0) return HTTP_PARSE_BAD_REQUEST;
+                parser->method = span(0, pos);
+                parser->mark = pos + 1;
+                parser->state = S_PATH;
+            } else if (!is_token_char(c)) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_PATH:
+            if (c == ' ' || c == '?') {
+                if (pos == parser->mark) return HTTP_PARSE_BAD_REQUEST;
+                parser->path = span(parser->mark, pos);
+                parser->query = span(pos + 1, pos + 1);
+                parser->mark = pos + 1;
+                parser->state = c == ' ' ? S_VERSION : S_QUERY;
+            } else if (!is_target_char(c)) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_QUERY:
+            if (c == ' ') {
+                parser->query = span(parser->mark, pos);
+                parser->mark = pos + 1;
+                parser->state = S_VERSION;
+            } else if (!is_target_char(c)) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_VERSION:
+            if (c == '\r' || c == '\n') {
+                int err = parse_version(parser, data + parser->mark, pos - parser->mark);
+                if (err != 0) return err;
+                parser->state = c == '\r' ? S_REQUEST_LINE_LF : S_HEADER_START;
+            } else if (pos - parser->mark >= 8) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_REQUEST_LINE_LF:
+        case S_HEADER_LF:
+            if (c != '\n') return HTTP_PARSE_BAD_REQUEST;
+            parser->state = S_HEADER_START;
+            break;
+
+        case S_HEADER_START:
+            if (c == '\r') {
+                parser->state = S_HEAD_END_LF;
+            } else if (c == '\n') {
+                parser->pos = pos + 1;
+                parser->state = S_DONE;
+                return HTTP_PARSE_DONE;
+            } else if (is_token_char(c)) {
+                if (parser->header_count == HTTP_MAX_HEADERS) return HTTP_PARSE_HEAD_TOO_LARGE;
+                parser->mark = pos;
+                parser->state = S_HEADER_NAME;
+            } else {
+                // Also rejects obsolete line folding (a line starting with whitespace)
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_HEADER_NAME:
+            if (c == ':') {
+                parser->header_names[parser->header_count] = span(parser->mark, pos);
+                parser->state = S_HEADER_VALUE_START;
+            } else if (!is_token_char(c)) {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            break;
+
+        case S_HEADER_VALUE_START:
+            if (c == ' ' || c == '\t') break;
+            parser->mark = pos;
+            parser->value_end = pos;
+            parser->state = S_HEADER_VALUE;
+            // fall through
+
+        case S_HEADER_VALUE:
+            if (c == '\r' || c == '\n') {
+                parser->header_values[parser->header_count++] = span(parser->mark, parser->value_end);
+                parser->state = c == '\r' ? S_HEADER_LF : S_HEADER_START;
+            } else if (c == ' ' || c == '\t') {
+                // Trailing whitespace is only part of the value if something follows it
+            } else if (c < 0x20 || c == 0x7f) {
+                return HTTP_PARSE_BAD_REQUEST;
+            } else {
+                parser->value_end = pos + 1;
+            }
+            break;
+
+        case S_HEAD_END_LF:
+            if (c != '\n') return HTTP_PARSE_BAD_REQUEST;
+            parser->pos = pos + 1;
+            parser->state = S_DONE;
+            return HTTP_PARSE_DONE;
+        }
+    }
+
+    parser->pos = pos;
+    return pos >= parser->max_head_len ? HTTP_PARSE_HEAD_TOO_LARGE : HTTP_PARSE_INCOMPLETE;
+}
+
+static struct http_slice slice(const char *data, struct http_span span) {
+    return (struct http_slice){ .data = data + span.offset, .len = span.len };
+}
+
+void http_parser_result(const struct http_parser *parser, const char *data, struct http_request *req) {
+    req->method = slice(data, parser->method);
+    req->path = slice(data, parser->path);
+    req->query = slice(data, parser->query);
+    req->minor_version = parser->minor_version;
+    req->header_count = parser->header_count;
+    req->head_len = parser->pos;
+
+    for (size_t i = 0; i < parser->header_count; ++i) {
+        req->headers[i].name = slice(data, parser->header_names[i]);
+        req->headers[i].value = slice(data, parser->header_values[i]);
+    }
+}
+
+struct http_slice http_request_header(const struct http_request *req, const char *name) {
+    size_t name_len = strlen(name);
+
+    for (size_t i = 0; i < req->header_count; ++i) {
+        const struct http_slice *field = &req->headers[i].name;
+        if (field->len == name_len && strncasecmp(field->data, name, name_len) == 0) {
+            return req->headers[i].value;
+        }
+    }
+    return (struct http_slice){ NULL, 0 };
+}
+
+/*
+ * Connection carries a comma-separated list of options, e.g. "keep-alive, Upgrade".
+ * Returns 1 if `option` is one of them.
+ */
+static int has_connection_option(struct http_slice value, const char *option) {
+    size_t option_len = strlen(option);
+    size_t i = 0;
+
+    while (i < value.len) {
+        while (i < value.len && (value.data[i] == ' ' || value.data[i] == '\t' || value.data[i] == ',')) i++;
+        size_t start = i;
+        while (i < value.len && value.data[i] != ',' && value.data[i] != ' ' && value.data[i] != '\t') i++;
+
+        if (i - start == option_len && strncasecmp(value.data + start, option, option_len) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Responses don't carry a "Connection: keep-alive" header, which HTTP/1.0 clients need to keep
+ * the connection open, so those are always answered on a connection that is closed afterwards.
+ */
+int http_request_keep_alive(const struct http_request *req) {
+    if (req->minor_version < 1) return 0;
+    return !has_connection_option(http_request_header(req, "Connection"), "close");
+}
+
+int http_slice_equals(struct http_slice slice, const char *str) {
+    size_t len = strlen(str);
+    return slice.len == len && memcmp(slice.data, str, len) == 0;
+}
+
+struct http_slice http_query_param(struct http_slice query, const char *name) {
+    size_t name_len = strlen(name);
+    const char *p = query.data;
+    const char *end = query.data + query.len;
+
+    while (p && p < end) {
+        const char *pair_end = memchr(p, '&', (size_t)(end - p));
+        if (!pair_end) pair_end = end;
+
+        if ((size_t)(pair_end - p) >= name_len && memcmp(p, name, name_len) == 0) {
+            if (p + name_len == pair_end) return (struct http_slice){ pair_end, 0 };
+            if (p[name_len] == '=') {
+                return (struct http_slice){ p + name_len + 1, (size_t)(pair_end - p - name_len - 1) };
+            }
+        }
+        p = pair_end + 1;
+    }
+    return (struct http_slice){ NULL, 0 };
+}
+
+int http_query_int(struct http_slice query, const char *name, long long *value) {
+    struct http_slice param = http_query_param(query, name);
+    if (!param.data) return 0;
+
+    char text[24];
+    if (param.len == 0 || param.len >= sizeof(text)) return -1;
+    memcpy(text, param.data, param.len);
+    text[param.len] = '\0';
+
+    char *end;
+    errno = 0;
+    long long parsed = strtoll(text, &end, 10);
+    if (errno != 0 || *end != '\0') return -1;
+    *value = parsed;
+    return 0;
+}
+
+enum body_state {
+    B_LENGTH,
+    B_CHUNK_SIZE,
+    B_CHUNK_EXTENSION,
+    B_CHUNK_SIZE_LF,
+    B_CHUNK_DATA,
+    B_CHUNK_DATA_CR,
+    B_CHUNK_DATA_LF,
+    B_TRAILER_START,
+    B_TRAILER,
+    B_END_LF,
+    B_DONE
+};
+
+// Longest accepted chunk-size line (extensions included), and total size of the trailers
+#define MAX_CHUNK_LINE 4096
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static int parse_content_length(struct http_slice value, uint64_t *length) {
+    if (value.len == 0 || value.len > 19) return HTTP_PARSE_BAD_REQUEST; // 19 digits always fit
+
+    uint64_t parsed = 0;
+    for (size_t i = 0; i < value.len; ++i) {
+        if (value.data[i] < '0' || value.data[i] > '9') return HTTP_PARSE_BAD_REQUEST;
+        parsed = parsed * 10 + (uint64_t)(value.data[i] - '0');
+    }
+    *length = parsed;
+    return 0;
+}
+
+/*
+ * A request that can be framed in two ways is the basis of request smuggling, so a
+ * Content-Length next to Transfer-Encoding, or more than one Content-Length, is rejected
+ * instead of picking one of them.
+ */
+int http_body_decoder_init(struct http_body_decoder *decoder, const struct http_request *req) {
+    *decoder = (struct http_body_decoder){ .state = B_DONE, .max_len = UINT64_MAX };
+
+    int content_length_count = 0;
+    struct http_slice content_length = { NULL, 0 };
+    struct http_slice transfer_encoding = { NULL, 0 };
+
+    for (size_t i = 0; i < req->header_count; ++i) {
+        const struct http_slice *name = &req->headers[i].name;
+        if (name->len == 14 && strncasecmp(name->data, "Content-Length", 14) == 0) {
+            content_length = req->headers[i].value;
+            content_length_count++;
+        } else if (name->len == 17 && strncasecmp(name->data, "Transfer-Encoding", 17) == 0) {
+            if (transfer_encoding.data) return HTTP_PARSE_NOT_IMPLEMENTED; // Stacked codings
+            transfer_encoding = req->headers[i].value;
+        }
+    }
+
+    if (transfer_encoding.data) {
+        if (content_length_count > 0) return HTTP_PARSE_BAD_REQUEST;
+        if (transfer_encoding.len != 7 || strncasecmp(transfer_encoding.data, "chunked", 7) != 0) {
+            return HTTP_PARSE_NOT_IMPLEMENTED;
+        }
+        decoder->state = B_CHUNK_SIZE;
+        return 0;
+    }
+
+    if (content_length_count > 1) return HTTP_PARSE_BAD_REQUEST;
+    if (content_length_count == 1) {
+        if (parse_content_length(content_length, &decoder->remaining) != 0) return HTTP_PARSE_BAD_REQUEST;
+        if (decoder->remaining > 0) decoder->state = B_LENGTH;
+    }
+    return 0;
+}
+
+int http_body_decoder_set_limit(struct http_body_decoder *decoder, uint64_t max_len) {
+    decoder->max_len = max_len;
+    if (decoder->state == B_LENGTH && decoder->remaining > max_len) return HTTP_PARSE_BODY_TOO_LARGE;
+    return 0;
+}
+
+int http_body_decoder_done(const struct http_body_decoder *decoder) {
+    return decoder->state == B_DONE;
+}
+
+int http_body_decoder_execute(struct http_body_decoder *decoder, const char *data, size_t len,
+                              size_t *consumed, const char **piece, size_t *piece_len) {
+    size_t pos = 0;
+    *piece = NULL;
+    *piece_len = 0;
+
+    while (pos < len && decoder->state != B_DONE) {
+        unsigned char c = (unsigned char)data[pos];
+
+        switch (decoder->state) {
+        case B_LENGTH:
+        case B_CHUNK_DATA: {
+            size_t available = len - pos;
+            size_t take = decoder->remaining < available ? (size_t)decoder->remaining : available;
+
+            *piece = data + pos;
+            *piece_len = take;
+            pos += take;
+            decoder->remaining -= take;
+            decoder->received += take;
+
+            if (decoder->remaining == 0) {
+                decoder->state = decoder->state == B_LENGTH ? B_DONE : B_CHUNK_DATA_CR;
+            }
+            if (decoder->state == B_DONE) break;
+
+            *consumed = pos;
+            return HTTP_BODY_DATA;
+        }
+
+        case B_CHUNK_SIZE: {
+            int digit = hex_value(c);
+            if (digit >= 0) {
+                // Checked before shifting, so the size can't overflow either
+                if (decoder->remaining > (decoder->max_len - decoder->received) >> 4) return HTTP_PARSE_BODY_TOO_LARGE;
+                decoder->remaining = decoder->remaining * 16 + (uint64_t)digit;
+                decoder->size_digits++;
+            } else if (decoder->size_digits == 0) {
+                return HTTP_PARSE_BAD_REQUEST;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                decoder->state = B_CHUNK_EXTENSION;
+            } else if (c == '\r') {
+                decoder->state = B_CHUNK_SIZE_LF;
+            } else {
+                return HTTP_PARSE_BAD_REQUEST;
+            }
+            if (decoder->remaining > decoder->max_len - decoder->received) return HTTP_PARSE_BODY_TOO_LARGE;
+            break;
+        }
+
+        case B_CHUNK_EXTENSION:
+            // Extensions are ignored, as RFC 9112 allows
+            if (c == '\r') decoder->state = B_CHUNK_SIZE_LF;
+            else if (c == '\n') return HTTP_PARSE_BAD_REQUEST;
+            break;
+
+        case B_CHUNK_SIZE_LF:
+            if (c != '\n') return HTTP_PARSE_BAD_REQUEST;
+            decoder->state = decoder->remaining == 0 ? B_TRAILER_START : B_CHUNK_DATA;
+            decoder->line_len = 0;
+            decoder->size_digits = 0;
+            break;
+
+        case B_CHUNK_DATA_CR:
+            if (c != '\r') return HTTP_PARSE_BAD_REQUEST;
+            decoder->state = B_CHUNK_DATA_LF;
+            break;
+
+        case B_CHUNK_DATA_LF:
+            if (c != '\n') return HTTP_PARSE_BAD_REQUEST;
+            decoder->state = B_CHUNK_SIZE;
+            break;
+
+        case B_TRAILER_START:
+            // Trailer fields are skipped, nothing here acts on them
+            if (c == '\r') decoder->state = B_END_LF;
+            else decoder->state = B_TRAILER;
+            break;
+
+        case B_TRAILER:
+            if (c == '\n') decoder->state = B_TRAILER_START;
+            break;
+
+        case B_END_LF:
+            if (c != '\n') return HTTP_PARSE_BAD_REQUEST;
+            decoder->state = B_DONE;
+            break;
+        }
+
+        if (decoder->state == B_DONE) {
+            if (*piece_len == 0) pos++;
+            break;
+        }
+        pos++;
+        if (++decoder->line_len > MAX_CHUNK_LINE) return HTTP_PARSE_BAD_REQUEST;
+    }
+
+    *consumed = pos;
+    return decoder->state == B_DONE ? HTTP_BODY_DONE : HTTP_BODY_INCOMPLETE;
+}
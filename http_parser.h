@@ -0,0 +1,173 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+// Maximum number of header fields accepted in one request head.
+#define HTTP_MAX_HEADERS 64
+
+// A view into the receive buffer. Not NUL-terminated, valid only while the
+// buffer holding the request is.
+struct http_slice {
+    const char *data;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value; // Leading and trailing whitespace removed
+};
+
+// A parsed request head. Every slice points into the connection's receive
+// buffer, nothing is copied.
+struct http_request {
+    struct http_slice method;
+    struct http_slice path;  // Without the query string
+    struct http_slice query; // Without the '?', empty if there is none
+    int minor_version;       // 0 for HTTP/1.0, 1 for HTTP/1.1
+    struct http_header headers[HTTP_MAX_HEADERS];
+    size_t header_count;
+    size_t head_len;         // Bytes up to and including the blank line
+};
+
+// Result of http_parser_execute(). Errors are negative and map to the
+// status code the client should get before the connection is closed.
+enum http_parse_status {
+    HTTP_PARSE_DONE = 1,
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_BAD_REQUEST = -1,         // 400
+    HTTP_PARSE_HEAD_TOO_LARGE = -2,      // 431, too many or too large header fields
+    HTTP_PARSE_VERSION_UNSUPPORTED = -3, // 505
+    HTTP_PARSE_BODY_TOO_LARGE = -4,      // 413
+    HTTP_PARSE_NOT_IMPLEMENTED = -5      // 501, unknown Transfer-Encoding
+};
+
+// Where a field starts and how long it is, relative to the start of the request.
+struct http_span {
+    uint32_t offset;
+    uint32_t len;
+};
+
+/*
+ * Resumable parser state for one request head. All positions are offsets from the first
+ * byte of the request, so the buffer may be moved between two calls (as long as the request
+ * keeps its content), and every call only looks at the bytes that arrived since the last one.
+ */
+struct http_parser {
+    int state;
+    size_t pos;
+    size_t max_head_len;
+    size_t mark;      // Start of the token being scanned
+    size_t value_end; // End of the header value without trailing whitespace
+    int minor_version;
+
+    struct http_span method;
+    struct http_span path;
+    struct http_span query;
+    struct http_span header_names[HTTP_MAX_HEADERS];
+    struct http_span header_values[HTTP_MAX_HEADERS];
+    size_t header_count;
+};
+
+// Function to prepare a parser for a new request.
+//
+// size_t max_head_len: Largest accepted request head in bytes, request line
+//                      and headers included.
+void http_parser_init(struct http_parser *parser, size_t max_head_len);
+
+// Function to continue parsing a request head.
+//
+// const char *data: The first byte of the request. Must hold the same bytes
+//                   as in previous calls for this request, plus new ones.
+// size_t len: Number of bytes of the request available in data.
+//
+// Returns: HTTP_PARSE_DONE once the blank line ending the head was seen,
+//          HTTP_PARSE_INCOMPLETE if more bytes are needed, or a negative
+//          http_parse_status if the request must be rejected.
+int http_parser_execute(struct http_parser *parser, const char *data, size_t len);
+
+// Function to fill `req` with slices into `data` once the parser returned
+// HTTP_PARSE_DONE. `data` is the same pointer passed to the last
+// http_parser_execute() call.
+void http_parser_result(const struct http_parser *parser, const char *data, struct http_request *req);
+
+// Function to look up a header field by name, case-insensitively.
+// Returns: The value of the first matching field, or an empty slice with a
+//          NULL data pointer if the request has no such field.
+struct http_slice http_request_header(const struct http_request *req, const char *name);
+
+// Function to decide whether the connection may stay open after the response.
+// HTTP/1.1 connections are persistent unless the client sends
+// "Connection: close", HTTP/1.0 connections are always closed.
+int http_request_keep_alive(const struct http_request *req);
+
+// Function to compare a slice with a NUL-terminated string.
+// Returns: 1 if both hold the same bytes, 0 otherwise.
+int http_slice_equals(struct http_slice slice, const char *str);
+
+// Function to look up a parameter of a query string such as "a=1&b=2".
+// The value is returned as it appears, without percent-decoding.
+// Returns: The value (empty for "a" or "a="), or an empty slice with a NULL
+//          data pointer if the parameter is absent.
+struct http_slice http_query_param(struct http_slice query, const char *name);
+
+// Function to read a decimal integer parameter of a query string.
+// Returns: 0 if the parameter is valid (stored in *value) or absent (*value
+//          is left as is), -1 if it is not an integer.
+int http_query_int(struct http_slice query, const char *name, long long *value);
+
+/*
+ * Resumable decoder for the message body that follows a request head, framed either by
+ * Content-Length or by chunked transfer coding. Like the head parser it only looks at every
+ * byte once, and it hands out the decoded data in place instead of copying it.
+ */
+struct http_body_decoder {
+    int state;
+    uint64_t remaining;  // Bytes left in the Content-Length body or in the current chunk
+    uint64_t received;   // Decoded body bytes so far
+    uint64_t max_len;
+    size_t line_len;     // Length of the current chunk-size line, or of all trailers
+    int size_digits;
+};
+
+// Function to set up the body decoder for a parsed request head.
+//
+// Returns: 0 on success, HTTP_PARSE_BAD_REQUEST for an invalid or ambiguous
+//          Content-Length (e.g. combined with Transfer-Encoding), or
+//          HTTP_PARSE_NOT_IMPLEMENTED for a transfer coding other than chunked.
+int http_body_decoder_init(struct http_body_decoder *decoder, const struct http_request *req);
+
+// Function to limit the decoded body size.
+// Returns: 0 on success, HTTP_PARSE_BODY_TOO_LARGE if the Content-Length
+//          already announces more than max_len bytes.
+int http_body_decoder_set_limit(struct http_body_decoder *decoder, uint64_t max_len);
+
+// Function to check whether the whole body has been decoded. True right away
+// for requests without a body.
+int http_body_decoder_done(const struct http_body_decoder *decoder);
+
+// Result of http_body_decoder_execute(), errors use the http_parse_status values.
+enum http_body_status {
+    HTTP_BODY_DONE = 2,
+    HTTP_BODY_DATA = 1,
+    HTTP_BODY_INCOMPLETE = 0
+};
+
+// Function to decode the next part of the body.
+//
+// const char *data, size_t len: Received bytes following what was consumed
+//                               by previous calls.
+// size_t *consumed: Set to the number of input bytes used, framing included.
+// const char **piece, size_t *piece_len: Set to the decoded data found in
+//                                        this call, pointing into `data`.
+//
+// Returns: HTTP_BODY_DATA if a piece was decoded and more may follow (call
+//          again with the remaining input), HTTP_BODY_INCOMPLETE if all input
+//          was used, HTTP_BODY_DONE once the body ended (a final piece may
+//          still be set), or a negative http_parse_status (`consumed` and
+//          `piece` are then left unset).
+int http_body_decoder_execute(struct http_body_decoder *decoder, const char *data, size_t len,
+                              size_t *consumed, const char **piece, size_t *piece_len);
+
+#endif // HTTP_PARSER_H
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE // For pipe2() and POLLRDHUP
+#include "jobs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "connection.h"
+#include "response.h"
+#include "thread_pool.h"
+#include "tls.h"
+
+#define JOB_HISTORY 64             // Jobs are remembered until this many newer ones were created
+#define JOB_MAX_FOLLOWERS 16       // Streams of one job's output at the same time
+#define JOB_READ_CHUNK 16384
+#define JOB_STACK_SIZE (256 * 1024)
+
+static const char TRUNCATED_NOTE[] = "\n[output truncated]\n";
+
+extern char **environ;
+
+enum job_state {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_SUCCEEDED,
+    JOB_FAILED,
+};
+
+static const char *const JOB_STATE_NAMES[] = { "queued", "running", "succeeded", "failed" };
+
+// A client receiving the output of a running job
+struct job_follower {
+    int fd;
+    size_t sent;
+};
+
+struct job {
+    uint64_t id;                // 0 if the slot holds no job
+    int busy;                   // Queued, running, or still sending its output: the slot can't be reused
+    const char *type;
+    const char *command;
+    enum job_state state;
+    unsigned int requests;      // Requests answered with this job, merged duplicates included
+    struct timespec queued_at;  // Wall clock
+    struct timespec started_at;
+    struct timespec finished_at;
+    int exit_code;              // -1 unless it exited by itself
+    int exit_signal;
+    pid_t pid;                  // The command's, while it runs
+
+    char *output;
+    size_t output_len;
+    size_t output_capacity;
+    int output_truncated;
+
+    struct job_follower followers[JOB_MAX_FOLLOWERS];
+    size_t follower_count;
+    int wake_fd;                // Tells the runner that a follower was added
+};
+
+/*
+ * Every field of every job is guarded by jobs_lock. Jobs are few and the lock is only held to
+ * copy or append a little data, never while waiting for a process or a slow client, so one lock
+ * for the table is all it takes.
+ *
+ * A job lives in jobs[id % JOB_HISTORY] until a later job needs the slot, so status and output
+ * stay available for a while after it finished.
+ */
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct job jobs[JOB_HISTORY];
+static uint64_t next_job_id = 1;
+static struct job *active_rebuild = NULL; // Queued or running, later rebuild requests merge into it
+
+static struct thread_pool *job_pool = NULL;
+
+static int job_finished(const struct job *job) {
+    return job->state == JOB_SUCCEEDED || job->state == JOB_FAILED;
+}
+
+static double seconds_of(const struct timespec *ts) {
+    return (double)ts->tv_sec + (double)ts->tv_nsec / 1e9;
+}
+
+static struct job *find_job(uint64_t id) {
+    struct job *job = &jobs[id % JOB_HISTORY];
+    return job->id == id ? job : NULL;
+}
+
+static int parse_job_id(struct http_slice text, uint64_t *id) {
+    if (text.len == 0 || text.len > 19) return -1;
+    *id = 0;
+    for (size_t i = 0; i < text.len; ++i) {
+        if (text.data[i] < '0' || text.data[i] > '9') return -1;
+        *id = *id * 10 + (uint64_t)(text.data[i] - '0');
+    }
+    return *id > 0 ? 0 : -1;
+}
+
+// Takes the slot of the next id. Called with jobs_lock held. Returns NULL if the slot is in use.
+static struct job *job_create(const char *type, const char *command) {
+    struct job *job = &jobs[next_job_id % JOB_HISTORY];
+    if (job->busy) return NULL;
+
+    free(job->output);
+    int wake_fd = job->wake_fd;
+    *job = (struct job){
+        .id = next_job_id++,
+        .busy = 1,
+        .type = type,
+        .command = command,
+        .state = JOB_QUEUED,
+        .requests = 1,
+        .exit_code = -1,
+        .wake_fd = wake_fd,
+    };
+    clock_gettime(CLOCK_REALTIME, &job->queued_at);
+    return job;
+}
+
+// Called with jobs_lock held
+static void job_append_output(struct job *job, const char *data, size_t len) {
+    size_t limit = server_config.job_output_bytes;
+    if (job->output_truncated) return;
+    if (len > limit - job->output_len) {
+        len = limit - job->output_len;
+        job->output_truncated = 1;
+    }
+
+    size_t needed = job->output_len + len + (job->output_truncated ? sizeof(TRUNCATED_NOTE) : 0);
+    if (needed > job->output_capacity) {
+        size_t capacity = job->output_capacity ? job->output_capacity : 4096;
+        while (capacity < needed) capacity *= 2;
+        char *grown = realloc(job->output, capacity);
+        if (!grown) {
+            job->output_truncated = 1; // Keep what we have
+            return;
+        }
+        job->output = grown;
+        job->output_capacity = capacity;
+    }
+
+    memcpy(job->output + job->output_len, data, len);
+    job->output_len += len;
+    if (job->output_truncated) {
+        memcpy(job->output + job->output_len, TRUNCATED_NOTE, sizeof(TRUNCATED_NOTE) - 1);
+        job->output_len += sizeof(TRUNCATED_NOTE) - 1;
+    }
+}
+
+// Called with jobs_lock held. Swaps the last follower into place.
+static void job_drop_follower(struct job *job, size_t index) {
+    tls_close(job->followers[index].fd);
+    close(job->followers[index].fd);
+    job->followers[index] = job->followers[--job->follower_count];
+}
+
+// Sends what a follower is missing without blocking. Called with jobs_lock held.
+// Returns: 0 if the follower is still there, -1 if it is gone.
+static int job_feed_follower(struct job *job, struct job_follower *follower) {
+    while (follower->sent < job->output_len) {
+        struct iovec rest = { .iov_base = job->output + follower->sent, .iov_len = job->output_len - follower->sent };
+        ssize_t n = tls_sendmsg(follower->fd, &rest, 1, 0);
+        if (n > 0) {
+            follower->sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+static pid_t spawn_command(const char *command, int output_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+
+    // The server runs with SIGPIPE blocked, see block_sigpipe(); the command gets the default.
+    // In a process group of its own, so whatever it starts can be killed along with it.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    char *const argv[] = { "sh", "-c", (char *)command, NULL };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Runs one job on an executor thread: the command's output is collected until it closes its end
+ * of the pipe, and pushed to the clients following it as it arrives. The followers' sockets are
+ * non-blocking and polled together with the pipe, so a slow client never holds up the job.
+ */
+static void run_job(void *arg) {
+    struct job *job = arg;
+
+    pthread_mutex_lock(&jobs_lock);
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_REALTIME, &job->started_at);
+    pthread_mutex_unlock(&jobs_lock);
+
+    int out_pipe[2];
+    pid_t pid = -1;
+    int out_fd = -1;
+    if (pipe2(out_pipe, O_CLOEXEC) == 0) {
+        pid = spawn_command(job->command, out_pipe[1]);
+        close(out_pipe[1]);
+        out_fd = out_pipe[0];
+    }
+    pthread_mutex_lock(&jobs_lock);
+    job->pid = pid > 0 ? pid : 0;
+    pthread_mutex_unlock(&jobs_lock);
+    if (pid < 0) {
+        char message[128];
+        int len = snprintf(message, sizeof(message), "Failed to start the job: %s\n", strerror(errno));
+        pthread_mutex_lock(&jobs_lock);
+        job_append_output(job, message, (size_t)len);
+        pthread_mutex_unlock(&jobs_lock);
+        if (out_fd >= 0) close(out_fd);
+        out_fd = -1;
+    }
+
+    static _Thread_local char buf[JOB_READ_CHUNK];
+    while (out_fd >= 0) {
+        struct pollfd fds[2 + JOB_MAX_FOLLOWERS];
+        fds[0] = (struct pollfd){ .fd = out_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = job->wake_fd, .events = POLLIN };
+
+        pthread_mutex_lock(&jobs_lock);
+        size_t followers = job->follower_count;
+        for (size_t i = 0; i < followers; ++i) {
+            short events = POLLIN | POLLRDHUP;
+            if (job->followers[i].sent < job->output_len) events |= POLLOUT;
+            fds[2 + i] = (struct pollfd){ .fd = job->followers[i].fd, .events = events };
+        }
+        pthread_mutex_unlock(&jobs_lock);
+
+        if (poll(fds, 2 + followers, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll in job runner");
+            break;
+        }
+
+        if (fds[1].revents) {
+            uint64_t count;
+            if (read(job->wake_fd, &count, sizeof(count)) < 0) {
+                // Reset already
+            }
+        }
+
+        ssize_t n = 0;
+        if (fds[0].revents) {
+            n = read(out_fd, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                close(out_fd); // The command and anything it left running in the background are done writing
+                out_fd = -1;
+            }
+        }
+
+        pthread_mutex_lock(&jobs_lock);
+        if (n > 0) job_append_output(job, buf, (size_t)n);
+
+        // Followers are only removed here, the ones added since the poll sit behind `followers`
+        for (size_t i = followers; i-- > 0;) {
+            int gone = (fds[2 + i].revents & (POLLHUP | POLLRDHUP | POLLERR)) != 0;
+            if (!gone && (fds[2 + i].revents & POLLIN)) {
+                // Whatever the client sends is ignored
+                gone = tls_recv(job->followers[i].fd, buf, sizeof(buf)) == 0;
+            }
+            if (gone) job_drop_follower(job, i);
+        }
+        for (size_t i = 0; i < job->follower_count;) {
+            if (job_feed_follower(job, &job->followers[i]) != 0) job_drop_follower(job, i);
+            else ++i;
+        }
+        pthread_mutex_unlock(&jobs_lock);
+    }
+
+    int status = 0;
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+            // Retry
+        }
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job->pid = 0;
+    clock_gettime(CLOCK_REALTIME, &job->finished_at);
+    if (pid > 0 && WIFEXITED(status)) {
+        job->exit_code = WEXITSTATUS(status);
+    } else if (pid > 0 && WIFSIGNALED(status)) {
+        job->exit_signal = WTERMSIG(status);
+    }
+    job->state = job->exit_code == 0 ? JOB_SUCCEEDED : JOB_FAILED;
+    if (active_rebuild == job) active_rebuild = NULL;
+
+    struct job_follower followers[JOB_MAX_FOLLOWERS];
+    size_t follower_count = job->follower_count;
+    memcpy(followers, job->followers, follower_count * sizeof(*followers));
+    job->follower_count = 0;
+    pthread_mutex_unlock(&jobs_lock);
+
+    /*
+     * The output is final now and the slot stays busy until we are done, so the rest is sent
+     * without the lock. Each follower gets ADMIN_SEND_TIMEOUT_MS to take it.
+     */
+    for (size_t i = 0; i < follower_count; ++i) {
+        struct iovec rest = { .iov_base = job->output + followers[i].sent,
+                              .iov_len = job->output_len - followers[i].sent };
+        send_segments(followers[i].fd, 0, &rest, 1, 0);
+        tls_close(followers[i].fd);
+        close(followers[i].fd);
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    job->busy = 0;
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+int start_job_executor(void) {
+    for (int i = 0; i < JOB_HISTORY; ++i) {
+        jobs[i].wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (jobs[i].wake_fd < 0) {
+            perror("eventfd for jobs");
+            return -1;
+        }
+    }
+
+    job_pool = thread_pool_create("jobs", server_config.job_workers, server_config.job_queue_capacity, JOB_STACK_SIZE);
+    return job_pool ? 0 : -1;
+}
+
+size_t jobs_busy(void) {
+    size_t busy = 0;
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < JOB_HISTORY; ++i) busy += jobs[i].busy != 0;
+    pthread_mutex_unlock(&jobs_lock);
+    return busy;
+}
+
+void jobs_kill_running(void) {
+    pthread_mutex_lock(&jobs_lock);
+    for (int i = 0; i < JOB_HISTORY; ++i) {
+        // Still unreaped while pid is set (the runner clears it after waitpid()), so is its group
+        if (jobs[i].pid > 0) kill(-jobs[i].pid, SIGKILL);
+    }
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+static void send_job_error(int client_fd, const char *status, const char *message) {
+    char body[128];
+    int len = snprintf(body, sizeof(body), "{\"error\":\"%s\"}", message);
+    send_response(client_fd, status, "application/json", body, (size_t)len);
+}
+
+void handle_admin_rebuild(int client_fd) {
+    if (!server_config.rebuild_command) {
+        send_job_error(client_fd, "503 Service Unavailable", "no rebuild command configured");
+        return;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    struct job *job = active_rebuild;
+    int merged = job != NULL;
+    if (job) {
+        job->requests++;
+    } else {
+        job = job_create("rebuild", server_config.rebuild_command);
+        if (job && thread_pool_submit(job_pool, run_job, job) != 0) {
+            job->id = 0;
+            job->busy = 0;
+            job = NULL;
+        }
+        active_rebuild = job;
+    }
+    uint64_t id = job ? job->id : 0;
+    const char *state = job ? JOB_STATE_NAMES[job->state] : NULL;
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (!job) {
+        send_job_error(client_fd, "503 Service Unavailable", "too many jobs");
+        return;
+    }
+
+    char body[256];
+    int len = snprintf(body, sizeof(body),
+        "{\"id\":%" PRIu64 ",\"state\":\"%s\",\"merged\":%s,"
+        "\"status_url\":\"/jobs/%" PRIu64 "\",\"output_url\":\"/jobs/%" PRIu64 "/output\"}",
+        id, state, merged ? "true" : "false", id, id);
+    send_response(client_fd, "202 Accepted", "application/json", body, (size_t)len);
+}
+
+void handle_job_status(int client_fd, struct http_slice id_text) {
+    uint64_t id;
+    if (parse_job_id(id_text, &id) != 0) {
+        send_404(client_fd);
+        return;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    struct job *found = find_job(id);
+    struct job job;
+    if (found) {
+        job = *found;
+        job.output = NULL; // Not copied, only its length is reported
+    }
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (!found) {
+        send_404(client_fd);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const struct timespec *started = job.state == JOB_QUEUED ? &now : &job.started_at;
+    const struct timespec *finished = job_finished(&job) ? &job.finished_at : &now;
+
+    char started_at[32] = "null", finished_at[32] = "null";
+    if (job.state != JOB_QUEUED) snprintf(started_at, sizeof(started_at), "%.3f", seconds_of(&job.started_at));
+    if (job_finished(&job)) snprintf(finished_at, sizeof(finished_at), "%.3f", seconds_of(&job.finished_at));
+
+    char body[512];
+    int len = snprintf(body, sizeof(body),
+        "{\"id\":%" PRIu64 ",\"type\":\"%s\",\"state\":\"%s\",\"requests\":%u,"
+        "\"queued_at\":%.3f,\"started_at\":%s,\"finished_at\":%s,"
+        "\"wait_seconds\":%.3f,\"run_seconds\":%.3f,\"exit_code\":%d,\"exit_signal\":%d,"
+        "\"output_bytes\":%zu,\"output_truncated\":%s}",
+        job.id, job.type, JOB_STATE_NAMES[job.state], job.requests,
+        seconds_of(&job.queued_at), started_at, finished_at,
+        seconds_of(started) - seconds_of(&job.queued_at),
+        job.state == JOB_QUEUED ? 0.0 : seconds_of(finished) - seconds_of(&job.started_at),
+        job.exit_code, job.exit_signal, job.output_len, job.output_truncated ? "true" : "false");
+    send_response(client_fd, "200 OK", "application/json", body, (size_t)len);
+}
+
+// Copies the output of a finished job. Called with jobs_lock held. Returns NULL if out of memory.
+static char *copy_output(const struct job *job, size_t *len) {
+    *len = job->output_len;
+    char *copy = malloc(job->output_len + 1);
+    if (copy && job->output_len) memcpy(copy, job->output, job->output_len);
+    return copy;
+}
+
+void handle_job_output(int client_fd, struct http_slice id_text) {
+    uint64_t id;
+    if (parse_job_id(id_text, &id) != 0) {
+        send_404(client_fd);
+        return;
+    }
+
+    pthread_mutex_lock(&jobs_lock);
+    struct job *job = find_job(id);
+    if (!job) {
+        pthread_mutex_unlock(&jobs_lock);
+        send_404(client_fd);
+        return;
+    }
+    if (job_finished(job)) {
+        size_t len;
+        char *output = copy_output(job, &len);
+        pthread_mutex_unlock(&jobs_lock);
+        if (!output) send_500(client_fd);
+        else send_response(client_fd, "200 OK", "text/plain; charset=utf-8", output, len);
+        free(output);
+        return;
+    }
+    int full = job->follower_count == JOB_MAX_FOLLOWERS;
+    pthread_mutex_unlock(&jobs_lock);
+
+    if (full) {
+        send_503(client_fd);
+        return;
+    }
+
+    // The job runner takes over the socket and writes the output as it arrives
+    int fd = connection_detach();
+    if (fd < 0) {
+        send_500(client_fd);
+        return;
+    }
+    send_stream_head(fd, "text/plain; charset=utf-8");
+
+    pthread_mutex_lock(&jobs_lock);
+    if (job->id == id && !job_finished(job) && job->follower_count < JOB_MAX_FOLLOWERS) {
+        job->followers[job->follower_count++] = (struct job_follower){ .fd = fd, .sent = 0 };
+        pthread_mutex_unlock(&jobs_lock);
+
+        uint64_t one = 1;
+        if (write(job->wake_fd, &one, sizeof(one)) < 0) {
+            // The runner polls its followers anyway the next time output arrives
+        }
+        return;
+    }
+
+    // Finished in the meantime: the whole output goes out from here
+    size_t len = 0;
+    char *output = job->id == id ? copy_output(job, &len) : NULL;
+    pthread_mutex_unlock(&jobs_lock);
+    struct iovec rest = { .iov_base = output, .iov_len = len };
+    if (output) send_segments(fd, 0, &rest, 1, 0);
+    free(output);
+    tls_close(fd);
+    close(fd);
+}
@@ -0,0 +1,43 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h> // For size_t
+
+#include "http_parser.h"
+
+// Function to start the job executor: ADMIN_JOB_WORKERS threads that run
+// long jobs such as rebuilds, so they never hold a request worker.
+//
+// Returns: 0 on success, -1 if the threads could not be created.
+int start_job_executor(void);
+
+// Function to count the jobs that are queued, running or still sending their
+// output, for a shutdown to wait for.
+size_t jobs_busy(void);
+
+// Function to kill the commands of running jobs, and every process they
+// started, which an upgrade would otherwise leave behind with nobody to wait
+// for them. Their runners
+// finish as if the commands had been killed by anybody else.
+void jobs_kill_running(void);
+
+// Function to answer POST /admin/rebuild. Queues a job running
+// ADMIN_REBUILD_COMMAND and answers 202 with its id right away. While a
+// rebuild is queued or running, further requests are merged into it and get
+// its id. Answers 503 if no command is configured or the executor is full.
+void handle_admin_rebuild(int client_fd);
+
+// Function to answer GET /jobs/{id} with the state and timings of a job as
+// JSON, or 404 if there is no such job (anymore).
+//
+// struct http_slice id: The {id} segment of the path.
+void handle_job_status(int client_fd, struct http_slice id);
+
+// Function to answer GET /jobs/{id}/output with the output of a job. For a
+// job that is still queued or running, the response is streamed as the job
+// writes, and ends once it finished.
+//
+// struct http_slice id: The {id} segment of the path.
+void handle_job_output(int client_fd, struct http_slice id);
+
+#endif // JOBS_H
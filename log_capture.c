@@ -0,0 +1,401 @@
+#define _GNU_SOURCE // For F_SETPIPE_SZ
+#include "log_capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log_follow.h"
+#include "response.h"
+
+#define LOG_STREAMS 2
+#define LOG_MAX_LINE 4096       // Longer lines are split, so one line can't take over the ring
+#define LOG_BYTES_PER_LINE 64   // Expected average, sizes the line index
+#define LOG_DEFAULT_TAIL 100
+#define LOG_MAX_TAIL 10000
+#define LOG_PIPE_SIZE (1024 * 1024) // Kernel buffer to absorb bursts while the reader is descheduled
+
+static const char *const STREAM_NAMES[LOG_STREAMS] = { "stdout", "stderr" };
+
+struct log_line {
+    _Atomic uint64_t start; // Position of the first byte in the ring's byte stream
+    _Atomic uint32_t len;   // Without the newline
+    _Atomic uint64_t seq;   // Order across both streams
+};
+
+/*
+ * The output of one stream: the bytes in a circular buffer, and where each line starts in a
+ * second circular array, so a tail request jumps straight to its first line instead of
+ * searching the bytes for newlines.
+ *
+ * The capture thread is the only writer and never waits for readers; readers never lock. They
+ * copy what they need and then check whether the writer got to it in the meantime, like a
+ * seqlock: before overwriting anything the writer announces how far it is going to write
+ * (`reserved`, `lines_reserved`), so a reader that sees those limits past what it copied knows
+ * its copy may be torn and drops it. Overwriting goes oldest first, so only the oldest lines
+ * of a tail are ever lost that way.
+ */
+struct log_ring {
+    char *data;
+    size_t size;                      // Power of two
+    struct log_line *lines;
+    size_t line_capacity;             // Power of two
+
+    _Atomic uint64_t head;            // Bytes written
+    _Atomic uint64_t reserved;        // Bytes the writer may be writing
+    _Atomic uint64_t line_count;      // Lines published
+    _Atomic uint64_t lines_reserved;  // Lines the writer may be writing
+
+    uint64_t line_start;              // Writer only: start of the line still being received
+    int fd;
+};
+
+static struct log_ring rings[LOG_STREAMS];
+static uint64_t next_seq = 0; // Capture thread only
+static struct encoded_cache compressed_tails = ENCODED_CACHE_INITIALIZER;
+
+// A line copied out of a ring
+struct tail_line {
+    uint64_t seq;
+    const char *text;
+    size_t len;
+};
+
+struct stream_tail {
+    struct tail_line *lines;
+    size_t count;
+    int lapped; // Lines were overwritten during the copy, count is smaller than it should be
+    char *text;
+};
+
+static size_t round_up_pow2(size_t n) {
+    size_t pow2 = 1;
+    while (pow2 < n) pow2 <<= 1;
+    return pow2;
+}
+
+static int ring_init(struct log_ring *ring, size_t size, int fd) {
+    ring->size = round_up_pow2(size);
+    ring->line_capacity = round_up_pow2(ring->size / LOG_BYTES_PER_LINE);
+    ring->data = malloc(ring->size);
+    ring->lines = calloc(ring->line_capacity, sizeof(*ring->lines));
+    if (!ring->data || !ring->lines) return -1;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->reserved, 0);
+    atomic_init(&ring->line_count, 0);
+    atomic_init(&ring->lines_reserved, 0);
+    ring->line_start = 0;
+    ring->fd = fd;
+    return 0;
+}
+
+static void ring_write(struct log_ring *ring, const char *bytes, size_t n) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->reserved, head + n, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t offset = (size_t)(head & (ring->size - 1));
+    size_t first = n < ring->size - offset ? n : ring->size - offset;
+    memcpy(ring->data + offset, bytes, first);
+    memcpy(ring->data, bytes + first, n - first);
+
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+static void ring_publish_line(struct log_ring *ring) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t index = atomic_load_explicit(&ring->line_count, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->lines_reserved, index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    struct log_line *line = &ring->lines[index & (ring->line_capacity - 1)];
+    atomic_store_explicit(&line->start, ring->line_start, memory_order_relaxed);
+    atomic_store_explicit(&line->len, (uint32_t)(head - ring->line_start), memory_order_relaxed);
+    atomic_store_explicit(&line->seq, next_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->line_count, index + 1, memory_order_release);
+
+    if (log_follow_active()) {
+        size_t offset = (size_t)(ring->line_start & (ring->size - 1));
+        size_t len = (size_t)(head - ring->line_start);
+        size_t first = len < ring->size - offset ? len : ring->size - offset;
+        log_follow_line(STREAM_NAMES[ring - rings], next_seq,
+                        ring->data + offset, first, ring->data, len - first);
+    }
+
+    next_seq++;
+    ring->line_start = head;
+}
+
+// Splits what was read into lines. A line without its newline yet stays unpublished.
+static void ring_append(struct log_ring *ring, const char *bytes, size_t n) {
+    while (n > 0) {
+        const char *newline = memchr(bytes, '\n', n);
+        size_t segment = newline ? (size_t)(newline - bytes) : n;
+
+        while (segment > 0) {
+            uint64_t line_len = atomic_load_explicit(&ring->head, memory_order_relaxed) - ring->line_start;
+            size_t take = segment < LOG_MAX_LINE - line_len ? segment : (size_t)(LOG_MAX_LINE - line_len);
+            ring_write(ring, bytes, take);
+            bytes += take;
+            n -= take;
+            segment -= take;
+            if (line_len + take == LOG_MAX_LINE) ring_publish_line(ring);
+        }
+
+        if (newline) {
+            ring_publish_line(ring);
+            bytes++;
+            n--;
+        }
+    }
+}
+
+/*
+ * Drains both pipes as fast as the service writes. The thread does nothing but copy into the
+ * rings, which never fill up, so the service's writes only block if this thread is starved for
+ * longer than the pipe buffer lasts.
+ */
+static void *capture_main(void *arg) {
+    static char buf[64 * 1024];
+    struct pollfd fds[LOG_STREAMS];
+    int open_streams = LOG_STREAMS;
+
+    for (int i = 0; i < LOG_STREAMS; ++i) fds[i] = (struct pollfd){ .fd = rings[i].fd, .events = POLLIN };
+
+    while (open_streams > 0) {
+        if (poll(fds, LOG_STREAMS, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll on service output");
+            break;
+        }
+
+        for (int i = 0; i < LOG_STREAMS; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0) {
+                ring_append(&rings[i], buf, (size_t)n);
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                // The service exited (or closed the stream): keep its last, unterminated line
+                if (atomic_load(&rings[i].head) > rings[i].line_start) ring_publish_line(&rings[i]);
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_streams--;
+            }
+        }
+        log_follow_flush(); // One chunk per wakeup, so followers get whole reads at once
+    }
+    return NULL;
+}
+
+int start_log_capture(int stdout_fd, int stderr_fd) {
+    int fds[LOG_STREAMS] = { stdout_fd, stderr_fd };
+
+    for (int i = 0; i < LOG_STREAMS; ++i) {
+        fcntl(fds[i], F_SETPIPE_SZ, LOG_PIPE_SIZE); // Best effort, capped by /proc/sys/fs/pipe-max-size
+        if (ring_init(&rings[i], server_config.log_buffer_bytes, fds[i]) != 0) {
+            fprintf(stderr, "Failed to allocate the %s log buffer\n", STREAM_NAMES[i]);
+            return -1;
+        }
+    }
+    if (start_log_follow() != 0) {
+        fprintf(stderr, "Warning: /logs/follow is unavailable\n");
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 64 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, &attr, capture_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create for log capture failed: %d\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Copies the last `wanted` lines of a ring. Returns 0 on success (tail->count may be smaller
+ * than wanted when lines were overwritten during the copy), -1 if out of memory.
+ */
+static int ring_tail(struct log_ring *ring, size_t wanted, struct stream_tail *tail) {
+    *tail = (struct stream_tail){ 0 };
+
+    uint64_t count = atomic_load_explicit(&ring->line_count, memory_order_acquire);
+    uint64_t first = count > wanted ? count - wanted : 0;
+    if (count - first > ring->line_capacity) first = count - ring->line_capacity;
+    size_t number = (size_t)(count - first);
+    if (number == 0) return 0;
+
+    tail->lines = malloc(number * sizeof(*tail->lines));
+    uint64_t *starts = malloc(number * sizeof(*starts));
+    if (!tail->lines || !starts) {
+        free(starts);
+        free(tail->lines);
+        tail->lines = NULL;
+        return -1;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < number; ++i) {
+        struct log_line *line = &ring->lines[(first + i) & (ring->line_capacity - 1)];
+        starts[i] = atomic_load_explicit(&line->start, memory_order_relaxed);
+        tail->lines[i].len = atomic_load_explicit(&line->len, memory_order_relaxed);
+        tail->lines[i].seq = atomic_load_explicit(&line->seq, memory_order_relaxed);
+        if (tail->lines[i].len > LOG_MAX_LINE) tail->lines[i].len = 0; // Torn, dropped below
+        total += tail->lines[i].len;
+    }
+
+    tail->text = malloc(total ? total : 1);
+    if (!tail->text) {
+        free(starts);
+        free(tail->lines);
+        tail->lines = NULL;
+        return -1;
+    }
+
+    char *out = tail->text;
+    for (size_t i = 0; i < number; ++i) {
+        size_t offset = (size_t)(starts[i] & (ring->size - 1));
+        size_t len = tail->lines[i].len;
+        size_t part = len < ring->size - offset ? len : ring->size - offset;
+        memcpy(out, ring->data + offset, part);
+        memcpy(out + part, ring->data, len - part);
+        tail->lines[i].text = out;
+        out += len;
+    }
+
+    // Everything the writer may have touched since is unreliable, and that is always a prefix
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t bytes_reserved = atomic_load_explicit(&ring->reserved, memory_order_relaxed);
+    uint64_t lines_reserved = atomic_load_explicit(&ring->lines_reserved, memory_order_relaxed);
+
+    size_t valid = number;
+    while (valid > 0) {
+        size_t i = number - valid;
+        if (first + i + ring->line_capacity >= lines_reserved && starts[i] + ring->size >= bytes_reserved) break;
+        valid--;
+    }
+    memmove(tail->lines, tail->lines + (number - valid), valid * sizeof(*tail->lines));
+    tail->count = valid;
+    tail->lapped = valid < number;
+
+    free(starts);
+    return 0;
+}
+
+static void stream_tail_free(struct stream_tail *tail) {
+    free(tail->lines);
+    free(tail->text);
+}
+
+void handle_logs_tail(int client_fd, const struct http_request *req) {
+    long long wanted = LOG_DEFAULT_TAIL;
+    if (http_query_int(req->query, "lines", &wanted) != 0 || wanted < 1) {
+        const char *error = "lines must be a positive integer\n";
+        send_response(client_fd, "400 Bad Request", "text/plain", error, strlen(error));
+        return;
+    }
+    if (wanted > LOG_MAX_TAIL) wanted = LOG_MAX_TAIL;
+
+    int first_stream = 0, last_stream = LOG_STREAMS - 1;
+    struct http_slice stream = http_query_param(req->query, "stream");
+    if (stream.data) {
+        for (first_stream = 0; first_stream < LOG_STREAMS; ++first_stream) {
+            if (http_slice_equals(stream, STREAM_NAMES[first_stream])) break;
+        }
+        if (first_stream == LOG_STREAMS) {
+            const char *error = "stream must be stdout or stderr\n";
+            send_response(client_fd, "400 Bad Request", "text/plain", error, strlen(error));
+            return;
+        }
+        last_stream = first_stream;
+    }
+
+    if (!rings[0].data) {
+        send_response(client_fd, "200 OK", "text/plain", "", 0); // Nothing captured
+        return;
+    }
+
+    struct stream_tail tails[LOG_STREAMS] = { 0 };
+    int failed = 0;
+    for (int i = first_stream; i <= last_stream; ++i) {
+        if (ring_tail(&rings[i], (size_t)wanted, &tails[i]) != 0) failed = 1;
+    }
+
+    // Both tails are ordered by seq: merge them and keep the newest `wanted` lines
+    size_t available = tails[0].count + tails[1].count;
+    size_t skip = available > (size_t)wanted ? available - (size_t)wanted : 0;
+    size_t body_len = 0;
+    char *body = NULL;
+
+    if (!failed) {
+        for (int pass = 0; pass < 2 && !failed; ++pass) {
+            size_t a = 0, b = 0, emitted = 0;
+            char *out = body;
+            while (a < tails[0].count || b < tails[1].count) {
+                int take_a = b == tails[1].count ||
+                             (a < tails[0].count && tails[0].lines[a].seq < tails[1].lines[b].seq);
+                const struct tail_line *line = take_a ? &tails[0].lines[a++] : &tails[1].lines[b++];
+                if (emitted++ < skip) continue;
+
+                if (pass == 0) {
+                    body_len += line->len + 1;
+                } else {
+                    memcpy(out, line->text, line->len);
+                    out[line->len] = '\n';
+                    out += line->len + 1;
+                }
+            }
+            if (pass == 0 && !(body = malloc(body_len ? body_len : 1))) failed = 1;
+        }
+    }
+
+    /*
+     * Dashboards poll the same window over and over. Its content is fixed by the query and the
+     * newest line in it, since seq counts across both streams, so that is what the compressed
+     * form is cached under. Unless the writer overwrote lines during the copy: the window then
+     * holds other lines than a full copy with the same newest line would, and caching it would
+     * serve them to every later request. Such a body is sent as it is, which is rare enough.
+     */
+    int lapped = tails[0].lapped || tails[1].lapped;
+    enum content_coding coding = failed || lapped ? CONTENT_IDENTITY : response_coding(req, body_len);
+    const struct encoded_body *encoded = NULL;
+    if (coding != CONTENT_IDENTITY) {
+        uint64_t newest = 0;
+        for (int i = first_stream; i <= last_stream; ++i) {
+            if (tails[i].count > 0 && tails[i].lines[tails[i].count - 1].seq > newest) {
+                newest = tails[i].lines[tails[i].count - 1].seq;
+            }
+        }
+        char key[48];
+        snprintf(key, sizeof(key), "%lld:%d:%d", wanted, first_stream, last_stream);
+        encoded = encoded_cache_get(&compressed_tails, key, newest, coding, body, body_len);
+    }
+
+    if (failed) {
+        send_500(client_fd);
+    } else if (encoded) {
+        send_encoded_response(client_fd, "200 OK", "text/plain", coding, encoded->data, encoded->len);
+        encoded_body_release(&compressed_tails, encoded);
+    } else {
+        send_encoded_response(client_fd, "200 OK", "text/plain", CONTENT_IDENTITY, body, body_len);
+    }
+
+    free(body);
+    for (int i = 0; i < LOG_STREAMS; ++i) stream_tail_free(&tails[i]);
+}
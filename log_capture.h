@@ -0,0 +1,24 @@
+#ifndef LOG_CAPTURE_H
+#define LOG_CAPTURE_H
+
+#include "http_parser.h"
+
+// Function to start capturing the output of the monitored service. A reader
+// thread drains both pipes into fixed-size in-memory rings, one per stream,
+// so a chatty service never blocks on a full pipe and memory use stays
+// constant: the oldest lines are overwritten.
+//
+// int stdout_fd, int stderr_fd: Read ends of the pipes connected to the
+//                               service's stdout and stderr. Ownership
+//                               passes to the capture.
+//
+// Returns: 0 on success, -1 if the rings or the thread could not be created.
+int start_log_capture(int stdout_fd, int stderr_fd);
+
+// Function to answer GET /logs/tail?lines=N&stream=stdout|stderr
+// Responds with the last N captured lines (default 100), oldest first, of
+// one stream or, without `stream`, of both interleaved in the order they
+// were read.
+void handle_logs_tail(int client_fd, const struct http_request *req);
+
+#endif // LOG_CAPTURE_H
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE // For memmem()
+#include "log_follow.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "event_loop.h"
+#include "response.h"
+#include "tls.h"
+
+#define FOLLOW_MAX_SUBSCRIBERS 64
+#define FOLLOW_MAX_LAG_BYTES (4 * 1024 * 1024) // A subscriber further behind skips ahead
+#define FOLLOW_HEARTBEAT_MS 15000              // Keeps proxies from closing a quiet stream
+#define FOLLOW_IOV_MAX 16
+#define FOLLOW_EVENTS_PER_WAIT 64
+#define FOLLOW_HELD_BYTES 4608 // The rest of the longest event (a 4096 byte line) and a notice
+
+static const char HEARTBEAT[] = ": keep-alive\n\n";
+
+/*
+ * The events of one batch of captured lines, formatted once. Chunks form a list in publishing
+ * order, and every subscriber sends straight from it: a line is never copied per subscriber.
+ *
+ * A chunk is referenced by the link from its predecessor, by last_chunk while it is the newest,
+ * and by each subscriber positioned on it. Freeing a chunk drops its link to the next one, so
+ * once the slowest subscriber moves on, everything behind it is released in order.
+ */
+struct follow_chunk {
+    _Atomic(struct follow_chunk *) next;
+    atomic_int refs;
+    uint64_t lines;       // Lines in this chunk
+    uint64_t end_lines;   // Lines published up to and including this chunk
+    uint64_t end_bytes;   // Bytes published up to and including this chunk
+    size_t len;
+    char data[];
+};
+
+struct subscriber {
+    int fd;
+    struct follow_chunk *chunk; // Referenced, the next byte to send is in it or after it
+    size_t offset;
+    char held[FOLLOW_HELD_BYTES]; // Sent before the chunks, see subscriber_check_lag()
+    size_t held_len;
+    size_t held_sent;
+    int writable;               // Edge-triggered: set by EPOLLOUT, cleared by EAGAIN
+    int closed;
+    struct subscriber *next;
+};
+
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct follow_chunk *last_chunk = NULL;  // Guarded by publish_lock
+static struct subscriber *pending = NULL;       // Guarded by publish_lock, not yet adopted by the thread
+static atomic_int subscriber_count;
+static _Atomic long long last_publish_ms;
+
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+// The chunk the capture thread is filling
+static struct follow_chunk *building = NULL;
+static size_t building_capacity = 0;
+static int building_failed = 0;
+
+static void chunk_ref(struct follow_chunk *chunk) {
+    atomic_fetch_add_explicit(&chunk->refs, 1, memory_order_relaxed);
+}
+
+static void chunk_unref(struct follow_chunk *chunk) {
+    while (chunk && atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) == 1) {
+        struct follow_chunk *next = atomic_load_explicit(&chunk->next, memory_order_acquire);
+        free(chunk);
+        chunk = next; // Its link reference goes with the freed chunk
+    }
+}
+
+static void wake_thread(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter can only overflow if the thread is stuck, it will see the data regardless
+    }
+}
+
+// Appends a chunk to the list, taking ownership of it
+static void publish_chunk(struct follow_chunk *chunk) {
+    atomic_init(&chunk->next, NULL);
+    atomic_init(&chunk->refs, 2); // The link from the previous chunk, and last_chunk
+
+    pthread_mutex_lock(&publish_lock);
+    struct follow_chunk *previous = last_chunk;
+    chunk->end_lines = previous->end_lines + chunk->lines;
+    chunk->end_bytes = previous->end_bytes + chunk->len;
+    atomic_store_explicit(&previous->next, chunk, memory_order_release);
+    last_chunk = chunk;
+    pthread_mutex_unlock(&publish_lock);
+
+    chunk_unref(previous); // No longer the newest
+    atomic_store(&last_publish_ms, monotonic_ms());
+    wake_thread();
+}
+
+int log_follow_active(void) {
+    return atomic_load_explicit(&subscriber_count, memory_order_relaxed) > 0;
+}
+
+static char *building_reserve(size_t extra) {
+    size_t len = building ? building->len : 0;
+    if (building && len + extra <= building_capacity) return building->data + len;
+
+    size_t capacity = building_capacity ? building_capacity : 4096;
+    while (capacity < len + extra) capacity *= 2;
+
+    struct follow_chunk *grown = realloc(building, sizeof(*grown) + capacity);
+    if (!grown) return NULL;
+    if (!building) {
+        grown->len = 0;
+        grown->lines = 0;
+    }
+    building = grown;
+    building_capacity = capacity;
+    return building->data + len;
+}
+
+// Copies one part of a line. A CR would end the SSE field early, so it becomes a space.
+static char *copy_line_part(char *out, const char *part, size_t len) {
+    memcpy(out, part, len);
+    for (char *cr = memchr(out, '\r', len); cr; cr = memchr(cr, '\r', (size_t)(out + len - cr))) *cr = ' ';
+    return out + len;
+}
+
+void log_follow_line(const char *stream, uint64_t seq,
+                     const char *part1, size_t len1, const char *part2, size_t len2) {
+    if (building_failed) return;
+
+    char head[80];
+    int head_len = snprintf(head, sizeof(head), "id: %llu\nevent: %s\ndata: ", (unsigned long long)seq, stream);
+    char *out = building_reserve((size_t)head_len + len1 + len2 + 2);
+    if (!out) {
+        building_failed = 1; // The batch is dropped as a whole, a half batch would look complete
+        return;
+    }
+
+    memcpy(out, head, (size_t)head_len);
+    out = copy_line_part(out + head_len, part1, len1);
+    out = copy_line_part(out, part2, len2);
+    out[0] = out[1] = '\n';
+    building->len += (size_t)head_len + len1 + len2 + 2;
+    building->lines++;
+}
+
+void log_follow_flush(void) {
+    if (building_failed) {
+        if (building) building->len = building->lines = 0;
+        building_failed = 0;
+        return;
+    }
+    if (!building || building->len == 0) return;
+
+    publish_chunk(building);
+    building = NULL;
+    building_capacity = 0;
+}
+
+static void publish_heartbeat(void) {
+    struct follow_chunk *chunk = malloc(sizeof(*chunk) + sizeof(HEARTBEAT) - 1);
+    if (!chunk) return;
+    chunk->lines = 0;
+    chunk->len = sizeof(HEARTBEAT) - 1;
+    memcpy(chunk->data, HEARTBEAT, chunk->len);
+    publish_chunk(chunk);
+}
+
+static void subscriber_drop(struct subscriber *sub) {
+    tls_close(sub->fd);
+    close(sub->fd); // Also removes it from the epoll set
+    chunk_unref(sub->chunk);
+    free(sub);
+    atomic_fetch_sub(&subscriber_count, 1);
+}
+
+static void subscriber_advance(struct subscriber *sub, size_t sent) {
+    size_t held_left = sub->held_len - sub->held_sent;
+    size_t from_held = sent < held_left ? sent : held_left;
+    sub->held_sent += from_held;
+    sent -= from_held;
+    if (sub->held_sent == sub->held_len) sub->held_len = sub->held_sent = 0;
+
+    while (1) {
+        size_t left = sub->chunk->len - sub->offset;
+        if (sent < left) {
+            sub->offset += sent;
+            return;
+        }
+        sent -= left;
+        sub->offset = sub->chunk->len;
+
+        // Moving on as soon as a chunk is done releases it without waiting for more data
+        struct follow_chunk *next = atomic_load_explicit(&sub->chunk->next, memory_order_acquire);
+        if (!next) return;
+        chunk_ref(next);
+        chunk_unref(sub->chunk);
+        sub->chunk = next;
+        sub->offset = 0;
+    }
+}
+
+// Counts the events in a chunk from an event boundary on
+static uint64_t lines_after(const struct follow_chunk *chunk, size_t offset) {
+    if (chunk->lines == 0) return 0; // A heartbeat, a comment rather than an event
+    uint64_t lines = 0;
+    const char *end = chunk->data + chunk->len;
+    for (const char *p = chunk->data + offset; (p = memmem(p, (size_t)(end - p), "\n\n", 2)); p += 2) lines++;
+    return lines;
+}
+
+/*
+ * A subscriber that doesn't keep up must neither hold on to an unbounded list of chunks nor
+ * slow anybody else down. It keeps a copy of the rest of the event it is in the middle of,
+ * jumps to the newest chunk, which releases everything it held, and is told how many lines it
+ * missed. One that falls that far behind again before even that went out is not reading at
+ * all, and is dropped.
+ */
+static int subscriber_check_lag(struct subscriber *sub, uint64_t newest_bytes) {
+    struct follow_chunk *chunk = sub->chunk;
+    uint64_t sent = chunk->end_bytes - chunk->len + sub->offset;
+    if (newest_bytes - sent <= FOLLOW_MAX_LAG_BYTES) return 0;
+    if (sub->held_len) return -1;
+
+    // Events never span chunks, so the current one ends in this chunk
+    size_t event_end = sub->offset;
+    if (event_end > 0 && event_end < chunk->len &&
+        !(event_end >= 2 && chunk->data[event_end - 1] == '\n' && chunk->data[event_end - 2] == '\n')) {
+        const char *end = memmem(chunk->data + event_end - 1, chunk->len - event_end + 1, "\n\n", 2);
+        if (!end) return -1;
+        event_end = (size_t)(end - chunk->data) + 2;
+    }
+    size_t rest = event_end - sub->offset;
+    if (rest > sizeof(sub->held) - 64) return -1;
+    memcpy(sub->held, chunk->data + sub->offset, rest);
+
+    uint64_t delivered = chunk->end_lines - lines_after(chunk, event_end);
+
+    pthread_mutex_lock(&publish_lock);
+    struct follow_chunk *target = last_chunk;
+    chunk_ref(target);
+    pthread_mutex_unlock(&publish_lock);
+
+    int len = snprintf(sub->held + rest, sizeof(sub->held) - rest, "event: skipped\ndata: %llu\n\n",
+                       (unsigned long long)(target->end_lines - delivered));
+    sub->held_len = rest + (size_t)len;
+    sub->held_sent = 0;
+
+    chunk_unref(chunk);
+    sub->chunk = target;
+    sub->offset = target->len;
+    return 0;
+}
+
+// Sends as much as the socket takes. Returns 0, or -1 if the subscriber is gone.
+static int subscriber_flush(struct subscriber *sub) {
+    while (sub->writable) {
+        struct iovec iov[FOLLOW_IOV_MAX];
+        int count = 0;
+
+        if (sub->held_sent < sub->held_len) {
+            iov[count++] = (struct iovec){ sub->held + sub->held_sent, sub->held_len - sub->held_sent };
+        }
+        size_t offset = sub->offset;
+        for (struct follow_chunk *chunk = sub->chunk; chunk && count < FOLLOW_IOV_MAX;
+             chunk = atomic_load_explicit(&chunk->next, memory_order_acquire)) {
+            if (offset < chunk->len) iov[count++] = (struct iovec){ chunk->data + offset, chunk->len - offset };
+            offset = 0;
+        }
+        if (count == 0) return 0; // Caught up
+
+        ssize_t n = tls_sendmsg(sub->fd, iov, (size_t)count, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sub->writable = 0;
+                return 0;
+            }
+            return -1;
+        }
+        subscriber_advance(sub, (size_t)n);
+    }
+    return 0;
+}
+
+// Discards whatever the client sends. Returns -1 once it closed its side.
+static int subscriber_drain_input(struct subscriber *sub) {
+    char buf[512];
+    while (1) {
+        ssize_t n = tls_recv(sub->fd, buf, sizeof(buf));
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+}
+
+/*
+ * All subscribers are served from this one thread with non-blocking sends, so a slow client
+ * costs nothing but its own lag, and the capture thread only ever appends to the list.
+ */
+static void *follow_main(void *arg) {
+    struct epoll_event events[FOLLOW_EVENTS_PER_WAIT];
+    struct subscriber *subscribers = NULL;
+
+    while (1) {
+        long long idle_ms = monotonic_ms() - atomic_load(&last_publish_ms);
+        int timeout_ms = !subscribers ? -1 : idle_ms >= FOLLOW_HEARTBEAT_MS ? 0 : (int)(FOLLOW_HEARTBEAT_MS - idle_ms);
+
+        int n = epoll_wait(epoll_fd, events, FOLLOW_EVENTS_PER_WAIT, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait in log follow");
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct subscriber *sub = events[i].data.ptr;
+            if (!sub) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0) {
+                    // Already reset by an earlier event
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) sub->closed = 1;
+            if (events[i].events & EPOLLOUT) sub->writable = 1;
+            if ((events[i].events & EPOLLIN) && subscriber_drain_input(sub) != 0) sub->closed = 1;
+        }
+
+        pthread_mutex_lock(&publish_lock);
+        struct subscriber *adopted = pending;
+        pending = NULL;
+        pthread_mutex_unlock(&publish_lock);
+
+        while (adopted) {
+            struct subscriber *sub = adopted;
+            adopted = sub->next;
+
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = sub };
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sub->fd, &ev) != 0) {
+                subscriber_drop(sub);
+                continue;
+            }
+            sub->writable = 1;
+            sub->next = subscribers;
+            subscribers = sub;
+        }
+
+        if (subscribers && monotonic_ms() - atomic_load(&last_publish_ms) >= FOLLOW_HEARTBEAT_MS) {
+            publish_heartbeat();
+        }
+
+        pthread_mutex_lock(&publish_lock);
+        uint64_t newest_bytes = last_chunk->end_bytes;
+        pthread_mutex_unlock(&publish_lock);
+
+        for (struct subscriber **link = &subscribers; *link;) {
+            struct subscriber *sub = *link;
+            if (sub->closed || subscriber_check_lag(sub, newest_bytes) != 0 || subscriber_flush(sub) != 0) {
+                *link = sub->next;
+                subscriber_drop(sub);
+                continue;
+            }
+            link = &sub->next;
+        }
+    }
+    return NULL;
+}
+
+// Undoes a start_log_follow() that failed half-way: requests then get 503
+static void close_follow_fds(void) {
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (wake_fd >= 0) close(wake_fd);
+    epoll_fd = -1;
+    wake_fd = -1;
+}
+
+int start_log_follow(void) {
+    last_chunk = calloc(1, sizeof(*last_chunk)); // Empty start of the list
+    if (!last_chunk) return -1;
+    atomic_init(&last_chunk->refs, 1);
+    atomic_init(&last_chunk->next, NULL);
+    atomic_init(&subscriber_count, 0);
+    atomic_init(&last_publish_ms, monotonic_ms());
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != 0) {
+        perror("log follow setup");
+        close_follow_fds();
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 64 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, &attr, follow_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create for log follow failed: %d\n", err);
+        close_follow_fds();
+        return -1;
+    }
+    return 0;
+}
+
+void handle_logs_follow(int client_fd, const struct http_request *req) {
+    if (epoll_fd < 0) {
+        send_503(client_fd); // Nothing is captured
+        return;
+    }
+    if (atomic_fetch_add(&subscriber_count, 1) >= FOLLOW_MAX_SUBSCRIBERS) {
+        atomic_fetch_sub(&subscriber_count, 1);
+        send_503(client_fd);
+        return;
+    }
+
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    int fd = sub ? connection_detach() : -1;
+    if (fd < 0) {
+        free(sub);
+        atomic_fetch_sub(&subscriber_count, 1);
+        send_500(client_fd);
+        return;
+    }
+
+    send_stream_head(fd, "text/event-stream");
+    sub->fd = fd;
+
+    // Lines published from here on are this subscriber's, none can slip in before it is adopted
+    pthread_mutex_lock(&publish_lock);
+    sub->chunk = last_chunk;
+    chunk_ref(sub->chunk);
+    sub->offset = sub->chunk->len;
+    sub->next = pending;
+    pending = sub;
+    pthread_mutex_unlock(&publish_lock);
+
+    wake_thread();
+}
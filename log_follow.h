@@ -0,0 +1,40 @@
+#ifndef LOG_FOLLOW_H
+#define LOG_FOLLOW_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+#include "http_parser.h"
+
+// Function to start the thread that streams captured log lines to
+// /logs/follow subscribers.
+//
+// Returns: 0 on success, -1 if the thread could not be created.
+int start_log_follow(void);
+
+// Function to tell the log capture whether anybody follows, so that it only
+// formats events when they are sent somewhere.
+// Returns: 1 if there is at least one subscriber, 0 otherwise.
+int log_follow_active(void);
+
+// Function to add a captured line to the batch being built. Called by the
+// log capture thread only. The line may be split in two parts where it wraps
+// around the capture ring.
+//
+// const char *stream: "stdout" or "stderr", sent as the event type.
+// uint64_t seq: Sequence number of the line, sent as the event id.
+void log_follow_line(const char *stream, uint64_t seq,
+                     const char *part1, size_t len1, const char *part2, size_t len2);
+
+// Function to hand the lines added since the last call to all subscribers.
+// Called by the log capture thread only.
+void log_follow_flush(void);
+
+// Function to answer GET /logs/follow with a Server-Sent Events stream of
+// the lines captured from now on, one event per line. The connection is
+// taken over by the follow thread and stays open until the client leaves.
+// A subscriber that falls too far behind skips ahead and receives a
+// "skipped" event with the number of lines it missed.
+void handle_logs_follow(int client_fd, const struct http_request *req);
+
+#endif // LOG_FOLLOW_H
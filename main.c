@@ -3,10 +3,18 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "auth.h"
+#include "config.h"
+#include "cpus.h"
+#include "jobs.h"
+#include "metrics_service.h"
+#include "request.h"
 #include "server.h"
 #include "signal.h"
 #include "service_manager.h"
+#include "tls.h"
+#include "upgrade.h"
 
 int main(int argc, char *argv[]) {
 
@@ -22,6 +30,19 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    upgrade_init(argv); // Also picks up what an upgraded process handed over
+    load_server_config();
+    block_sigpipe(); // Before any thread is started, they inherit the mask
+    int signal_fd = open_signal_fd(); // Same
+    if (signal_fd < 0) return EXIT_FAILURE;
+    if (cpus_init() != 0) return EXIT_FAILURE; // Same for the CPU affinity
+    if (init_request_routes() != 0) return EXIT_FAILURE;
+    if (tls_init() != 0) {
+        fprintf(stderr, "Failed to load the TLS certificate or key, exiting.\n");
+        return EXIT_FAILURE;
+    }
+    if (admission_init() != 0) return EXIT_FAILURE;
+
     // Parse port
     int port = atoi(argv[1]);
     if (port <= 0 || port > 65535) {
@@ -64,19 +85,33 @@ int main(int argc, char *argv[]) {
      size of an array (char* argv[]) and the other (char** argv) would give us the size of the pointer.
      */
 
-    if (start_monitored_service(service_argv[0], service_argv) != 0) {
-        fprintf(stderr, "Failed to launch monitored service, exiting.\n");
+    if (start_services(service_argv[0], service_argv) != 0) {
+        fprintf(stderr, "Failed to launch the services, exiting.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (start_metrics_sampler() != 0) {
+        fprintf(stderr, "Failed to start the metrics sampler, exiting.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (start_job_executor() != 0) {
+        fprintf(stderr, "Failed to start the job executor, exiting.\n");
         return EXIT_FAILURE;
     }
 
     //init_auth_or_exit();
-    install_signal_handlers(); // handle SIGINT, SIGTERM
-    int server_fd = start_server(port); // Bind & listen
+    int server_fd = start_server(port); // Bind & listen, or take over the upgraded process's sockets
+    if (server_fd < 0) {
+        fprintf(stderr, "Failed to listen on port %d, exiting.\n", port);
+        return EXIT_FAILURE;
+    }
 
-    printf("Starting server on port %d\n", port);
+    printf("%s server on port %d\n", upgrade_resumed() ? "Resumed" : "Starting", port);
 
-    accept_clients(server_fd); // Thread per request here
+    // Event loop feeding the request worker pool, only returns if it could not be set up
+    accept_clients(server_fd, signal_fd);
 
     close(server_fd);
-    return 0;
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,373 @@
+#include "metrics_history.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "response.h"
+
+#define HISTORY_MAGIC 0x54534948u // "HIST"
+#define HISTORY_VERSION 1
+
+/*
+ * Three rings per metric, every sample is merged into all of them at once, so no rollup job is
+ * needed and every resolution is always up to date:
+ *   1 s points for 15 minutes, 10 s points for 3 hours, 1 min points for 24 hours.
+ */
+#define HISTORY_LEVELS 3
+static const struct history_level {
+    int64_t resolution; // Seconds per point
+    size_t capacity;    // Points in the ring
+    size_t base;        // Index of the first point in history_store.points
+} LEVELS[HISTORY_LEVELS] = {
+    { 1, 900, 0 },
+    { 10, 1080, 900 },
+    { 60, 1440, 1980 },
+};
+#define HISTORY_POINTS_PER_METRIC 3420
+
+static const char *const METRIC_NAMES[HISTORY_METRIC_COUNT] = {
+    "monitored_service_memory_bytes",
+    "monitored_service_cpu_seconds_total",
+    "monitored_service_thread_count",
+    "admin_service_thread_count",
+};
+
+static const int METRIC_IS_COUNTER[HISTORY_METRIC_COUNT] = { 0, 1, 0, 0 };
+
+// Aggregate of the samples that fell into one point. A slot whose time doesn't match the
+// expected point time holds data from an earlier lap of the ring and counts as empty.
+struct history_point {
+    int64_t time;
+    double min;
+    double max;
+    double sum;
+    double last;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+/*
+ * Plain fixed-size data without pointers, so the same layout works in anonymous memory and in a
+ * mapped file. The header tells whether a file found at startup was written with this layout.
+ */
+struct history_store {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t metric_count;
+    uint32_t points_per_metric;
+    struct history_point points[HISTORY_METRIC_COUNT][HISTORY_POINTS_PER_METRIC];
+};
+
+static struct history_store *store = NULL;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void store_reset(struct history_store *s) {
+    memset(s, 0, sizeof(*s));
+    s->magic = HISTORY_MAGIC;
+    s->version = HISTORY_VERSION;
+    s->metric_count = HISTORY_METRIC_COUNT;
+    s->points_per_metric = HISTORY_POINTS_PER_METRIC;
+}
+
+static struct history_store *map_history_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open history file");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(struct history_store)) != 0) {
+        perror("ftruncate history file");
+        close(fd);
+        return NULL;
+    }
+
+    struct history_store *mapped = mmap(NULL, sizeof(*mapped), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file referenced
+    if (mapped == MAP_FAILED) {
+        perror("mmap history file");
+        return NULL;
+    }
+
+    // A new file reads as zeros, a file from an older layout is started over
+    if (mapped->magic != HISTORY_MAGIC || mapped->version != HISTORY_VERSION ||
+        mapped->metric_count != HISTORY_METRIC_COUNT || mapped->points_per_metric != HISTORY_POINTS_PER_METRIC) {
+        store_reset(mapped);
+    }
+    return mapped;
+}
+
+int metrics_history_init(void) {
+    const char *path = server_config.metrics_history_file;
+
+    if (path && *path) {
+        store = map_history_file(path);
+    } else {
+        store = mmap(NULL, sizeof(*store), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (store == MAP_FAILED) store = NULL;
+        if (store) store_reset(store);
+    }
+    return store ? 0 : -1;
+}
+
+static struct history_point *point_at(enum history_metric metric, const struct history_level *level, int64_t time) {
+    size_t slot = (size_t)(time / level->resolution) % level->capacity;
+    return &store->points[metric][level->base + slot];
+}
+
+void metrics_history_record(enum history_metric metric, time_t now, double value) {
+    if (!store || now < 0) return;
+
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < HISTORY_LEVELS; ++i) {
+        int64_t start = (int64_t)now - (int64_t)now % LEVELS[i].resolution;
+        struct history_point *point = point_at(metric, &LEVELS[i], start);
+
+        if (point->time != start || point->count == 0) {
+            *point = (struct history_point){ .time = start, .min = value, .max = value };
+        }
+        if (value < point->min) point->min = value;
+        if (value > point->max) point->max = value;
+        point->sum += value;
+        point->last = value;
+        point->count++;
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+struct json_out {
+    char *data;
+    size_t len;
+    size_t capacity;
+    int failed;
+};
+
+static void json_appendf(struct json_out *out, const char *fmt, ...) {
+    while (!out->failed) {
+        size_t room = out->capacity - out->len;
+        va_list args;
+        va_start(args, fmt);
+        int n = out->data ? vsnprintf(out->data + out->len, room, fmt, args) : -1;
+        va_end(args);
+        if (n >= 0 && (size_t)n < room) {
+            out->len += (size_t)n;
+            return;
+        }
+
+        size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+        char *grown = realloc(out->data, capacity);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t rank = (size_t)(p * (double)count + 0.999999);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+static int level_covers(const struct history_level *level, int64_t now, int64_t from) {
+    return now - level->resolution * (int64_t)(level->capacity - 1) <= from;
+}
+
+/*
+ * Picks the coarsest ring that still has points at most `step` apart for the whole range, so
+ * the fewest points are visited. If no ring is fine enough, the step is widened to fit the
+ * finest ring that covers the range.
+ */
+static const struct history_level *choose_level(int64_t now, int64_t from, long long step) {
+    const struct history_level *chosen = NULL;
+
+    for (int i = 0; i < HISTORY_LEVELS; ++i) {
+        if (LEVELS[i].resolution <= step && level_covers(&LEVELS[i], now, from)) chosen = &LEVELS[i];
+    }
+    if (chosen) return chosen;
+
+    for (int i = 0; i < HISTORY_LEVELS; ++i) {
+        if (level_covers(&LEVELS[i], now, from)) return &LEVELS[i];
+    }
+    return &LEVELS[HISTORY_LEVELS - 1];
+}
+
+struct step_aggregate {
+    int64_t start;
+    double min;
+    double max;
+    double sum;
+    uint32_t count;
+    double last;
+    int64_t last_time;
+};
+
+static void emit_step(struct json_out *out, const struct step_aggregate *agg, int is_counter,
+                      int has_base, double base_value, int64_t base_time, int *first) {
+    if (agg->count == 0) return;
+
+    json_appendf(out, "%s{\"t\":%lld,\"min\":%.10g,\"max\":%.10g,\"avg\":%.10g",
+                 *first ? "" : ",", (long long)agg->start, agg->min, agg->max, agg->sum / agg->count);
+    if (is_counter && has_base && agg->last >= base_value && agg->last_time > base_time) {
+        json_appendf(out, ",\"rate\":%.10g", (agg->last - base_value) / (double)(agg->last_time - base_time));
+    }
+    json_appendf(out, "}");
+    *first = 0;
+}
+
+static void send_history_error(int client_fd, const char *message) {
+    char body[128];
+    int len = snprintf(body, sizeof(body), "{\"error\":\"%s\"}", message);
+    send_response(client_fd, "400 Bad Request", "application/json", body, (size_t)len);
+}
+
+void handle_metrics_history(int client_fd, const struct http_request *req) {
+    if (!store) {
+        send_500(client_fd);
+        return;
+    }
+
+    struct http_slice name = http_query_param(req->query, "metric");
+    int metric = -1;
+    for (int i = 0; i < HISTORY_METRIC_COUNT && name.data; ++i) {
+        if (http_slice_equals(name, METRIC_NAMES[i])) metric = i;
+    }
+    if (metric < 0) {
+        send_history_error(client_fd, "unknown or missing metric");
+        return;
+    }
+
+    int64_t now = (int64_t)time(NULL);
+    long long from = -3600, to = 0, step = 0;
+    if (http_query_int(req->query, "from", &from) != 0 || http_query_int(req->query, "to", &to) != 0 ||
+        http_query_int(req->query, "step", &step) != 0 || step < 0) {
+        send_history_error(client_fd, "from, to and step must be integers");
+        return;
+    }
+    if (from <= 0) from += now;
+    if (to <= 0) to += now;
+    if (to > now) to = now;
+
+    const struct history_level *level = choose_level(now, from, step > 0 ? step : 1);
+    int64_t resolution = level->resolution;
+    int64_t oldest = now - now % resolution - resolution * (int64_t)(level->capacity - 1);
+    if (from < oldest) from = oldest;
+    if (step < resolution) step = resolution;
+    step = (step + resolution - 1) / resolution * resolution;
+    if (from > to) {
+        send_history_error(client_fd, "empty range");
+        return;
+    }
+
+    int is_counter = METRIC_IS_COUNTER[metric];
+    double *values = malloc(level->capacity * sizeof(*values));
+    struct json_out out = { 0 };
+    if (!values) {
+        send_500(client_fd);
+        return;
+    }
+
+    json_appendf(&out, "{\"metric\":\"%s\",\"from\":%lld,\"to\":%lld,\"step\":%lld,\"resolution\":%lld,\"points\":[",
+                 METRIC_NAMES[metric], from, to, step, (long long)resolution);
+
+    size_t value_count = 0;
+    double range_min = 0, range_max = 0;
+    int first = 1;
+
+    // Previous valid point, the baseline for counter rates. The point just before the range counts.
+    int has_prev = 0;
+    double prev_value = 0;
+    int64_t prev_time = 0;
+
+    // Baseline of the step being aggregated
+    int has_base = 0;
+    double base_value = 0;
+    int64_t base_time = 0;
+
+    int64_t step_start = from - from % step;
+    struct step_aggregate agg = { .start = step_start };
+
+    pthread_mutex_lock(&store_lock);
+
+    int64_t t = from - from % resolution;
+    const struct history_point *before = point_at(metric, level, t - resolution);
+    if (t - resolution >= oldest && before->time == t - resolution && before->count > 0) {
+        has_prev = 1;
+        prev_value = before->last;
+        prev_time = before->time;
+    }
+    has_base = has_prev;
+    base_value = prev_value;
+    base_time = prev_time;
+
+    for (; t <= to; t += resolution) {
+        if (t >= step_start + step) {
+            emit_step(&out, &agg, is_counter, has_base, base_value, base_time, &first);
+            step_start += step;
+            while (t >= step_start + step) step_start += step;
+            agg = (struct step_aggregate){ .start = step_start };
+            has_base = has_prev;
+            base_value = prev_value;
+            base_time = prev_time;
+        }
+
+        const struct history_point *point = point_at(metric, level, t);
+        if (point->time != t || point->count == 0) continue;
+
+        if (agg.count == 0 || point->min < agg.min) agg.min = point->min;
+        if (agg.count == 0 || point->max > agg.max) agg.max = point->max;
+        agg.sum += point->sum;
+        agg.count += point->count;
+        agg.last = point->last;
+        agg.last_time = point->time;
+
+        if (value_count == 0 || point->min < range_min) range_min = point->min;
+        if (value_count == 0 || point->max > range_max) range_max = point->max;
+
+        // Percentiles are taken over the average of each point, or over per-point rates for counters
+        if (!is_counter) {
+            values[value_count++] = point->sum / point->count;
+        } else if (has_prev && point->last >= prev_value) {
+            values[value_count++] = (point->last - prev_value) / (double)(point->time - prev_time);
+        }
+
+        has_prev = 1;
+        prev_value = point->last;
+        prev_time = point->time;
+    }
+    emit_step(&out, &agg, is_counter, has_base, base_value, base_time, &first);
+
+    pthread_mutex_unlock(&store_lock);
+
+    json_appendf(&out, "],\"summary\":{\"samples\":%zu", value_count);
+    if (value_count > 0) {
+        qsort(values, value_count, sizeof(*values), compare_doubles);
+        double sum = 0;
+        for (size_t i = 0; i < value_count; ++i) sum += values[i];
+
+        json_appendf(&out, ",\"min\":%.10g,\"max\":%.10g,\"%s\":%.10g,\"p50\":%.10g,\"p90\":%.10g,\"p99\":%.10g",
+                     range_min, range_max, is_counter ? "avg_rate" : "avg", sum / (double)value_count,
+                     percentile(values, value_count, 0.50), percentile(values, value_count, 0.90),
+                     percentile(values, value_count, 0.99));
+    }
+    json_appendf(&out, "}}");
+    free(values);
+
+    if (out.failed) send_500(client_fd);
+    else send_response(client_fd, "200 OK", "application/json", out.data, out.len);
+    free(out.data);
+}
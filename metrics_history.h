@@ -0,0 +1,37 @@
+#ifndef METRICS_HISTORY_H
+#define METRICS_HISTORY_H
+
+#include <time.h> // For time_t
+
+#include "http_parser.h"
+
+// The series kept in the history. Counters are reported with their rate.
+enum history_metric {
+    HISTORY_SERVICE_MEMORY_BYTES,
+    HISTORY_SERVICE_CPU_SECONDS,      // Counter, its rate is the number of cores in use
+    HISTORY_SERVICE_THREADS,
+    HISTORY_ADMIN_THREADS,
+    HISTORY_METRIC_COUNT
+};
+
+// Function to set up the history store. With ADMIN_METRICS_HISTORY_FILE set
+// the store is a memory-mapped file, so the history survives restarts and is
+// available immediately; otherwise it lives in anonymous memory. Either way
+// its size is fixed.
+//
+// Returns: 0 on success, -1 if the memory or the file could not be mapped.
+int metrics_history_init(void);
+
+// Function to add a sample. Called by the metrics sampler only.
+//
+// time_t now: Wall-clock time of the sample.
+void metrics_history_record(enum history_metric metric, time_t now, double value);
+
+// Function to answer GET /metrics/history?metric=...&from=...&to=...&step=...
+// from/to are Unix timestamps, or seconds relative to now when negative
+// (from defaults to -3600, to to now). step is the width of a returned point
+// in seconds. Responds with JSON points (min, max, avg, and rate for
+// counters) and a summary with percentiles over the range.
+void handle_metrics_history(int client_fd, const struct http_request *req);
+
+#endif // METRICS_HISTORY_H
@@ -1,122 +1,382 @@
+#include "metrics_service.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+
+#include "admission.h"
+#include "config.h"
+#include "metrics_history.h"
+#include "process_tree.h"
+#include "response.h"
 #include "service_manager.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+#include "tls.h"
 
-long get_rss_memory_kb(pid_t pid) {
-    char path[64];
-    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+// Room kept in front of the body for the response head, written once the body length is known
+#define SNAPSHOT_HEAD_RESERVE 128
+#define SNAPSHOT_INITIAL_CAPACITY 4096
+// How long the sampler waits for scrapers to finish with a buffer before skipping a sample
+#define SNAPSHOT_REUSE_WAIT_MS 100
 
-    FILE *f = fopen(path, "r");
-    if (!f) return -1;
+/*
+ * The procfs files of one process, opened once and re-read with pread(). Reading from offset 0
+ * of an open /proc file regenerates its content, so no open/close is needed per sample.
+ */
+struct proc_files {
+    pid_t pid;
+    int stat_fd;
+    int status_fd;
+};
 
-    char line[256];
-    long kb = -1;
+struct process_sample {
+    long rss_kb;         // -1 if unknown
+    double cpu_seconds;  // -1 if unknown
+    int threads;         // -1 if unknown
+};
 
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "VmRSS:", 6) == 0) {
-            sscanf(line + 6, "%ld", &kb);
-            break;
-        }
-    }
+/*
+ * A complete prebuilt /metrics response: status line, headers and body. Two of them are used in
+ * turn. Scrapers announce themselves in `readers` while they send from the published one, and
+ * the sampler only renders into the other buffer once nobody reads it anymore.
+ */
+struct metrics_snapshot {
+    atomic_int readers;
+    unsigned long long sample;  // Identifies the content in the compressed body cache
+    char *data;
+    size_t capacity;
+    size_t len;          // Rendered bytes, counted from data
+    size_t head_offset;  // Where the response starts, the head sits right in front of the body
+};
 
-    fclose(f);
-    return kb;
+static struct metrics_snapshot snapshots[2];
+static _Atomic(struct metrics_snapshot *) published = NULL;
+static unsigned long long samples_rendered = 0; // Sampler only
+static struct encoded_cache compressed_snapshots = ENCODED_CACHE_INITIALIZER;
+
+static struct proc_files own_files = { -1, -1, -1 };
+
+static void proc_files_close(struct proc_files *files) {
+    if (files->stat_fd >= 0) close(files->stat_fd);
+    if (files->status_fd >= 0) close(files->status_fd);
+    files->stat_fd = files->status_fd = -1;
 }
 
-double get_cpu_time_seconds(pid_t pid) {
+// Reopens the files when the process changed, e.g. after the service was restarted
+static void proc_files_track(struct proc_files *files, pid_t pid) {
+    if (files->pid == pid && files->stat_fd >= 0) return;
+    proc_files_close(files);
+    files->pid = pid;
+    if (pid <= 0) return;
+
     char path[64];
-    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    files->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    files->status_fd = open(path, O_RDONLY | O_CLOEXEC);
+}
 
-    FILE *f = fopen(path, "r");
-    if (!f) return -1;
+static ssize_t read_proc_file(int fd, char *buf, size_t size) {
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    if (n >= 0) buf[n] = '\0';
+    return n;
+}
 
-    // Fields: pid (1) ... utime (14), stime (15)
-    long utime = 0, stime = 0;
-    char dummy[512];
-    for (int i = 0; i < 13; ++i) fscanf(f, "%s", dummy); // skip 13 fields
-    fscanf(f, "%ld %ld", &utime, &stime);
-    fclose(f);
+// Value of a "Name:   123 kB" line in /proc/<pid>/status
+static long status_field(const char *status, const char *name) {
+    size_t name_len = strlen(name);
 
-    long ticks_per_sec = sysconf(_SC_CLK_TCK);
-    return (utime + stime) / (double)ticks_per_sec;
+    for (const char *line = status; line; line = strchr(line, '\n')) {
+        if (*line == '\n') line++;
+        if (strncmp(line, name, name_len) == 0) return strtol(line + name_len, NULL, 10);
+    }
+    return -1;
 }
 
-int get_own_thread_count() {
-    FILE *f = fopen("/proc/self/status", "r");
-    if (!f) return -1;
+/*
+ * /proc/<pid>/stat is "pid (comm) state ppid ...". comm may contain spaces and parentheses, so
+ * fields are counted from the last ')'. utime and stime are fields 14 and 15.
+ */
+static double stat_cpu_seconds(const char *stat) {
+    const char *p = strrchr(stat, ')');
+    if (!p) return -1;
 
-    char line[256];
-    int threads = -1;
-
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "Threads:", 8) == 0) {
-            sscanf(line + 8, "%d", &threads);
-            break;
-        }
+    for (int field = 2; field < 14; ++field) {
+        p = strchr(p + 1, ' ');
+        if (!p) return -1;
     }
 
-    fclose(f);
-    return threads;
+    char *end;
+    unsigned long long utime = strtoull(p + 1, &end, 10);
+    unsigned long long stime = strtoull(end, NULL, 10);
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
 }
 
-int get_thread_count_for_pid(pid_t pid) {
-    char path[64];
-    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+static void read_process_sample(struct proc_files *files, struct process_sample *sample) {
+    char buf[4096];
+
+    sample->rss_kb = -1;
+    sample->threads = -1;
+    sample->cpu_seconds = -1;
 
-    FILE *f = fopen(path, "r");
-    if (!f) return -1;
+    if (read_proc_file(files->status_fd, buf, sizeof(buf)) > 0) {
+        sample->rss_kb = status_field(buf, "VmRSS:");
+        sample->threads = (int)status_field(buf, "Threads:");
+    }
+    if (read_proc_file(files->stat_fd, buf, sizeof(buf)) > 0) {
+        sample->cpu_seconds = stat_cpu_seconds(buf);
+    }
+}
 
-    char line[256];
-    int threads = -1;
+// Appends to the body of the snapshot being rendered, growing its buffer when needed
+static void snapshot_appendf(void *ctx, const char *fmt, ...) {
+    struct metrics_snapshot *snap = ctx;
 
-    while (fgets(line, sizeof(line), f)) {
-        if (strncmp(line, "Threads:", 8) == 0) {
-            sscanf(line + 8, "%d", &threads);
-            break;
+    while (1) {
+        size_t room = snap->capacity - snap->len;
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(snap->data + snap->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            snap->len += (size_t)n;
+            return;
         }
+
+        char *grown = realloc(snap->data, snap->capacity * 2);
+        if (!grown) return; // Keep what fits, the metric is dropped from this sample
+        snap->data = grown;
+        snap->capacity *= 2;
     }
+}
 
-    fclose(f);
-    return threads;
+static void append_pool_stats(const struct thread_pool_stats *stats, void *ctx) {
+    snapshot_appendf(ctx,
+        "admin_pool_workers{pool=\"%s\"} %zu\n"
+        "admin_pool_busy_workers{pool=\"%s\"} %zu\n"
+        "admin_pool_queue_depth{pool=\"%s\"} %zu\n"
+        "admin_pool_queue_capacity{pool=\"%s\"} %zu\n"
+        "admin_pool_jobs_completed_total{pool=\"%s\"} %llu\n"
+        "admin_pool_jobs_rejected_total{pool=\"%s\"} %llu\n",
+        stats->name, stats->workers, stats->name, stats->busy_workers,
+        stats->name, stats->queue_depth, stats->name, stats->queue_capacity,
+        stats->name, stats->completed, stats->name, stats->rejected);
 }
 
-void handle_metrics(int client_fd) {
-    char body[2048];
+static void append_service_status(struct metrics_snapshot *snap, const struct service_snapshot *services) {
+    for (size_t i = 0; i < services->count; ++i) {
+        const struct service_status *s = &services->services[i];
+        snapshot_appendf(snap,
+            "supervised_service_up{service=\"%s\"} %d\n"
+            "supervised_service_pid{service=\"%s\"} %d\n"
+            "supervised_service_restarts_total{service=\"%s\"} %llu\n"
+            "supervised_service_restart_latency_seconds{service=\"%s\"} %.6f\n"
+            "supervised_service_restart_latency_seconds_sum{service=\"%s\"} %.6f\n",
+            s->name, s->state == SERVICE_RUNNING, s->name, (int)s->pid, s->name, s->restarts,
+            s->name, s->last_restart_latency, s->name, s->restart_latency_sum);
+    }
+}
+
+static void append_thread_group(const struct thread_cpu_group *group, void *ctx) {
+    snapshot_appendf(ctx,
+        "monitored_service_thread_cpu_seconds_total{thread=\"%s\"} %.2f\n"
+        "monitored_service_threads{thread=\"%s\"} %d\n",
+        group->name, group->cpu_seconds, group->name, group->threads);
+}
+
+static void render_snapshot(struct metrics_snapshot *snap) {
+    // The monitored_service_* metrics describe the service from the command line, with every
+    // process it forked
+    struct service_snapshot *services = services_acquire();
+    pid_t pid = services->services[0].pid;
+    services_release(services);
+
+    proc_files_track(&own_files, getpid());
+
+    struct process_tree_sample service;
+    struct process_sample own;
+    process_tree_sample(pid, &service);
+    read_process_sample(&own_files, &own);
 
     time_t now = time(NULL);
-    long uptime = now - server_start_time;
-    long rss_kb = get_rss_memory_kb(monitored_service_pid);
-    double cpu_time = get_cpu_time_seconds(monitored_service_pid);
-    int thread_count = get_thread_count_for_pid(monitored_service_pid);
+    if (service.processes > 0) {
+        metrics_history_record(HISTORY_SERVICE_MEMORY_BYTES, now, service.rss_kb * 1024.0);
+        metrics_history_record(HISTORY_SERVICE_CPU_SECONDS, now, service.cpu_seconds);
+        metrics_history_record(HISTORY_SERVICE_THREADS, now, service.threads);
+    }
+    if (own.threads >= 0) metrics_history_record(HISTORY_ADMIN_THREADS, now, own.threads);
 
-    int len = snprintf(body, sizeof(body),
+    snap->sample = ++samples_rendered;
+    snap->len = SNAPSHOT_HEAD_RESERVE;
+    snapshot_appendf(snap,
         "admin_service_uptime_seconds %ld\n"
         "monitored_service_pid %d\n",
-        uptime, monitored_service_pid);
+        (long)(now - server_start_time), (int)pid);
 
-    if (rss_kb >= 0) {
-        len += snprintf(body + len, sizeof(body) - len,
-            "monitored_service_memory_bytes %ld\n", rss_kb * 1024L);
+    if (service.processes > 0) {
+        snapshot_appendf(snap,
+            "monitored_service_process_count %d\n"
+            "monitored_service_memory_bytes %ld\n"
+            "monitored_service_cpu_seconds_total %.2f\n"
+            "monitored_service_thread_count %d\n",
+            service.processes, service.rss_kb * 1024L, service.cpu_seconds, service.threads);
+    }
+    // Proportional set size: shared pages are split between the processes mapping them
+    if (service.processes > 0 && service.pss_kb >= 0) {
+        snapshot_appendf(snap, "monitored_service_pss_bytes %ld\n", service.pss_kb * 1024L);
+    }
+    if (service.processes > 0 && service.io_read_bytes >= 0) {
+        snapshot_appendf(snap,
+            "monitored_service_io_read_bytes_total %lld\n"
+            "monitored_service_io_write_bytes_total %lld\n"
+            "monitored_service_io_read_chars_total %lld\n"
+            "monitored_service_io_write_chars_total %lld\n",
+            service.io_read_bytes, service.io_write_bytes, service.io_read_chars, service.io_write_chars);
+    }
+    if (service.processes > 0 && service.context_switches >= 0) {
+        snapshot_appendf(snap, "monitored_service_context_switches_total %lld\n", service.context_switches);
     }
+    if (service.processes > 0 && server_config.metrics_thread_cpu) {
+        process_tree_foreach_thread_group(append_thread_group, snap);
+    }
+    if (own.threads >= 0) {
+        snapshot_appendf(snap, "admin_service_thread_count %d\n", own.threads);
+    }
+    // The admin server's own footprint, to show what it costs the host next to the service
+    if (own.rss_kb >= 0) {
+        snapshot_appendf(snap, "admin_service_memory_bytes %ld\n", own.rss_kb * 1024L);
+    }
+    if (own.cpu_seconds >= 0) {
+        snapshot_appendf(snap, "admin_service_cpu_seconds_total %.2f\n", own.cpu_seconds);
+    }
+
+    services = services_acquire();
+    append_service_status(snap, services);
+    services_release(services);
+
+    thread_pool_foreach_stats(append_pool_stats, snap);
+    telemetry_render(snapshot_appendf, snap);
+    tls_render(snapshot_appendf, snap);
+    admission_render(snapshot_appendf, snap);
+
+    // The head goes right in front of the body, so the response is one contiguous buffer
+    char head[SNAPSHOT_HEAD_RESERVE];
+    int head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nVary: Accept-Encoding\r\nContent-Length: %zu\r\n\r\n",
+        snap->len - SNAPSHOT_HEAD_RESERVE);
+    snap->head_offset = SNAPSHOT_HEAD_RESERVE - (size_t)head_len;
+    memcpy(snap->data + snap->head_offset, head, (size_t)head_len);
+}
 
-    if (cpu_time >= 0) {
-        len += snprintf(body + len, sizeof(body) - len,
-            "monitored_service_cpu_seconds_total %.2f\n", cpu_time);
+// Waits until no scraper sends from `snap` anymore. Returns 0 once it is free, -1 on timeout.
+static int snapshot_wait_unused(struct metrics_snapshot *snap) {
+    for (int waited_ms = 0; atomic_load(&snap->readers) != 0; ++waited_ms) {
+        if (waited_ms >= SNAPSHOT_REUSE_WAIT_MS) return -1;
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
     }
+    return 0;
+}
+
+static void sample_once(void) {
+    struct metrics_snapshot *current = atomic_load(&published);
+    struct metrics_snapshot *next = current == &snapshots[0] ? &snapshots[1] : &snapshots[0];
 
-    if (thread_count >= 0) {
-        len += snprintf(body + len, sizeof(body) - len,
-            "admin_service_thread_count %d\n", thread_count);
+    // A scraper stuck on a slow socket must not be able to stall sampling: skip this round
+    if (snapshot_wait_unused(next) != 0) return;
+
+    render_snapshot(next);
+    atomic_store(&published, next);
+}
+
+static void *sampler_main(void *arg) {
+    long interval_ms = (long)server_config.metrics_interval_ms;
+    struct timespec interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+
+    while (1) {
+        while (nanosleep(&interval, &interval) != 0 && errno == EINTR) {
+            // Sleep the remaining time
+        }
+        interval = (struct timespec){ interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+        sample_once();
+    }
+    return NULL;
+}
+
+int start_metrics_sampler(void) {
+    // Without history /metrics still works, only /metrics/history answers 500
+    if (metrics_history_init() != 0) fprintf(stderr, "Metrics history unavailable\n");
+
+    for (int i = 0; i < 2; ++i) {
+        snapshots[i].data = malloc(SNAPSHOT_INITIAL_CAPACITY);
+        if (!snapshots[i].data) return -1;
+        snapshots[i].capacity = SNAPSHOT_INITIAL_CAPACITY;
+        atomic_init(&snapshots[i].readers, 0);
     }
 
-    char header[128];
-    snprintf(header, sizeof(header),
-        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n",
-        len);
+    // First sample on the caller's thread, so /metrics has something to serve right away
+    render_snapshot(&snapshots[0]);
+    atomic_store(&published, &snapshots[0]);
 
-    write(client_fd, header, strlen(header));
-    write(client_fd, body, len);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 64 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, &attr, sampler_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create for metrics sampler failed: %d\n", err);
+        return -1;
+    }
+    return 0;
 }
 
+/*
+ * A scrape never touches procfs: it sends the prebuilt response of the latest sample. The
+ * re-check after announcing ourselves closes the race with the sampler picking this buffer
+ * for the next sample: if it was swapped in between, we back off and take the new one.
+ * Compressed, the body is taken from a cache keyed by the sample, so each sample is only
+ * compressed once per coding however many scrapers ask for it.
+ */
+void handle_metrics(int client_fd, const struct http_request *req) {
+    struct metrics_snapshot *snap;
+    while (1) {
+        snap = atomic_load(&published);
+        atomic_fetch_add(&snap->readers, 1);
+        if (atomic_load(&published) == snap) break;
+        atomic_fetch_sub(&snap->readers, 1);
+    }
+
+    const char *body = snap->data + SNAPSHOT_HEAD_RESERVE;
+    size_t body_len = snap->len - SNAPSHOT_HEAD_RESERVE;
+    enum content_coding coding = response_coding(req, body_len);
+    const struct encoded_body *encoded = NULL;
+    if (coding != CONTENT_IDENTITY) {
+        encoded = encoded_cache_get(&compressed_snapshots, "metrics", snap->sample, coding, body, body_len);
+    }
+
+    if (encoded) {
+        atomic_fetch_sub(&snap->readers, 1); // The compressed copy doesn't need the snapshot
+        send_encoded_response(client_fd, "200 OK", "text/plain", coding, encoded->data, encoded->len);
+        encoded_body_release(&compressed_snapshots, encoded);
+        return;
+    }
+
+    struct iovec response = { .iov_base = snap->data + snap->head_offset, .iov_len = snap->len - snap->head_offset };
+    send_segments(client_fd, 200, &response, 1, 0);
+
+    atomic_fetch_sub(&snap->readers, 1);
+}
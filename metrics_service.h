@@ -1,6 +1,18 @@
 #ifndef METRICS_SERVICE_H
 #define METRICS_SERVICE_H
 
-void handle_metrics(int client_fd);
+#include "http_parser.h"
+
+// Function to take a first sample and start the background sampler thread.
+// Every ADMIN_METRICS_INTERVAL_MS it reads procfs and renders the complete
+// /metrics response, which scrapers then send as is, and feeds the samples
+// into the metrics history.
+//
+// Returns: 0 on success, -1 if the buffers or the thread could not be created.
+int start_metrics_sampler(void);
+
+// Function to send the latest /metrics snapshot, compressed if the client
+// accepts it. Does not touch procfs, and takes no lock unless compressed.
+void handle_metrics(int client_fd, const struct http_request *req);
 
 #endif //METRICS_SERVICE_H
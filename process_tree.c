@@ -0,0 +1,410 @@
+#define _GNU_SOURCE // For O_DIRECTORY
+#include "process_tree.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define TREE_MAX_PROCESSES 256
+#define TREE_MAX_THREADS 4096              // Tracked one by one, further threads are only counted
+#define TREE_THREAD_READS_PER_SAMPLE 256   // Threads beyond that are refreshed in the next samples
+#define TREE_CHILDREN_READS_PER_SAMPLE 512 // Scans that don't fit are done in the next samples
+#define TREE_RESCAN_SAMPLES 10             // Every process is rescanned at least this often
+#define TREE_PSS_SAMPLES 10                // smaps_rollup walks the page tables, it is read less often
+#define TREE_MAX_GROUPS 64
+
+struct tree_thread {
+    pid_t tid;
+    char name[16];
+    uint64_t run_ns;   // From schedstat: time on the CPU
+    uint64_t switches; // From status: voluntary and involuntary context switches
+};
+
+/*
+ * A process of the tree. It is addressed through a descriptor of its /proc directory rather than
+ * its PID: once the process is gone every read fails with ESRCH, even if the PID was reused.
+ */
+struct tree_process {
+    pid_t pid;
+    int dir_fd;
+    unsigned long long scanned_ticks;  // utime + stime when its children were last read
+    unsigned long long scanned_run_ns; // Main thread's run time from schedstat at that time
+    int scanned_threads;               // Thread count at that time
+    int needs_scan;
+    long pss_kb;                       // -1 until read
+    struct tree_thread *threads;       // Sorted by tid
+    size_t thread_count;
+};
+
+static struct tree_process processes[TREE_MAX_PROCESSES];
+static size_t process_count = 0;
+static size_t tracked_threads = 0;
+static pid_t tree_root = 0;
+static unsigned long long sample_number = 0;
+static size_t thread_cursor = 0;
+static int switches_seen = 0;
+
+static struct thread_cpu_group groups[TREE_MAX_GROUPS];
+static size_t group_count = 0;
+
+/*
+ * What the threads that are no longer tracked (exited, or dropped over TREE_MAX_THREADS) counted
+ * when they were last read. The totals are exported as counters and must not go down when a
+ * thread ends; a thread dropped over the limit and tracked again later is counted twice.
+ */
+static uint64_t retired_switches = 0;
+static struct thread_cpu_group retired_groups[TREE_MAX_GROUPS]; // Their thread counts stay 0
+static size_t retired_group_count = 0;
+
+struct stat_fields {
+    unsigned long long utime;
+    unsigned long long stime;
+    unsigned long long cutime;
+    unsigned long long cstime;
+    int num_threads;
+};
+
+static ssize_t read_at(int dir_fd, const char *path, char *buf, size_t size) {
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n >= 0) buf[n] = '\0';
+    return n;
+}
+
+/*
+ * /proc/<pid>/stat is "pid (comm) state ppid ...". comm may contain spaces and parentheses, so
+ * fields are counted from the last ')'. utime, stime, cutime and cstime are fields 14 to 17,
+ * num_threads is field 20.
+ */
+static int parse_stat(const char *stat, struct stat_fields *fields) {
+    const char *p = strrchr(stat, ')');
+    if (!p || p[1] != ' ' || !p[2]) return -1;
+
+    unsigned long long values[21] = { 0 };
+    char *end = (char *)p + 3; // Past the state character
+    for (int field = 4; field <= 20; ++field) {
+        values[field] = strtoull(end, &end, 10);
+    }
+    fields->utime = values[14];
+    fields->stime = values[15];
+    fields->cutime = values[16];
+    fields->cstime = values[17];
+    fields->num_threads = (int)values[20];
+    return fields->num_threads > 0 ? 0 : -1;
+}
+
+static int is_tracked(pid_t pid) {
+    for (size_t i = 0; i < process_count; ++i) {
+        if (processes[i].pid == pid) return 1;
+    }
+    return 0;
+}
+
+static void track_process(pid_t pid) {
+    if (process_count == TREE_MAX_PROCESSES) return;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d", (int)pid);
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return; // Already gone
+
+    processes[process_count++] = (struct tree_process){ .pid = pid, .dir_fd = dir_fd, .needs_scan = 1, .pss_kb = -1 };
+}
+
+// The last group of `list` is kept for "other"
+static struct thread_cpu_group *group_of(struct thread_cpu_group *list, size_t *count, const char *name) {
+    for (size_t g = 0; g < *count; ++g) {
+        if (strcmp(list[g].name, name) == 0) return &list[g];
+    }
+    if (*count >= TREE_MAX_GROUPS - 1 && strcmp(name, "other") != 0) return group_of(list, count, "other");
+
+    struct thread_cpu_group *group = &list[(*count)++];
+    snprintf(group->name, sizeof(group->name), "%s", name);
+    group->threads = 0;
+    group->cpu_seconds = 0;
+    return group;
+}
+
+static void retire_thread(const struct tree_thread *thread) {
+    retired_switches += thread->switches;
+    group_of(retired_groups, &retired_group_count, thread->name)->cpu_seconds += (double)thread->run_ns / 1e9;
+}
+
+// Swaps the last process into place
+static void untrack_process(size_t index) {
+    struct tree_process *proc = &processes[index];
+    for (size_t t = 0; t < proc->thread_count; ++t) retire_thread(&proc->threads[t]);
+    close(proc->dir_fd);
+    free(proc->threads);
+    tracked_threads -= proc->thread_count;
+    processes[index] = processes[--process_count];
+}
+
+/*
+ * Thread names are chosen by the service and end up in metric labels unescaped. Only printable
+ * ASCII is kept, without '"' and '\\': comm is cut at 15 bytes, possibly inside a UTF-8
+ * sequence, and one invalid label would break the whole /metrics body.
+ */
+static void sanitize_thread_name(char *name) {
+    for (unsigned char *c = (unsigned char *)name; *c; ++c) {
+        if (*c < 0x20 || *c > 0x7e || *c == '"' || *c == '\\') *c = '_';
+    }
+}
+
+static int compare_tids(const void *a, const void *b) {
+    pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void track_children(struct tree_process *proc, pid_t tid) {
+    char path[48], buf[4096];
+    snprintf(path, sizeof(path), "task/%d/children", (int)tid);
+    if (read_at(proc->dir_fd, path, buf, sizeof(buf)) <= 0) return;
+
+    for (char *p = buf, *end; *p; p = end) {
+        long child = strtol(p, &end, 10);
+        if (end == p) break;
+        if (child > 0 && !is_tracked((pid_t)child)) track_process((pid_t)child);
+    }
+}
+
+/*
+ * Re-reads the list of a process's threads, and the children each of them forked. Threads that
+ * are already known keep their data, new ones are looked up once.
+ */
+static void scan_process(struct tree_process *proc) {
+    int task_fd = openat(proc->dir_fd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = task_fd >= 0 ? fdopendir(task_fd) : NULL;
+    if (!dir) {
+        if (task_fd >= 0) close(task_fd);
+        return;
+    }
+
+    pid_t *tids = NULL;
+    size_t tid_count = 0, tid_capacity = 0;
+    for (struct dirent *entry; (entry = readdir(dir));) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') continue;
+        if (tid_count == tid_capacity) {
+            size_t capacity = tid_capacity ? tid_capacity * 2 : 16;
+            pid_t *grown = realloc(tids, capacity * sizeof(*tids));
+            if (!grown) break;
+            tids = grown;
+            tid_capacity = capacity;
+        }
+        tids[tid_count++] = (pid_t)atoi(entry->d_name);
+    }
+    closedir(dir);
+    qsort(tids, tid_count, sizeof(*tids), compare_tids);
+
+    struct tree_thread *threads = calloc(tid_count ? tid_count : 1, sizeof(*threads));
+    if (!threads) {
+        free(tids);
+        return;
+    }
+
+    // Both lists are sorted by tid: merge them
+    size_t kept = 0, old = 0;
+    size_t budget = TREE_MAX_THREADS - (tracked_threads - proc->thread_count);
+    for (size_t i = 0; i < tid_count && kept < budget; ++i) {
+        while (old < proc->thread_count && proc->threads[old].tid < tids[i]) retire_thread(&proc->threads[old++]);
+        if (old < proc->thread_count && proc->threads[old].tid == tids[i]) {
+            threads[kept++] = proc->threads[old++];
+            continue;
+        }
+
+        struct tree_thread *thread = &threads[kept++];
+        thread->tid = tids[i];
+        char path[48];
+        snprintf(path, sizeof(path), "task/%d/comm", (int)tids[i]);
+        if (read_at(proc->dir_fd, path, thread->name, sizeof(thread->name)) > 0) {
+            thread->name[strcspn(thread->name, "\n")] = '\0';
+            sanitize_thread_name(thread->name);
+        }
+    }
+
+    while (old < proc->thread_count) retire_thread(&proc->threads[old++]);
+    for (size_t i = 0; i < tid_count; ++i) track_children(proc, tids[i]);
+
+    tracked_threads += kept;
+    tracked_threads -= proc->thread_count;
+    free(proc->threads);
+    proc->threads = threads;
+    proc->thread_count = kept;
+    free(tids);
+}
+
+static long pss_kb_of(struct tree_process *proc) {
+    char buf[2048];
+    if (read_at(proc->dir_fd, "smaps_rollup", buf, sizeof(buf)) <= 0) return -1;
+    const char *pss = strstr(buf, "\nPss:");
+    return pss ? strtol(pss + 5, NULL, 10) : -1;
+}
+
+static long long io_field(const char *io, const char *name) {
+    const char *line = strstr(io, name);
+    return line ? strtoll(line + strlen(name), NULL, 10) : -1;
+}
+
+static long long status_field(const char *status, const char *name) {
+    const char *line = strstr(status, name);
+    return line ? strtoll(line + strlen(name), NULL, 10) : -1;
+}
+
+/*
+ * Reads the context switches of up to TREE_THREAD_READS_PER_SAMPLE threads, taking turns, and
+ * their schedstat if the CPU time per thread is wanted. schedstat's third field counts
+ * timeslices, not switches: a thread that keeps the CPU across several slices is not switched.
+ */
+static void refresh_threads(void) {
+    if (tracked_threads == 0) return;
+
+    size_t start = thread_cursor % tracked_threads;
+    size_t index = 0;
+    for (size_t p = 0; p < process_count; ++p) {
+        struct tree_process *proc = &processes[p];
+        for (size_t t = 0; t < proc->thread_count; ++t, ++index) {
+            if ((index + tracked_threads - start) % tracked_threads >= TREE_THREAD_READS_PER_SAMPLE) continue;
+
+            struct tree_thread *thread = &proc->threads[t];
+            char path[48], buf[2048];
+            snprintf(path, sizeof(path), "task/%d/status", (int)thread->tid);
+            if (read_at(proc->dir_fd, path, buf, sizeof(buf)) > 0) {
+                long long voluntary = status_field(buf, "\nvoluntary_ctxt_switches:");
+                long long involuntary = status_field(buf, "\nnonvoluntary_ctxt_switches:");
+                if (voluntary >= 0 && involuntary >= 0) {
+                    thread->switches = (uint64_t)(voluntary + involuntary);
+                    switches_seen = 1;
+                }
+            }
+
+            snprintf(path, sizeof(path), "task/%d/schedstat", (int)thread->tid);
+            if (server_config.metrics_thread_cpu && read_at(proc->dir_fd, path, buf, sizeof(buf)) > 0) {
+                thread->run_ns = strtoull(buf, NULL, 10);
+            }
+        }
+    }
+    thread_cursor = start + TREE_THREAD_READS_PER_SAMPLE;
+}
+
+static void group_threads(void) {
+    memcpy(groups, retired_groups, retired_group_count * sizeof(*groups));
+    group_count = retired_group_count;
+    for (size_t p = 0; p < process_count; ++p) {
+        for (size_t t = 0; t < processes[p].thread_count; ++t) {
+            const struct tree_thread *thread = &processes[p].threads[t];
+            struct thread_cpu_group *group = group_of(groups, &group_count, thread->name);
+            group->threads++;
+            group->cpu_seconds += (double)thread->run_ns / 1e9;
+        }
+    }
+}
+
+/*
+ * The children files are what makes discovery expensive: one per thread. A process can only fork
+ * while it runs, so its children are only re-read when its CPU time or thread count changed,
+ * plus every TREE_RESCAN_SAMPLES samples for forks too short to show in the clock ticks. Scans
+ * that exceed the per-sample budget wait for the next sample.
+ */
+void process_tree_sample(pid_t root, struct process_tree_sample *sample) {
+    *sample = (struct process_tree_sample){
+        .pss_kb = 0, .io_read_bytes = 0, .io_write_bytes = 0, .io_read_chars = 0, .io_write_chars = 0,
+    };
+
+    if (root != tree_root) {
+        // A new service (or none), whose counters start over
+        while (process_count > 0) untrack_process(0);
+        retired_switches = 0;
+        retired_group_count = 0;
+        tree_root = root;
+        if (root > 0) track_process(root);
+    }
+
+    sample_number++;
+    int rescan_all = sample_number % TREE_RESCAN_SAMPLES == 0;
+    int read_pss = sample_number % TREE_PSS_SAMPLES == 1;
+    size_t scan_budget = TREE_CHILDREN_READS_PER_SAMPLE;
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    long clock_ticks = sysconf(_SC_CLK_TCK);
+    int io_known = 1;
+
+    // Processes found on the way are appended and visited in the same pass
+    for (size_t i = 0; i < process_count;) {
+        struct tree_process *proc = &processes[i];
+        char buf[1024];
+        struct stat_fields stat;
+        if (read_at(proc->dir_fd, "stat", buf, sizeof(buf)) <= 0 || parse_stat(buf, &stat) != 0) {
+            untrack_process(i); // Exited, the last process is moved here and visited next
+            continue;
+        }
+
+        // Clock ticks are too coarse to show a quick fork, the main thread's run time isn't
+        unsigned long long ticks = stat.utime + stat.stime, run_ns = 0;
+        if (read_at(proc->dir_fd, "schedstat", buf, sizeof(buf)) > 0) run_ns = strtoull(buf, NULL, 10);
+        if (rescan_all || ticks != proc->scanned_ticks || run_ns != proc->scanned_run_ns ||
+            stat.num_threads != proc->scanned_threads) {
+            proc->needs_scan = 1;
+        }
+        // A process with more threads than the whole budget is scanned when the budget is untouched
+        size_t cost = (size_t)stat.num_threads;
+        if (proc->needs_scan && (cost <= scan_budget || scan_budget == TREE_CHILDREN_READS_PER_SAMPLE)) {
+            scan_process(proc);
+            scan_budget -= cost < scan_budget ? cost : scan_budget;
+            proc->needs_scan = 0;
+            proc->scanned_ticks = ticks;
+            proc->scanned_run_ns = run_ns;
+            proc->scanned_threads = stat.num_threads;
+        }
+
+        sample->processes++;
+        sample->threads += stat.num_threads;
+        sample->cpu_seconds += (double)(ticks + stat.cutime + stat.cstime) / (double)clock_ticks;
+
+        long size_pages, resident_pages;
+        if (read_at(proc->dir_fd, "statm", buf, sizeof(buf)) > 0 &&
+            sscanf(buf, "%ld %ld", &size_pages, &resident_pages) == 2) {
+            sample->rss_kb += resident_pages * page_kb;
+        }
+
+        if (read_at(proc->dir_fd, "io", buf, sizeof(buf)) > 0) {
+            sample->io_read_chars += io_field(buf, "rchar:");
+            sample->io_write_chars += io_field(buf, "wchar:");
+            sample->io_read_bytes += io_field(buf, "\nread_bytes:");
+            sample->io_write_bytes += io_field(buf, "\nwrite_bytes:");
+        } else {
+            io_known = 0; // Needs ptrace access, e.g. the service changed its user
+        }
+
+        if (read_pss || proc->pss_kb < 0) proc->pss_kb = pss_kb_of(proc);
+        if (proc->pss_kb >= 0 && sample->pss_kb >= 0) sample->pss_kb += proc->pss_kb;
+        else sample->pss_kb = -1;
+
+        i++;
+    }
+
+    if (!io_known) {
+        sample->io_read_bytes = sample->io_write_bytes = sample->io_read_chars = sample->io_write_chars = -1;
+    }
+    if (sample->processes == 0) sample->pss_kb = 0;
+
+    refresh_threads();
+    sample->context_switches = switches_seen ? (long long)retired_switches : -1;
+    for (size_t p = 0; switches_seen && p < process_count; ++p) {
+        for (size_t t = 0; t < processes[p].thread_count; ++t) {
+            sample->context_switches += (long long)processes[p].threads[t].switches;
+        }
+    }
+
+    if (server_config.metrics_thread_cpu) group_threads();
+}
+
+void process_tree_foreach_thread_group(void (*visit)(const struct thread_cpu_group *group, void *ctx), void *ctx) {
+    for (size_t i = 0; i < group_count; ++i) visit(&groups[i], ctx);
+}
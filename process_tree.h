@@ -0,0 +1,42 @@
+#ifndef PROCESS_TREE_H
+#define PROCESS_TREE_H
+
+#include <sys/types.h> // For pid_t
+
+// Resource usage of a process and all of its descendants.
+struct process_tree_sample {
+    int processes;            // 0 if the root is not running
+    int threads;
+    long rss_kb;
+    long pss_kb;              // -1 if smaps_rollup can't be read
+    double cpu_seconds;       // Includes the children the tree's processes reaped
+    long long io_read_bytes;  // From storage, -1 if /proc/<pid>/io can't be read
+    long long io_write_bytes;
+    long long io_read_chars;  // Through read() and friends, including the page cache
+    long long io_write_chars;
+    long long context_switches; // Voluntary and involuntary, of every thread since the service started, -1 if unknown
+};
+
+// CPU time of the threads sharing one name, see process_tree_foreach_thread_group().
+struct thread_cpu_group {
+    char name[16];
+    int threads;
+    double cpu_seconds;
+};
+
+// Function to sample the process tree rooted at `root`. Processes forked by
+// the root or its descendants are discovered from /proc/<pid>/task/*/children,
+// which is only re-read for processes that ran since their last scan. Called
+// by the metrics sampler thread only.
+//
+// pid_t root: The service's PID, 0 if it is not running.
+// struct process_tree_sample *sample: Filled with the totals.
+void process_tree_sample(pid_t root, struct process_tree_sample *sample);
+
+// Function to call `visit` with the CPU time per thread name of the last
+// sample, including threads that exited since the service started. Only
+// gathered with ADMIN_METRICS_THREAD_CPU=1. Threads whose name doesn't fit
+// into the fixed number of groups are counted as "other".
+void process_tree_foreach_thread_group(void (*visit)(const struct thread_cpu_group *group, void *ctx), void *ctx);
+
+#endif // PROCESS_TREE_H
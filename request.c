@@ -1,30 +1,27 @@
 #include "request.h"
 
 #include <jansson.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "auth.h"
+#include "config.h"
+#include "jobs.h"
+#include "log_capture.h"
+#include "log_follow.h"
 #include "response.h"
+#include "metrics_history.h"
 #include "metrics_service.h"
+#include "router.h"
+#include "service_manager.h"
+#include "telemetry.h"
 
-static int READ_BUF_SIZE = 4096;
-
-void handle_logs_tail(int client_fd) {
-    const char *msg = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nHello Logs";
-    write(client_fd, msg, 33);
-}
-
-void handle_admin_rebuild(int client_fd) {
-    const char *msg = "HTTP/1.1 200 OK\r\nContent-Length: 12\r\n\r\nRebuild Done";
-    write(client_fd, msg, 36);
-}
-
-void handle_auth_token(int client_fd, const char *body) {
+void handle_auth_token(int client_fd, const char *body, size_t len) {
     json_error_t error;
-    json_t *root = json_loads(body, 0, &error);
+    json_t *root = json_loadb(body, len, 0, &error);
     if (!root) {
         send_401(client_fd);  // invalid JSON
         return;
@@ -44,6 +41,11 @@ void handle_auth_token(int client_fd, const char *body) {
         }
 
     char *jwt = generate_jwt(username);
+    if (!jwt) {
+        json_decref(root);
+        send_500(client_fd); // No JWT_SECRET configured
+        return;
+    }
     json_t *response = json_object();
     json_object_set_new(response, "token", json_string(jwt));
     free(jwt);
@@ -51,102 +53,222 @@ void handle_auth_token(int client_fd, const char *body) {
     char *response_str = json_dumps(response, JSON_COMPACT);
     json_decref(response);
 
-    char header[256];
-    snprintf(header, sizeof(header),
-             "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
-             strlen(response_str));
-    write(client_fd, header, strlen(header));
-    write(client_fd, response_str, strlen(response_str));
+    send_response(client_fd, "200 OK", "application/json", response_str, strlen(response_str));
 
     free(response_str);
     json_decref(root);
 }
 
-static char *read_http_request(int fd) {
-    char *buffer = NULL;
-    size_t buffer_size = 0;
-    size_t data_len = 0;
-    char temp_buf[READ_BUF_SIZE];
+void handle_auth_revoke(int client_fd, const struct http_request *req) {
+    struct http_slice authorization = http_request_header(req, "Authorization");
+    char *token = extract_bearer_token(authorization.data, authorization.len);
+    bool revoked = revoke_token(token);
+    free(token);
 
-    while (1) {
-        ssize_t n = read(fd, temp_buf, READ_BUF_SIZE);
-        if (n <= 0) {
-            // EOF or error
-            break;
-        }
+    if (!revoked) {
+        send_401(client_fd);
+        return;
+    }
+    const char *body = "{\"revoked\":true}";
+    send_response(client_fd, "200 OK", "application/json", body, strlen(body));
+}
 
-        char *new_buf = realloc(buffer, data_len + n + 1);
-        if (!new_buf) {
-            free(buffer);
-            return NULL;
-        }
-        buffer = new_buf;
+/*
+ * Body consumer for handlers that need the whole body at once, such as JSON requests. The
+ * buffer grows with the data and is capped by ADMIN_MAX_BODY_BYTES through max_len.
+ */
+typedef void (*buffered_body_handler)(int client_fd, const char *body, size_t len);
 
-        memcpy(buffer + data_len, temp_buf, n);
-        data_len += n;
-        buffer[data_len] = '\0';
+struct buffered_body {
+    buffered_body_handler handler;
+    char *data;
+    size_t len;
+    size_t capacity;
+};
 
-        // Check for end of headers
-        if (strstr(buffer, "\r\n\r\n") != NULL) {
-            break;
-        }
+static int buffered_body_append(void *ctx, const char *data, size_t len) {
+    struct buffered_body *buffered = ctx;
+
+    if (buffered->len + len > buffered->capacity) {
+        size_t capacity = buffered->capacity ? buffered->capacity : 1024;
+        while (capacity < buffered->len + len) capacity *= 2;
+
+        char *grown = realloc(buffered->data, capacity);
+        if (!grown) return -1;
+        buffered->data = grown;
+        buffered->capacity = capacity;
     }
+    memcpy(buffered->data + buffered->len, data, len);
+    buffered->len += len;
+    return 0;
+}
+
+static void buffered_body_free(void *ctx) {
+    struct buffered_body *buffered = ctx;
+    free(buffered->data);
+    free(buffered);
+}
 
-    return buffer;
+static void buffered_body_complete(int client_fd, void *ctx) {
+    struct buffered_body *buffered = ctx;
+    buffered->handler(client_fd, buffered->data ? buffered->data : "", buffered->len);
+    buffered_body_free(buffered);
 }
 
-void handle_request(int client_fd) {
-    char *request = read_http_request(client_fd);
-    if (!request) {
-        // Could not read request properly
-        // Optionally send 400 Bad Request or just close connection
-        close(client_fd);
+static void accept_buffered_body(int client_fd, struct request_body *body, buffered_body_handler handler) {
+    struct buffered_body *buffered = calloc(1, sizeof(*buffered));
+    if (!buffered) {
+        send_500(client_fd);
         return;
     }
+    buffered->handler = handler;
 
-    // Parse method and path from request start line
-    char method[8] = {0};
-    char path[1024] = {0};
+    body->max_len = server_config.max_body_bytes;
+    body->on_data = buffered_body_append;
+    body->on_complete = buffered_body_complete;
+    body->on_abort = buffered_body_free;
+    body->ctx = buffered;
+}
+
+/*
+ * The rebuild artifact is streamed through without being kept in memory, the rebuild job itself
+ * does not use it yet. Uploads may be as large as ADMIN_MAX_UPLOAD_BYTES.
+ */
+static int skip_rebuild_artifact(void *ctx, const char *data, size_t len) {
+    return 0;
+}
+
+static void rebuild_artifact_received(int client_fd, void *ctx) {
+    handle_admin_rebuild(client_fd);
+}
+
+static void route_metrics(int client_fd, const struct http_request *req,
+                          const struct route_params *params, struct request_body *body) {
+    handle_metrics(client_fd, req);
+}
 
-    if (sscanf(request, "%7s %1023s", method, path) != 2) {
-        free(request);
-        // Malformed request line
-        // Send 400 Bad Request or close
-        close(client_fd);
+static void route_metrics_history(int client_fd, const struct http_request *req,
+                                  const struct route_params *params, struct request_body *body) {
+    handle_metrics_history(client_fd, req);
+}
+
+static void route_logs_tail(int client_fd, const struct http_request *req,
+                            const struct route_params *params, struct request_body *body) {
+    handle_logs_tail(client_fd, req);
+}
+
+static void route_logs_follow(int client_fd, const struct http_request *req,
+                              const struct route_params *params, struct request_body *body) {
+    handle_logs_follow(client_fd, req);
+}
+
+static void route_services(int client_fd, const struct http_request *req,
+                           const struct route_params *params, struct request_body *body) {
+    handle_services(client_fd);
+}
+
+static void route_admin_rebuild(int client_fd, const struct http_request *req,
+                                const struct route_params *params, struct request_body *body) {
+    body->max_len = server_config.max_upload_bytes;
+    body->on_data = skip_rebuild_artifact;
+    body->on_complete = rebuild_artifact_received;
+}
+
+static void route_job_status(int client_fd, const struct http_request *req,
+                             const struct route_params *params, struct request_body *body) {
+    handle_job_status(client_fd, route_param(params, "id"));
+}
+
+static void route_job_output(int client_fd, const struct http_request *req,
+                             const struct route_params *params, struct request_body *body) {
+    handle_job_output(client_fd, route_param(params, "id"));
+}
+
+/*
+ * Files in ADMIN_FILES_DIR, such as build artifacts, core dumps and rotated logs. The name is a
+ * single path segment and may not start with a dot, so nothing outside the directory, or hidden
+ * in it, can be reached.
+ */
+static void route_file(int client_fd, const struct http_request *req,
+                       const struct route_params *params, struct request_body *body) {
+    static const char NAME_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-";
+    struct http_slice name = route_param(params, "name");
+    size_t valid = 0;
+    while (valid < name.len && memchr(NAME_CHARS, name.data[valid], sizeof(NAME_CHARS) - 1)) valid++;
+
+    char path[PATH_MAX];
+    int len = server_config.files_dir && name.len > 0 && valid == name.len && name.data[0] != '.'
+        ? snprintf(path, sizeof(path), "%s/%.*s", server_config.files_dir, (int)name.len, name.data) : -1;
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        send_404(client_fd);
         return;
     }
+    send_file_response(client_fd, req, path);
+}
+
+static void route_auth_token(int client_fd, const struct http_request *req,
+                             const struct route_params *params, struct request_body *body) {
+    accept_buffered_body(client_fd, body, handle_auth_token);
+}
+
+static void route_auth_revoke(int client_fd, const struct http_request *req,
+                              const struct route_params *params, struct request_body *body) {
+    handle_auth_revoke(client_fd, req);
+}
+
+/*
+ * Every endpoint of the admin server. The table is compiled into the router once at startup,
+ * adding an entry here does not make dispatching any other request slower.
+ */
+static const struct route ROUTES[] = {
+    { "GET",  "/metrics",          route_metrics },
+    { "GET",  "/metrics/history",  route_metrics_history },
+    { "GET",  "/logs/tail",        route_logs_tail },
+    { "GET",  "/logs/follow",      route_logs_follow },
+    { "GET",  "/services",         route_services },
+    { "POST", "/admin/rebuild",    route_admin_rebuild },
+    { "GET",  "/jobs/{id}",        route_job_status },
+    { "GET",  "/jobs/{id}/output", route_job_output },
+    { "GET",  "/files/{name}",     route_file },
+    { "POST", "/auth/token",       route_auth_token },
+    { "POST", "/auth/revoke",      route_auth_revoke },
+};
 
+int init_request_routes(void) {
+    size_t count = sizeof(ROUTES) / sizeof(ROUTES[0]);
+    telemetry_init(ROUTES, count);
+    return router_init(ROUTES, count);
+}
+
+int handle_request(int client_fd, const struct http_request *req, struct request_body *body) {
     /*
     // Always check JWT token from headers
-    char *token = extract_bearer_token(request);
+    struct http_slice authorization = http_request_header(req, "Authorization");
+    char *token = extract_bearer_token(authorization.data, authorization.len);
     if (!token || !validate_token(token)) {
         free(token);
         send_401(client_fd);
-        free(request);
-        return;
+        return http_request_keep_alive(req);
     }
     free(token);
     */
 
-    // Dispatch by method + path
-    if (strcmp(method, "GET") == 0) {
-        if (strcmp(path, "/metrics") == 0) {
-            handle_metrics(client_fd);
-        } else if (strcmp(path, "/logs/tail") == 0) {
-            handle_logs_tail(client_fd);
-        } else {
-            send_404(client_fd);
-        }
-    } else if (strcmp(method, "POST") == 0) {
+    const struct route *route = NULL;
+    struct route_params params;
+    const char *allow = NULL;
 
-        if (strcmp(path, "/admin/rebuild") == 0) {
-            handle_admin_rebuild(client_fd);
-        } else {
-            send_404(client_fd);
-        }
-    } else {
-        send_405(client_fd);
+    switch (router_match(req, &route, &params, &allow)) {
+    case ROUTE_FOUND:
+        telemetry_set_route(route);
+        route->handler(client_fd, req, &params, body);
+        break;
+    case ROUTE_METHOD_NOT_ALLOWED:
+        send_405(client_fd, allow);
+        break;
+    case ROUTE_NOT_FOUND:
+        send_404(client_fd);
+        break;
     }
 
-    free(request);
-}
\ No newline at end of file
+    return http_request_keep_alive(req);
+}
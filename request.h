@@ -1,21 +1,69 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
-void handle_logs_tail(int client_fd);
-void handle_admin_rebuild(int client_fd);
+#include <stddef.h> // For size_t
+#include <stdint.h>
 
-// No specific includes are strictly necessary here, as the functions
-// take basic types (int, char*). The dependencies for send_file_response
-// and send_405 will be handled by response.h.
+#include "http_parser.h"
 
-// Function to handle an incoming HTTP request from a client.
-// It reads the request, parses the method and path, and dispatches
-// to the appropriate response function (e.g., serving a file for GET,
-// or sending a 405 for unsupported methods).
+// Function to issue a JWT for the credentials in a JSON body of the form
+// {"username": "...", "password": "..."}.
+//
+// const char *body: The request body, not necessarily NUL-terminated.
+// size_t len: Length of the body in bytes.
+void handle_auth_token(int client_fd, const char *body, size_t len);
+
+// Function to revoke the bearer token the request is authorized with, for
+// the rest of its lifetime (logout). Answers 401 if it is not valid.
+void handle_auth_revoke(int client_fd, const struct http_request *req);
+
+// Consumer for the body of a request, filled in by handle_request() when the
+// route takes a body. The connection decodes Content-Length or chunked framing
+// and feeds the data in order as it arrives, so a large upload is processed
+// incrementally instead of being buffered whole.
+struct request_body {
+    uint64_t max_len; // Larger bodies are rejected with 413
+
+    // Called for every decoded piece of the body. `data` points into the
+    // receive buffer and is only valid during the call.
+    // Returns: 0 to continue, -1 to abort; the connection is then closed
+    //          without a further response.
+    int (*on_data)(void *ctx, const char *data, size_t len);
+
+    // Called once the whole body has arrived. Writes the response and
+    // releases ctx.
+    void (*on_complete)(int client_fd, void *ctx);
+
+    // Called instead of on_complete when the body can't be received
+    // (malformed, too large, client gone). Releases ctx. May be NULL.
+    void (*on_abort)(void *ctx);
+
+    void *ctx;
+};
+
+// Function to compile the server's route table, see router_init().
+// Call once at startup.
+//
+// Returns: 0 on success, -1 if the table is invalid.
+int init_request_routes(void);
+
+// Function to handle one HTTP request received from a client.
+// It looks up the route for the parsed method and path and runs its
+// handler, or answers 404, or 405 with an Allow header when the path
+// exists for other methods only.
 //
 // int client_fd: The file descriptor of the connected client socket
-//                from which the request is read and to which the
-//                response is written.
-void handle_request(int client_fd);
+//                to which the response is written.
+// const struct http_request *req: The parsed request head. Its slices point
+//                                 into the connection's receive buffer and
+//                                 are invalid once this function returns.
+// struct request_body *body: Zeroed by the caller. A route that takes the
+//                            body sets on_complete and answers from there;
+//                            otherwise the response is written right away
+//                            and any body is skipped.
+//
+// Returns: 1 if the connection may be kept open for further requests,
+//          0 if it must be closed after this response.
+int handle_request(int client_fd, const struct http_request *req, struct request_body *body);
 
 #endif // REQUEST_H
\ No newline at end of file
@@ -1,34 +1,635 @@
+#define _GNU_SOURCE // For IOV_MAX, strptime() and timegm()
 #include "response.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
-void send_file_response(int client_fd, const char *path) {
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        send_404(client_fd);
+#include "config.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "telemetry.h"
+#include "tls.h"
+
+static const char *const CODING_NAMES[] = { "identity", "gzip", "zstd" };
+
+// Waits for `events` on the socket until the deadline. Returns 0 when it is ready, -1 on timeout.
+static int wait_socket(int client_fd, short events, long long deadline_ms) {
+    while (1) {
+        long long remaining = deadline_ms - monotonic_ms();
+        if (remaining <= 0) {
+            telemetry_connection_timeout(TELEMETRY_TIMEOUT_WRITE);
+            return -1;
+        }
+        struct pollfd pfd = { .fd = client_fd, .events = events };
+        int n = poll(&pfd, 1, (int)remaining);
+        if (n > 0) return 0;
+        if (n < 0 && errno != EINTR) return -1;
+    }
+}
+
+/*
+ * With MSG_ZEROCOPY the kernel sends straight from our pages, so the caller may only reuse them
+ * once it reports them released. Each zerocopy send is acknowledged on the socket's error queue,
+ * a notification covering a range of them. Falling back to copying is reported the same way.
+ */
+static int wait_zerocopy_done(int client_fd, size_t sends, long long deadline_ms) {
+    while (sends > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(client_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) continue;
+            // A pending notification shows as POLLERR, which poll() reports without asking
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(client_fd, 0, deadline_ms) == 0) continue;
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            size_t done = (size_t)(err.ee_data - err.ee_info) + 1;
+            sends -= done < sends ? done : sends;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The socket is only ever written with MSG_DONTWAIT, blocking or not: a full socket is waited
+ * for with poll() against one deadline for the whole response, so a client that stops reading
+ * holds a worker for ADMIN_SEND_TIMEOUT_MS at most. MSG_NOSIGNAL turns a client that went away
+ * into EPIPE instead of SIGPIPE; ignoring the signal process-wide instead would be inherited by
+ * the services we exec. With TLS the records are written by OpenSSL, see block_sigpipe().
+ */
+int send_segments(int client_fd, int status, struct iovec *iov, size_t count, int flags) {
+    long long deadline_ms = monotonic_ms() + (long long)server_config.send_timeout_ms;
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) total += iov[i].iov_len;
+
+    int one = 1;
+    // Only plaintext: records encrypted in user space are our copy already, and kTLS rejects MSG_ZEROCOPY
+    int zerocopy = server_config.zerocopy_min_bytes > 0 && total >= server_config.zerocopy_min_bytes &&
+                   !tls_copies(client_fd) && setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    size_t zerocopy_sends = 0;
+    int result = 0;
+
+    telemetry_response(status, 0);
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+
+        int send_flags = 0;
+        if (flags & RESPONSE_MORE) send_flags |= MSG_MORE;
+        if (zerocopy) send_flags |= MSG_ZEROCOPY;
+
+        ssize_t n = tls_sendmsg(client_fd, iov, count < IOV_MAX ? count : IOV_MAX, send_flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(client_fd, POLLOUT, deadline_ms) == 0) continue;
+            if (errno == ENOBUFS && zerocopy) {
+                zerocopy = 0; // Over the locked memory allowance for zerocopy, copy instead
+                continue;
+            }
+            result = -1;
+            break;
+        }
+
+        if (zerocopy) zerocopy_sends++;
+        telemetry_response(0, (size_t)n);
+        for (size_t sent = (size_t)n; sent > 0;) {
+            size_t part = sent < iov->iov_len ? sent : iov->iov_len;
+            iov->iov_base = (char *)iov->iov_base + part;
+            iov->iov_len -= part;
+            sent -= part;
+            if (iov->iov_len == 0) {
+                iov++;
+                count--;
+            }
+        }
+    }
+
+    if (zerocopy_sends > 0 && wait_zerocopy_done(client_fd, zerocopy_sends, deadline_ms) != 0) result = -1;
+    if (result != 0) shutdown(client_fd, SHUT_RDWR);
+    return result;
+}
+
+static void head_append(struct response *res, const char *fmt, ...) {
+    size_t room = sizeof(res->head) - res->head_len;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(res->head + res->head_len, room, fmt, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= room) res->overflow = 1;
+    else res->head_len += (size_t)n;
+}
+
+void response_init(struct response *res, int client_fd, const char *status, int flags) {
+    res->client_fd = client_fd;
+    res->status = atoi(status);
+    res->flags = flags;
+    res->overflow = 0;
+    res->head_len = 0;
+    res->body_len = 0;
+    res->segment_count = 1;
+    head_append(res, "HTTP/1.1 %s\r\n", status);
+}
+
+void response_header(struct response *res, const char *name, const char *value) {
+    head_append(res, "%s: %s\r\n", name, value);
+}
+
+void response_body(struct response *res, const void *data, size_t len) {
+    if (len == 0) return;
+    if (res->segment_count == sizeof(res->segments) / sizeof(res->segments[0])) {
+        res->overflow = 1;
+        return;
+    }
+    res->segments[res->segment_count++] = (struct iovec){ .iov_base = (void *)data, .iov_len = len };
+    res->body_len += len;
+}
+
+void response_body_follows(struct response *res, size_t len) {
+    res->body_len += len;
+    if (!(res->flags & RESPONSE_HEAD_ONLY)) res->flags |= RESPONSE_MORE;
+}
+
+int response_send(struct response *res) {
+    if (res->flags & RESPONSE_UNTIL_CLOSE) head_append(res, "Connection: close\r\n\r\n");
+    else head_append(res, "Content-Length: %zu\r\n\r\n", res->body_len);
+
+    if (res->overflow) {
+        // A bug rather than a runtime condition: the fixed sizes cover every response we build
+        fprintf(stderr, "Response head or body segments too large for status %d\n", res->status);
+        send_500(res->client_fd);
+        return -1;
+    }
+
+    res->segments[0] = (struct iovec){ .iov_base = res->head, .iov_len = res->head_len };
+    size_t count = res->flags & RESPONSE_HEAD_ONLY ? 1 : res->segment_count;
+    return send_segments(res->client_fd, res->status, res->segments, count, res->flags & RESPONSE_MORE);
+}
+
+int send_file_range(int client_fd, int fd, off_t offset, size_t len) {
+    long long deadline_ms = monotonic_ms() + (long long)server_config.send_timeout_ms;
+    int result = 0;
+
+    while (len > 0) {
+        ssize_t n = tls_sendfile(client_fd, fd, &offset, len);
+        if (n > 0) {
+            telemetry_response(0, (size_t)n);
+            len -= (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(client_fd, POLLOUT, deadline_ms) == 0) continue;
+        result = -1; // n == 0: the file was truncated under us, the announced length can't be met
+        break;
+    }
+
+    if (result != 0) shutdown(client_fd, SHUT_RDWR);
+    return result;
+}
+
+void send_response(int client_fd, const char *status, const char *content_type, const char *body, size_t len) {
+    struct response res;
+    response_init(&res, client_fd, status, 0);
+    response_header(&res, "Content-Type", content_type);
+    response_body(&res, body, len);
+    response_send(&res);
+}
+
+void send_encoded_response(int client_fd, const char *status, const char *content_type, enum content_coding coding,
+                           const char *body, size_t len) {
+    struct response res;
+    response_init(&res, client_fd, status, 0);
+    response_header(&res, "Content-Type", content_type);
+    if (coding != CONTENT_IDENTITY) response_header(&res, "Content-Encoding", CODING_NAMES[coding]);
+    response_header(&res, "Vary", "Accept-Encoding");
+    response_body(&res, body, len);
+    response_send(&res);
+}
+
+/*
+ * The q-value an Accept-Encoding value gives `coding`, such as 0.5 for "gzip;q=0.5". A coding
+ * that is not listed gets the value of "*", or -1 if there is none either.
+ */
+static double accept_q(struct http_slice accept, const char *coding) {
+    size_t coding_len = strlen(coding);
+    double wildcard = -1;
+
+    for (size_t pos = 0; pos < accept.len;) {
+        size_t end = pos;
+        while (end < accept.len && accept.data[end] != ',') end++;
+
+        const char *item = accept.data + pos;
+        size_t item_len = end - pos;
+        while (item_len > 0 && (*item == ' ' || *item == '\t')) item++, item_len--;
+        size_t name_len = 0;
+        while (name_len < item_len && item[name_len] != ';' && item[name_len] != ' ' && item[name_len] != '\t') name_len++;
+
+        double q = 1;
+        for (size_t i = name_len; i + 2 < item_len; ++i) {
+            if ((item[i] == 'q' || item[i] == 'Q') && item[i + 1] == '=') {
+                char value[8] = { 0 };
+                size_t n = item_len - i - 2 < sizeof(value) - 1 ? item_len - i - 2 : sizeof(value) - 1;
+                memcpy(value, item + i + 2, n);
+                q = strtod(value, NULL);
+                break;
+            }
+        }
+
+        if (name_len == coding_len && strncasecmp(item, coding, coding_len) == 0) return q;
+        if (name_len == 1 && *item == '*') wildcard = q;
+        pos = end + 1;
+    }
+    return wildcard;
+}
+
+enum content_coding response_coding(const struct http_request *req, size_t len) {
+    if (len < server_config.compress_min_bytes) return CONTENT_IDENTITY;
+    struct http_slice accept = http_request_header(req, "Accept-Encoding");
+    if (!accept.data) return CONTENT_IDENTITY;
+
+    double gzip = accept_q(accept, "gzip");
+#ifdef HAVE_ZSTD
+    // Compresses about as well as gzip at a fraction of the CPU, preferred unless ranked lower
+    double zstd = accept_q(accept, "zstd");
+    if (zstd > 0 && zstd >= gzip) return CONTENT_ZSTD;
+#endif
+    return gzip > 0 ? CONTENT_GZIP : CONTENT_IDENTITY;
+}
+
+static char *gzip_body(const char *body, size_t len, size_t *out_len) {
+    z_stream stream = { 0 };
+    // 15 + 16: the largest window, with a gzip header and trailer instead of a zlib one
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+
+    size_t bound = deflateBound(&stream, len);
+    char *out = malloc(bound);
+    int result = Z_STREAM_ERROR;
+    if (out) {
+        stream.next_in = (Bytef *)body;
+        stream.avail_in = (uInt)len;
+        stream.next_out = (Bytef *)out;
+        stream.avail_out = (uInt)bound;
+        result = deflate(&stream, Z_FINISH);
+    }
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+
+    if (result != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static char *compress_body(enum content_coding coding, const char *body, size_t len, size_t *out_len) {
+    if (coding == CONTENT_GZIP) return gzip_body(body, len, out_len);
+#ifdef HAVE_ZSTD
+    if (coding == CONTENT_ZSTD) {
+        size_t bound = ZSTD_compressBound(len);
+        char *out = malloc(bound);
+        if (!out) return NULL;
+        *out_len = ZSTD_compress(out, bound, body, len, 3);
+        if (ZSTD_isError(*out_len)) {
+            free(out);
+            return NULL;
+        }
+        return out;
+    }
+#endif
+    return NULL;
+}
+
+// Caller holds the cache lock
+static void body_unref(struct encoded_body *body) {
+    if (--body->refs > 0) return;
+    free(body->data);
+    free(body);
+}
+
+/*
+ * The first request for a body puts a placeholder into the cache and compresses outside the
+ * lock, later ones find the placeholder and wait for it. Holders keep their own reference, so
+ * a body replaced by a newer version in the meantime stays valid until they are done with it.
+ */
+const struct encoded_body *encoded_cache_get(struct encoded_cache *cache, const char *key, unsigned long long version,
+                                             enum content_coding coding, const char *body, size_t len) {
+    pthread_mutex_lock(&cache->lock);
+    cache->uses++;
+
+    size_t victim = ENCODED_CACHE_SLOTS;
+    for (size_t i = 0; i < ENCODED_CACHE_SLOTS; ++i) {
+        struct encoded_body *slot = cache->slots[i];
+        if (!slot) {
+            if (victim == ENCODED_CACHE_SLOTS) victim = i;
+            continue;
+        }
+        if (slot->coding != coding || strcmp(slot->key, key) != 0) continue;
+
+        if (slot->version != version) {
+            victim = i; // Outdated: replaced right away, not only once the cache is full
+            break;
+        }
+
+        slot->refs++;
+        slot->last_used = cache->uses;
+        while (!slot->ready) pthread_cond_wait(&cache->ready, &cache->lock);
+        if (!slot->data) {
+            body_unref(slot);
+            slot = NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return slot;
+    }
+
+    if (victim == ENCODED_CACHE_SLOTS) {
+        victim = 0;
+        for (size_t i = 1; i < ENCODED_CACHE_SLOTS; ++i) {
+            if (cache->slots[i]->last_used < cache->slots[victim]->last_used) victim = i;
+        }
+    }
+
+    struct encoded_body *entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+    entry->version = version;
+    entry->coding = coding;
+    entry->refs = 2; // The cache's and ours
+    entry->last_used = cache->uses;
+    if (cache->slots[victim]) body_unref(cache->slots[victim]);
+    cache->slots[victim] = entry;
+    pthread_mutex_unlock(&cache->lock);
+
+    size_t compressed_len = 0;
+    char *compressed = compress_body(coding, body, len, &compressed_len);
+
+    pthread_mutex_lock(&cache->lock);
+    entry->data = compressed;
+    entry->len = compressed_len;
+    entry->ready = 1;
+    pthread_cond_broadcast(&cache->ready);
+    if (!compressed) {
+        body_unref(entry);
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+void encoded_body_release(struct encoded_cache *cache, const struct encoded_body *body) {
+    pthread_mutex_lock(&cache->lock);
+    body_unref((struct encoded_body *)body);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void send_stream_head(int client_fd, const char *content_type) {
+    struct response res;
+    response_init(&res, client_fd, "200 OK", RESPONSE_UNTIL_CLOSE);
+    response_header(&res, "Content-Type", content_type);
+    response_header(&res, "Cache-Control", "no-cache");
+    response_send(&res);
+}
+
+// Whether an If-None-Match list names the entity tag, weak tags compared by their value
+static int etag_listed(struct http_slice list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    for (size_t pos = 0; pos < list.len;) {
+        size_t end = pos;
+        while (end < list.len && list.data[end] != ',') end++;
+
+        const char *tag = list.data + pos;
+        size_t tag_len = end - pos;
+        while (tag_len > 0 && (*tag == ' ' || *tag == '\t')) tag++, tag_len--;
+        while (tag_len > 0 && (tag[tag_len - 1] == ' ' || tag[tag_len - 1] == '\t')) tag_len--;
+        if (tag_len >= 2 && tag[0] == 'W' && tag[1] == '/') tag += 2, tag_len -= 2;
+
+        if ((tag_len == 1 && *tag == '*') || (tag_len == etag_len && memcmp(tag, etag, etag_len) == 0)) return 1;
+        pos = end + 1;
+    }
+    return 0;
+}
+
+// Parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT". Returns: 0 on success, -1 otherwise.
+static int parse_http_date(struct http_slice value, time_t *time) {
+    char date[40];
+    if (value.len >= sizeof(date)) return -1;
+    memcpy(date, value.data, value.len);
+    date[value.len] = '\0';
+
+    struct tm tm = { 0 };
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return -1;
+    *time = timegm(&tm);
+    return 0;
+}
+
+/*
+ * Parses a Range header against a file of `size` bytes: "bytes=first-last", "bytes=first-" or
+ * "bytes=-suffix_length". Several ranges would need a multipart body; like any other form we
+ * don't handle, they are ignored and the whole file is sent, which the client has to accept.
+ * Returns: 1 with the range set, 0 to ignore the header, -1 if the range is unsatisfiable.
+ */
+static int parse_range(struct http_slice range, off_t size, off_t *first, off_t *last) {
+    char spec[64];
+    if (range.len < 6 || range.len >= sizeof(spec) || strncasecmp(range.data, "bytes=", 6) != 0) return 0;
+    memcpy(spec, range.data + 6, range.len - 6);
+    spec[range.len - 6] = '\0';
+    if (strchr(spec, ',')) return 0;
+
+    char *dash = strchr(spec, '-');
+    if (!dash) return 0;
+    *dash = '\0';
+    const char *from = spec, *to = dash + 1;
+    if ((*from && strspn(from, "0123456789") != strlen(from)) || strspn(to, "0123456789") != strlen(to)) return 0;
+    if (!*from && !*to) return 0;
+
+    if (!*from) {
+        unsigned long long suffix = strtoull(to, NULL, 10);
+        if (suffix == 0 || size == 0) return -1;
+        *first = suffix >= (unsigned long long)size ? 0 : size - (off_t)suffix;
+        *last = size - 1;
+        return 1;
+    }
+
+    unsigned long long start = strtoull(from, NULL, 10);
+    unsigned long long end = *to ? strtoull(to, NULL, 10) : (unsigned long long)size - 1;
+    if (*to && end < start) return 0; // Invalid, which is not the same as unsatisfiable
+    if (start >= (unsigned long long)size) return -1;
+    *first = (off_t)start;
+    *last = end >= (unsigned long long)size ? size - 1 : (off_t)end;
+    return 1;
+}
+
+static const char *file_content_type(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot && (strcmp(dot, ".log") == 0 || strcmp(dot, ".txt") == 0)) return "text/plain";
+    if (dot && strcmp(dot, ".json") == 0) return "application/json";
+    if (dot && strcmp(dot, ".gz") == 0) return "application/gzip";
+    return "application/octet-stream";
+}
+
+/*
+ * The conditional headers are evaluated in the order RFC 9110 gives them: If-None-Match wins
+ * over If-Modified-Since, and a Range only applies if If-Range (when sent) still matches the
+ * file, otherwise the client's partial copy is outdated and it gets the whole file again.
+ */
+void send_file_response(int client_fd, const struct http_request *req, const char *path) {
+    const struct cached_file *file = file_cache_open(path);
+    if (!file) {
+        if (errno == ENOMEM || errno == EMFILE || errno == ENFILE) send_500(client_fd);
+        else send_404(client_fd);
         return;
     }
 
-    dprintf(client_fd, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+    struct http_slice if_none_match = http_request_header(req, "If-None-Match");
+    struct http_slice if_modified_since = http_request_header(req, "If-Modified-Since");
+    time_t since;
+    int not_modified = if_none_match.data ? etag_listed(if_none_match, file->etag)
+                                          : if_modified_since.data && parse_http_date(if_modified_since, &since) == 0 &&
+                                            file->mtime <= since;
 
-    char buf[1024];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        write(client_fd, buf, n);
+    off_t first = 0, last = file->size - 1;
+    int range = 0;
+    struct http_slice range_header = http_request_header(req, "Range");
+    if (!not_modified && range_header.data) {
+        struct http_slice if_range = http_request_header(req, "If-Range");
+        time_t date;
+        int current = !if_range.data ||
+                      (if_range.len == strlen(file->etag) && memcmp(if_range.data, file->etag, if_range.len) == 0) ||
+                      (parse_http_date(if_range, &date) == 0 && date == file->mtime);
+        if (current) range = parse_range(range_header, file->size, &first, &last);
     }
 
-    fclose(fp);
+    struct response res;
+    char content_range[96];
+    if (not_modified) {
+        response_init(&res, client_fd, "304 Not Modified", RESPONSE_HEAD_ONLY);
+        response_header(&res, "ETag", file->etag);
+        response_header(&res, "Last-Modified", file->last_modified);
+        response_body_follows(&res, (size_t)file->size);
+        response_send(&res);
+    } else if (range < 0) {
+        snprintf(content_range, sizeof(content_range), "bytes */%lld", (long long)file->size);
+        response_init(&res, client_fd, "416 Range Not Satisfiable", 0);
+        response_header(&res, "Content-Range", content_range);
+        response_send(&res);
+    } else {
+        size_t len = file->size > 0 ? (size_t)(last - first + 1) : 0;
+        response_init(&res, client_fd, range ? "206 Partial Content" : "200 OK", 0);
+        response_header(&res, "Content-Type", file_content_type(path));
+        response_header(&res, "Accept-Ranges", "bytes");
+        response_header(&res, "ETag", file->etag);
+        response_header(&res, "Last-Modified", file->last_modified);
+        if (range) {
+            snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld",
+                     (long long)first, (long long)last, (long long)file->size);
+            response_header(&res, "Content-Range", content_range);
+        }
+        if (len > 0) response_body_follows(&res, len);
+        if (response_send(&res) == 0 && len > 0) send_file_range(client_fd, file->fd, first, len);
+    }
+
+    file_cache_release(file);
+}
+
+// Sends a response without a body. With `close`, the client is told the connection ends after it.
+static void send_bodyless(int client_fd, const char *status, int close) {
+    struct response res;
+    response_init(&res, client_fd, status, 0);
+    if (close) response_header(&res, "Connection", "close");
+    response_send(&res);
+}
+
+// Error responses always carry a Content-Length, otherwise a keep-alive client can't tell
+// where the response ends.
+// Malformed requests are answered with "Connection: close", the connection is dropped right after.
+void send_400(int client_fd) {
+    send_bodyless(client_fd, "400 Bad Request", 1);
 }
 
 void send_401(int client_fd) {
-    dprintf(client_fd, "HTTP/1.1 401 Unauthorized\r\n\r\n");
+    send_bodyless(client_fd, "401 Unauthorized", 0);
 }
 
 void send_404(int client_fd) {
-    dprintf(client_fd, "HTTP/1.1 404 Not Found\r\n\r\nFile Not Found");
+    send_response(client_fd, "404 Not Found", "text/plain", "File Not Found", 14);
+}
+
+void send_405(int client_fd, const char *allow) {
+    struct response res;
+    response_init(&res, client_fd, "405 Method Not Allowed", 0);
+    response_header(&res, "Allow", allow);
+    response_send(&res);
 }
 
-void send_405(int client_fd) {
-    dprintf(client_fd, "HTTP/1.1 405 Method Not Allowed\r\n\r\n");
+void send_431(int client_fd) {
+    send_bodyless(client_fd, "431 Request Header Fields Too Large", 1);
+}
+
+void send_505(int client_fd) {
+    send_bodyless(client_fd, "505 HTTP Version Not Supported", 1);
+}
+
+void send_413(int client_fd) {
+    send_bodyless(client_fd, "413 Content Too Large", 1);
+}
+
+void send_500(int client_fd) {
+    send_bodyless(client_fd, "500 Internal Server Error", 0);
+}
+
+void send_501(int client_fd) {
+    send_bodyless(client_fd, "501 Not Implemented", 1);
+}
+
+// Interim response telling a client that sent "Expect: 100-continue" to go ahead with the body.
+// It has no body and, unlike final responses, no Content-Length.
+void send_100_continue(int client_fd) {
+    static const char head[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    struct iovec iov = { .iov_base = (void *)head, .iov_len = sizeof(head) - 1 };
+    send_segments(client_fd, 100, &iov, 1, 0);
+}
+
+void send_503(int client_fd) {
+    struct response res;
+    response_init(&res, client_fd, "503 Service Unavailable", 0);
+    response_header(&res, "Retry-After", "1");
+    response_send(&res);
+}
+
+void send_429(int client_fd, unsigned retry_after_s) {
+    char retry_after[16];
+    snprintf(retry_after, sizeof(retry_after), "%u", retry_after_s);
+
+    struct response res;
+    response_init(&res, client_fd, "429 Too Many Requests", 0);
+    response_header(&res, "Retry-After", retry_after);
+    response_header(&res, "Connection", "close");
+    response_send(&res);
 }
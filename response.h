@@ -1,16 +1,179 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
+#include <pthread.h>
 #include <stddef.h> // For size_t
 #include <stdio.h>  // For FILE (though not directly in function signatures, common for dprintf/fopen context)
+#include <sys/types.h> // For off_t
+#include <sys/uio.h>   // For struct iovec
 
-// Function to send an HTTP 200 OK response and the content of a file.
+#include "http_parser.h"
+
+#define ENCODED_CACHE_SLOTS 8
+#define RESPONSE_HEAD_CAPACITY 512
+#define RESPONSE_MAX_BODY_SEGMENTS 8
+
+// Flags for response_init() and send_segments().
+#define RESPONSE_UNTIL_CLOSE 1 // No Content-Length, the body runs until the connection is closed
+#define RESPONSE_MORE 2        // More data follows right away, don't push out a partial segment
+#define RESPONSE_HEAD_ONLY 4   // Only the head is sent, its Content-Length describes the body (304)
+
+/*
+ * A response being assembled. The status line and headers are formatted into `head`, the body
+ * segments are referenced where they are, and everything leaves in one sendmsg() call.
+ */
+struct response {
+    int client_fd;
+    int status;
+    int flags;
+    int overflow;                 // The head or the segments didn't fit, a 500 is sent instead
+    size_t head_len;
+    size_t body_len;
+    size_t segment_count;         // segments[0] is the head
+    struct iovec segments[1 + RESPONSE_MAX_BODY_SEGMENTS];
+    char head[RESPONSE_HEAD_CAPACITY];
+};
+
+// Content codings a response body can be sent in. zstd is only offered when
+// built with libzstd (HAVE_ZSTD).
+enum content_coding {
+    CONTENT_IDENTITY,
+    CONTENT_GZIP,
+    CONTENT_ZSTD,
+};
+
+// A compressed body shared by every client asking for the same content in the
+// same coding. Obtained from encoded_cache_get(), read-only for the holder.
+struct encoded_body {
+    char key[48];
+    unsigned long long version;
+    enum content_coding coding;
+    int ready;                   // 0 while the first requester compresses it
+    int refs;                    // Holders, plus one while it is in the cache
+    unsigned long long last_used;
+    char *data;                  // NULL if compression failed
+    size_t len;
+};
+
+// The compressed forms of a module's recent responses. Declare one per module
+// with ENCODED_CACHE_INITIALIZER.
+struct encoded_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct encoded_body *slots[ENCODED_CACHE_SLOTS];
+    unsigned long long uses;
+};
+
+#define ENCODED_CACHE_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, 0 }
+
+// Function to start building a response.
+//
+// int client_fd: The file descriptor of the client socket.
+// const char *status: Status code and reason, e.g. "200 OK".
+// int flags: RESPONSE_UNTIL_CLOSE and/or RESPONSE_MORE, or 0.
+void response_init(struct response *res, int client_fd, const char *status, int flags);
+
+// Function to add a header field. Content-Length is added by response_send().
+void response_header(struct response *res, const char *name, const char *value);
+
+// Function to append a body segment. The data is not copied and must stay
+// valid until response_send() returned.
+void response_body(struct response *res, const void *data, size_t len);
+
+// Function to announce a body of `len` bytes that the caller sends itself
+// with send_segments() right after response_send(). Implies RESPONSE_MORE.
+void response_body_follows(struct response *res, size_t len);
+
+// Function to send the response: the head with its Content-Length, and the
+// body segments.
+//
+// Returns: 0 once everything was sent, -1 if it could not be (see
+//          send_segments()).
+int response_send(struct response *res);
+
+// Function to send bytes to a client, completely. Waits for a socket that is
+// full to drain, up to ADMIN_SEND_TIMEOUT_MS in total, and never raises
+// SIGPIPE. Bodies of at least ADMIN_ZEROCOPY_MIN_BYTES are sent with
+// MSG_ZEROCOPY; the call returns once the kernel released them.
+// If sending fails the socket is shut down: the client has a partial
+// response, nothing else may follow on that connection.
+//
+// int status: Accounted as the response status, 0 for a continuation.
+// struct iovec *iov, size_t count: The data. Modified as it is sent.
+// int flags: RESPONSE_MORE or 0.
+// Returns: 0 on success, -1 on failure.
+int send_segments(int client_fd, int status, struct iovec *iov, size_t count, int flags);
+
+// Function to send part of a file to a client with sendfile(), without
+// copying it through user space. Same waiting, deadline and failure
+// handling as send_segments().
+//
+// int fd: The file, read from `offset` on without moving its file offset.
+// size_t len: Bytes to send. A file that got shorter fails the send.
+// Returns: 0 on success, -1 on failure.
+int send_file_range(int client_fd, int fd, off_t offset, size_t len);
+
+// Function to send a complete response with a body held in memory.
+//
+// int client_fd: The file descriptor of the client socket.
+// const char *status: Status code and reason, e.g. "200 OK".
+// const char *content_type: Value of the Content-Type header.
+// const char *body, size_t len: The body.
+void send_response(int client_fd, const char *status, const char *content_type, const char *body, size_t len);
+
+// Function to pick the coding for a response body from the request's
+// Accept-Encoding. Bodies smaller than ADMIN_COMPRESS_MIN_BYTES are always
+// sent as they are, compressing them costs more than it saves.
+//
+// size_t len: Length of the uncompressed body.
+// Returns: The coding to send the body in.
+enum content_coding response_coding(const struct http_request *req, size_t len);
+
+// Function to get the compressed form of a body from a cache, compressing it
+// if this is the first request for it. Concurrent requests for the same body
+// wait for that one compression pass instead of doing their own.
+//
+// const char *key, unsigned long long version: Identify the content, e.g.
+//     "metrics" and the sample number. A new version replaces the old one.
+// enum content_coding coding: The coding, not CONTENT_IDENTITY.
+// const char *body, size_t len: The uncompressed body, used on a miss.
+// Returns: The body with a reference the caller must give back with
+//          encoded_body_release(), or NULL if compression failed.
+const struct encoded_body *encoded_cache_get(struct encoded_cache *cache, const char *key, unsigned long long version,
+                                             enum content_coding coding, const char *body, size_t len);
+
+// Function to give back a body obtained from encoded_cache_get().
+void encoded_body_release(struct encoded_cache *cache, const struct encoded_body *body);
+
+// Function to send a complete response with a body that may be compressed.
+// Like send_response(), plus the Content-Encoding and Vary headers.
+//
+// enum content_coding coding: The coding `body` is in.
+void send_encoded_response(int client_fd, const char *status, const char *content_type, enum content_coding coding,
+                           const char *body, size_t len);
+
+// Function to start a 200 OK response whose body runs until the connection
+// is closed, such as an event stream. Only the head is sent.
+//
+// int client_fd: The file descriptor of the client socket.
+// const char *content_type: Value of the Content-Type header.
+void send_stream_head(int client_fd, const char *content_type);
+
+// Function to answer a GET for a file: 200 with the whole file, 206 for a
+// single satisfiable Range (416 if none is), or 304 when If-None-Match or
+// If-Modified-Since show the client's copy is current. Responses carry
+// ETag, Last-Modified and Accept-Ranges so clients can resume or revalidate.
 // If the file cannot be opened, it calls send_404.
 //
 // int client_fd: The file descriptor of the client socket.
+// const struct http_request *req: The request, for its conditional headers.
 // const char *path: The path to the file to be served.
-void send_file_response(int client_fd, const char *path);
+void send_file_response(int client_fd, const struct http_request *req, const char *path);
 
+// Function to send an HTTP 400 Bad Request response for a malformed request.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_400(int client_fd);
 
 void send_401(int client_fd);
 
@@ -22,6 +185,54 @@ void send_404(int client_fd);
 // Function to send an HTTP 405 Method Not Allowed response.
 //
 // int client_fd: The file descriptor of the client socket.
-void send_405(int client_fd);
+// const char *allow: The methods the path supports, e.g. "GET, POST".
+void send_405(int client_fd, const char *allow);
+
+// Function to send an HTTP 431 Request Header Fields Too Large response, used
+// when a request head exceeds ADMIN_MAX_HEADER_BYTES or HTTP_MAX_HEADERS.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_431(int client_fd);
+
+// Function to send an HTTP 505 HTTP Version Not Supported response.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_505(int client_fd);
+
+// Function to send an HTTP 413 Content Too Large response, used when a body
+// exceeds the limit of its route.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_413(int client_fd);
+
+// Function to send an HTTP 500 Internal Server Error response.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_500(int client_fd);
+
+// Function to send an HTTP 501 Not Implemented response, used for transfer
+// codings other than chunked.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_501(int client_fd);
+
+// Function to send the interim "100 Continue" response before reading a body
+// the client announced with "Expect: 100-continue".
+//
+// int client_fd: The file descriptor of the client socket.
+void send_100_continue(int client_fd);
+
+// Function to send an HTTP 503 Service Unavailable response, used when the
+// server sheds load.
+//
+// int client_fd: The file descriptor of the client socket.
+void send_503(int client_fd);
+
+// Function to send an HTTP 429 Too Many Requests response and close the
+// connection, used when a client exceeds its request rate.
+//
+// int client_fd: The file descriptor of the client socket.
+// unsigned retry_after_s: When the client may send again, for Retry-After.
+void send_429(int client_fd, unsigned retry_after_s);
 
 #endif // RESPONSE_H
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include "router.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ROUTER_MAX_NODES 128
+#define ROUTER_EDGE_SLOTS 256 // Power of two, at least twice ROUTER_MAX_NODES to keep probes short
+
+/*
+ * The route table is compiled into a trie over path segments. Every node is one path prefix;
+ * the static children of all nodes live in a single open-addressing hash table keyed by
+ * (parent node, segment), so descending one level costs one hash of the segment and, almost
+ * always, one probe. A node has at most one parameter child, taken when no static child
+ * matches. The whole structure is built once at startup into fixed arrays and never written
+ * again, so lookups need no lock.
+ */
+struct route_node {
+    int param_child;            // -1 if the node has no {name} child
+    char param_name[32];        // Name of that child's parameter
+    const struct route *routes[HTTP_METHOD_COUNT];
+    char allow[64];             // Allow header value, precomputed for 405 responses
+};
+
+struct route_edge {
+    int parent;                 // -1 marks an empty slot
+    const char *segment;
+    size_t segment_len;
+    int child;
+};
+
+static struct route_node nodes[ROUTER_MAX_NODES];
+static size_t node_count = 0;
+static struct route_edge edges[ROUTER_EDGE_SLOTS];
+
+static const char *const METHOD_NAMES[HTTP_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS"
+};
+
+static int parse_method(struct http_slice method) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        if (http_slice_equals(method, METHOD_NAMES[i])) return i;
+    }
+    return -1;
+}
+
+// FNV-1a over the parent id and the segment bytes
+static uint32_t edge_hash(int parent, const char *segment, size_t len) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    hash *= 16777619u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)segment[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int find_static_child(int parent, const char *segment, size_t len) {
+    uint32_t slot = edge_hash(parent, segment, len) & (ROUTER_EDGE_SLOTS - 1);
+
+    while (edges[slot].parent >= 0) {
+        const struct route_edge *edge = &edges[slot];
+        if (edge->parent == parent && edge->segment_len == len && memcmp(edge->segment, segment, len) == 0) {
+            return edge->child;
+        }
+        slot = (slot + 1) & (ROUTER_EDGE_SLOTS - 1);
+    }
+    return -1;
+}
+
+static int new_node(void) {
+    if (node_count == ROUTER_MAX_NODES) return -1;
+
+    struct route_node *node = &nodes[node_count];
+    memset(node, 0, sizeof(*node));
+    node->param_child = -1;
+    return (int)node_count++;
+}
+
+static int add_static_child(int parent, const char *segment, size_t len) {
+    int child = find_static_child(parent, segment, len);
+    if (child >= 0) return child;
+
+    child = new_node();
+    if (child < 0) return -1;
+
+    uint32_t slot = edge_hash(parent, segment, len) & (ROUTER_EDGE_SLOTS - 1);
+    while (edges[slot].parent >= 0) slot = (slot + 1) & (ROUTER_EDGE_SLOTS - 1);
+    edges[slot] = (struct route_edge){ parent, segment, len, child };
+    return child;
+}
+
+static int add_param_child(int parent, const char *name, size_t len) {
+    struct route_node *node = &nodes[parent];
+    if (len >= sizeof(node->param_name)) return -1;
+
+    if (node->param_child >= 0) {
+        // "/jobs/{id}" and "/jobs/{name}" would capture the same segment under two names
+        if (strlen(node->param_name) != len || memcmp(node->param_name, name, len) != 0) return -1;
+        return node->param_child;
+    }
+
+    int child = new_node();
+    if (child < 0) return -1;
+    node->param_child = child;
+    memcpy(node->param_name, name, len);
+    node->param_name[len] = '\0';
+    return child;
+}
+
+static int add_route(const struct route *route) {
+    int method = parse_method((struct http_slice){ route->method, strlen(route->method) });
+    if (method < 0 || route->pattern[0] != '/') return -1;
+
+    int node = 0;
+    size_t params = 0;
+    const char *segment = route->pattern + 1;
+
+    while (*segment) {
+        const char *end = strchr(segment, '/');
+        size_t len = end ? (size_t)(end - segment) : strlen(segment);
+
+        if (len >= 2 && segment[0] == '{' && segment[len - 1] == '}') {
+            if (++params > ROUTE_MAX_PARAMS) return -1;
+            node = add_param_child(node, segment + 1, len - 2);
+        } else {
+            node = add_static_child(node, segment, len);
+        }
+        if (node < 0) return -1;
+
+        if (!end) break;
+        segment = end + 1;
+    }
+
+    if (nodes[node].routes[method]) return -1; // Registered twice
+    nodes[node].routes[method] = route;
+    return 0;
+}
+
+static void build_allow_header(struct route_node *node) {
+    size_t len = 0;
+    node->allow[0] = '\0';
+
+    for (int i = 0; i < HTTP_METHOD_COUNT; ++i) {
+        if (!node->routes[i]) continue;
+        len += (size_t)snprintf(node->allow + len, sizeof(node->allow) - len, "%s%s",
+                                len ? ", " : "", METHOD_NAMES[i]);
+    }
+}
+
+int router_init(const struct route *routes, size_t count) {
+    for (size_t i = 0; i < ROUTER_EDGE_SLOTS; ++i) edges[i].parent = -1;
+    node_count = 0;
+    new_node(); // Root, matches "/"
+
+    for (size_t i = 0; i < count; ++i) {
+        if (add_route(&routes[i]) != 0) {
+            fprintf(stderr, "Invalid or conflicting route: %s %s\n", routes[i].method, routes[i].pattern);
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < node_count; ++i) build_allow_header(&nodes[i]);
+    return 0;
+}
+
+/*
+ * Static segments win over parameters. When a static branch dead-ends further down, the
+ * parameter branch of the same node is tried instead, so "/jobs/active" and "/jobs/{id}/output"
+ * can coexist. The depth of the path bounds the work, not the size of the table.
+ */
+static int match_node(int node, const char *segment, const char *path_end, struct route_params *params) {
+    if (segment > path_end) return node;
+
+    const char *end = memchr(segment, '/', (size_t)(path_end - segment));
+    if (!end) end = path_end;
+    size_t len = (size_t)(end - segment);
+
+    int child = find_static_child(node, segment, len);
+    if (child >= 0) {
+        int found = match_node(child, end + 1, path_end, params);
+        if (found >= 0) return found;
+    }
+
+    child = nodes[node].param_child;
+    if (child < 0 || len == 0 || params->count == ROUTE_MAX_PARAMS) return -1;
+
+    size_t index = params->count++;
+    params->names[index] = nodes[node].param_name;
+    params->values[index] = (struct http_slice){ segment, len };
+
+    int found = match_node(child, end + 1, path_end, params);
+    if (found < 0) params->count = index;
+    return found;
+}
+
+enum route_result router_match(const struct http_request *req, const struct route **route,
+                               struct route_params *params, const char **allow) {
+    params->count = 0;
+    if (req->path.len == 0 || req->path.data[0] != '/') return ROUTE_NOT_FOUND;
+
+    // The root has no segment at all; any other path starts matching after its first '/'
+    const char *path_end = req->path.data + req->path.len;
+    int node = req->path.len == 1 ? 0 : match_node(0, req->path.data + 1, path_end, params);
+    if (node < 0) return ROUTE_NOT_FOUND;
+
+    int method = parse_method(req->method);
+    if (method >= 0 && nodes[node].routes[method]) {
+        *route = nodes[node].routes[method];
+        return ROUTE_FOUND;
+    }
+
+    // A node without any handler is only an inner prefix, like "/admin" for "/admin/rebuild"
+    if (nodes[node].allow[0] == '\0') return ROUTE_NOT_FOUND;
+    *allow = nodes[node].allow;
+    return ROUTE_METHOD_NOT_ALLOWED;
+}
+
+struct http_slice route_param(const struct route_params *params, const char *name) {
+    for (size_t i = 0; i < params->count; ++i) {
+        if (strcmp(params->names[i], name) == 0) return params->values[i];
+    }
+    return (struct http_slice){ NULL, 0 };
+}
@@ -0,0 +1,75 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h> // For size_t
+
+#include "http_parser.h"
+
+struct request_body;
+
+enum http_method {
+    HTTP_GET,
+    HTTP_HEAD,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_DELETE,
+    HTTP_PATCH,
+    HTTP_OPTIONS,
+    HTTP_METHOD_COUNT
+};
+
+// Maximum number of {name} segments in one route pattern.
+#define ROUTE_MAX_PARAMS 4
+
+// Values captured by the {name} segments of the matched pattern, in order.
+struct route_params {
+    size_t count;
+    const char *names[ROUTE_MAX_PARAMS];
+    struct http_slice values[ROUTE_MAX_PARAMS]; // Point into the request path
+};
+
+// Handler of a route, see handle_request() for the meaning of `body`.
+typedef void (*route_handler)(int client_fd, const struct http_request *req,
+                              const struct route_params *params, struct request_body *body);
+
+// One entry of a route table.
+//
+// const char *method: "GET", "POST", ...
+// const char *pattern: Path such as "/metrics" or "/jobs/{id}/output". A
+//                      segment in braces matches any single segment.
+struct route {
+    const char *method;
+    const char *pattern;
+    route_handler handler;
+};
+
+enum route_result {
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,
+    ROUTE_METHOD_NOT_ALLOWED
+};
+
+// Function to compile a route table into the lookup structure used by
+// router_match(). Call once at startup, before any request is served.
+// The table must outlive the router.
+//
+// Returns: 0 on success, -1 if a pattern is invalid, two routes clash, or
+//          the table exceeds the router's fixed capacity.
+int router_init(const struct route *routes, size_t count);
+
+// Function to find the route of a request. The cost depends on the number
+// of segments in the path, not on the number of routes.
+//
+// const struct route **route: Set when ROUTE_FOUND is returned, to the
+//                             matching entry of the table.
+// struct route_params *params: Filled with the captured segments.
+// const char **allow: Set when ROUTE_METHOD_NOT_ALLOWED is returned, to the
+//                     value of the Allow header listing the path's methods.
+enum route_result router_match(const struct http_request *req, const struct route **route,
+                               struct route_params *params, const char **allow);
+
+// Function to look up a captured segment by the name used in the pattern.
+// Returns: The segment, or an empty slice with a NULL data pointer.
+struct http_slice route_param(const struct route_params *params, const char *name);
+
+#endif // ROUTER_H
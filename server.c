@@ -1,16 +1,73 @@
+#define _GNU_SOURCE // For accept4() and pthread_attr_setaffinity_np()
 #include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // For PTHREAD_STACK_MIN
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/filter.h> // For the reuseport steering program
 #include <netdb.h>
 
+#include "admission.h"
+#include "config.h"
+#include "connection.h"
+#include "cpus.h"
+#include "event_loop.h"
+#include "jobs.h"
+#include "service_manager.h"
+#include "signal.h"
 #include "thread_pool.h"
+#include "upgrade.h"
 
-int start_server(int port) {
+#define MAX_REACTORS 256
+#define DRAIN_CHECK_INTERVAL_MS 20
+#define JOB_KILL_GRACE_MS 1000
+
+/*
+ * A listening socket with the loop that accepts from it. In the default mode there is one,
+ * run by the main thread, whose connections are served by the request worker pool. With
+ * ADMIN_REACTORS there is one per reactor thread, which serves its connections itself.
+ */
+struct listener {
+    int fd;
+    int spare_fd; // See on_listener_ready()
+    int cpu;      // The reactor's CPU, -1 in the default mode
+    struct event_loop *loop;
+    struct connection_group *connections;
+};
+
+static struct listener listeners[MAX_REACTORS];
+static size_t listener_count = 0;
+static int reactor_mode = 0;
+
+// Cleared while draining, the listeners stay registered but leave their connections queued
+static atomic_int accepting = 1;
+
+enum drain_goal {
+    DRAIN_NONE,
+    DRAIN_TO_EXIT,    // SIGINT or SIGTERM
+    DRAIN_TO_UPGRADE, // SIGUSR2
+};
+
+// Only touched on the main thread, by the callbacks of its loop
+static enum drain_goal drain_goal = DRAIN_NONE;
+static long long drain_started_ms;
+static long long drain_deadline_ms;
+static int drain_jobs_killed;
+static int drain_timer_fd = -1;
+
+static int open_listener(int port, int reuseport) {
 
     int server_fd = -1;
     int optval = 1; // Optval being 1 means the option argument should be "enabled" when used in socket options call
@@ -76,10 +133,16 @@ int start_server(int port) {
         Instead, we register the socket with epoll, and only act when the kernel tells you it’s ready.
          */
 
-        server_fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
+        server_fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
         if (server_fd == -1) continue;
 
         setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        // Every reactor binds its own socket to the port, the kernel spreads connections over them
+        if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
 
         if (bind(server_fd, rp->ai_addr, rp->ai_addrlen) == 0) {
             break; // success
@@ -96,7 +159,7 @@ int start_server(int port) {
         return -1;
     }
 
-    if (listen(server_fd, 16) < 0) {
+    if (listen(server_fd, (int)server_config.listen_backlog) < 0) {
         perror("listen");
         close(server_fd);
         return -1;
@@ -105,11 +168,385 @@ int start_server(int port) {
     return server_fd;
 }
 
-void accept_clients(int server_fd) {
-    while (1) {
-        int client_fd = accept(server_fd, NULL, NULL);
-        if (client_fd < 0) continue;
+/*
+ * Steers a connection to the reactor pinned to the CPU that received it (and ran the TCP
+ * handshake in softirq context), so its socket stays warm in that CPU's cache. A connection
+ * arriving on any other CPU goes to reactor cpu % count. Indexes are the order in which the
+ * sockets joined the port, i.e. the order of listeners[].
+ *
+ * The program maps each CPU to a single reactor. With more reactors than CPUs, those sharing a
+ * CPU with an earlier one would only get connections from CPUs without a reactor, so the
+ * program is not attached then and the kernel's hash spreads the connections evenly.
+ */
+static void attach_cpu_steering(void) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    for (size_t i = 1; i < listener_count; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (listeners[i].cpu == listeners[j].cpu) {
+                fprintf(stderr, "Ignoring ADMIN_REUSEPORT_CBPF, reactors %zu and %zu share CPU %d\n",
+                        j, i, listeners[i].cpu);
+                return;
+            }
+        }
+    }
+
+    struct sock_filter code[2 * MAX_REACTORS + 3];
+    size_t n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for (size_t i = 0; i < listener_count; ++i) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)listeners[i].cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)listener_count);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = { .len = (unsigned short)n, .filter = code };
+    if (setsockopt(listeners[0].fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF"); // The kernel's hash still spreads the connections
+    }
+#else
+    fprintf(stderr, "ADMIN_REUSEPORT_CBPF is not supported on this system\n");
+#endif
+}
+
+/*
+ * Takes over the listening sockets of the process this one replaced: "<reactor mode>:<fd>,<fd>...".
+ * Connections that arrived during the upgrade are waiting in their accept queues. The layout is
+ * kept as it was, the configuration is the same anyway since the environment is inherited.
+ * Returns: The number of sockets taken over, 0 if there are none.
+ */
+static size_t adopt_listeners(void) {
+    const char *value = upgrade_state("listeners");
+    if (!value) return 0;
+
+    char *end;
+    long mode = strtol(value, &end, 10);
+    while (*end == ':' || *end == ',') {
+        long long fd = strtoll(end + 1, &end, 10);
+        int accepts = 0;
+        socklen_t len = sizeof(accepts);
+        if (upgrade_adopt_fd(fd) < 0 || getsockopt((int)fd, SOL_SOCKET, SO_ACCEPTCONN, &accepts, &len) != 0 ||
+            !accepts || listener_count == MAX_REACTORS) {
+            break;
+        }
+        listeners[listener_count] = (struct listener){ .fd = (int)fd, .cpu = mode ? cpus_reactor_cpu(listener_count) : -1 };
+        listener_count++;
+    }
+    if (listener_count == 0) return 0;
+
+    reactor_mode = mode != 0;
+    printf("Took over %zu listening socket%s\n", listener_count, listener_count == 1 ? "" : "s");
+    return listener_count;
+}
+
+int start_server(int port) {
+    if (upgrade_resumed() && adopt_listeners() > 0) return listeners[0].fd;
+
+    size_t reactors = server_config.reactors;
+    if (reactors == 0) reactors = cpus_reactor_cpu_count();
+    if (reactors > MAX_REACTORS) reactors = MAX_REACTORS;
+
+    if (reactors == 0) {
+        listeners[0] = (struct listener){ .fd = open_listener(port, 0), .cpu = -1 };
+        listener_count = 1;
+        return listeners[0].fd;
+    }
+
+    for (size_t i = 0; i < reactors; ++i) {
+        int fd = open_listener(port, 1);
+        if (fd < 0) {
+            while (listener_count > 0) close(listeners[--listener_count].fd);
+            return -1;
+        }
+        listeners[listener_count++] = (struct listener){ .fd = fd, .cpu = cpus_reactor_cpu(i) };
+    }
+    reactor_mode = 1;
+    if (server_config.reuseport_cbpf) attach_cpu_steering();
+    return listeners[0].fd;
+}
+
+/*
+ * Each listener keeps a spare descriptor to survive EMFILE/ENFILE. With an edge-triggered
+ * listener, a pending connection we fail to accept produces no new edge, so it would sit in
+ * the backlog forever. When the process runs out of fds we briefly give the spare up, accept
+ * the connection and close it straight away, which tells the client to back off instead of
+ * hanging.
+ */
+static void on_listener_ready(struct event_loop *loop, int server_fd, uint32_t events, void *arg) {
+    struct listener *listener = arg;
+
+    /*
+     * The listener is edge-triggered: we are told once that the accept queue became non-empty,
+     * so we have to drain it completely, until accept() reports EAGAIN.
+     */
+    while (atomic_load_explicit(&accepting, memory_order_relaxed)) {
+        // Non-blocking: every read and write of a client goes through MSG_DONTWAIT or a deadline anyway
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int client_fd = accept4(server_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+            if ((errno == EMFILE || errno == ENFILE) && listener->spare_fd >= 0) {
+                close(listener->spare_fd);
+                int rejected_fd = accept(server_fd, NULL, NULL);
+                if (rejected_fd >= 0) close(rejected_fd);
+                listener->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                continue;
+            }
+
+            perror("accept");
+            return;
+        }
+
+        struct client_addr client;
+        client_addr_from(&client, &addr);
+        if (!admission_accept(client_fd, &client, connections_open_count())) continue;
+        connection_open(listener->connections, client_fd, &client);
+    }
+}
+
+// Sets up the loop of a listener, with its connections served on `pool` (NULL: on the loop thread)
+static int listener_start(struct listener *listener, struct thread_pool *pool) {
+    listener->loop = event_loop_create();
+    if (!listener->loop) return -1;
+    listener->connections = connection_group_create(listener->loop, pool, listener_count);
+    if (!listener->connections) return -1;
 
-        spawn_thread_for_client(client_fd); // Thread function in thread_pool.c
+    // Every tick of the connections' timer wheel
+    event_loop_set_timer(listener->loop, CONNECTION_TIMER_TICK_MS, connections_sweep_idle, listener->connections);
+
+    listener->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (event_loop_add(listener->loop, listener->fd, EPOLLIN | EPOLLET, on_listener_ready, listener) != 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static void *reactor_main(void *arg) {
+    struct listener *listener = arg;
+    event_loop_run(listener->loop);
+    return NULL;
+}
+
+/*
+ * A reactor accepts, parses and answers on one thread pinned to one CPU: no handoff to a pool,
+ * no cross-CPU wakeup, the connection's memory stays in that CPU's cache. The price is that a
+ * handler that waits (a client slow to take a large response, up to ADMIN_SEND_TIMEOUT_MS)
+ * holds up the other connections of its reactor, so reactors suit many small requests such as
+ * metrics scrapes.
+ */
+static int start_reactors(void) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    size_t stack_size = server_config.worker_stack_size; // Handlers run on reactors, as on workers
+    if (stack_size < (size_t)PTHREAD_STACK_MIN) stack_size = (size_t)PTHREAD_STACK_MIN;
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (size_t i = 0; i < listener_count; ++i) {
+        struct listener *listener = &listeners[i];
+        if (listener_start(listener, NULL) != 0) {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+
+        // Pinned from the start, the thread never runs anywhere else
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(listener->cpu, &cpu);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+
+        pthread_t tid;
+        int err = pthread_create(&tid, &attr, reactor_main, listener);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create for reactor %zu failed: %d\n", i, err);
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
     }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/*
+ * A shutdown closes the listeners, so new clients are refused right away and can go elsewhere.
+ * An upgrade keeps them open for the next process: connections arriving meanwhile wait in the
+ * accept queue, nobody is refused. In both cases the listeners stay registered, they are just
+ * not accepted from, which is all that can safely be changed from another thread than theirs.
+ */
+static void stop_accepting(int close_listeners) {
+    atomic_store_explicit(&accepting, 0, memory_order_relaxed);
+    if (!close_listeners) return;
+    for (size_t i = 0; i < listener_count; ++i) shutdown(listeners[i].fd, SHUT_RDWR);
+}
+
+static void resume_accepting(void) {
+    atomic_store_explicit(&accepting, 1, memory_order_relaxed);
+    // Edge-triggered: re-arming reports the connections that queued up meanwhile
+    for (size_t i = 0; i < listener_count; ++i) event_loop_rearm(listeners[i].loop, listeners[i].fd, EPOLLIN | EPOLLET);
+}
+
+static void listeners_handoff(void) {
+    char fds[MAX_REACTORS * 12];
+    size_t len = 0;
+    for (size_t i = 0; i < listener_count; ++i) {
+        if (upgrade_handoff_fd(listeners[i].fd) != 0) continue;
+        len += (size_t)snprintf(fds + len, sizeof(fds) - len, "%s%d", len ? "," : "", listeners[i].fd);
+    }
+    upgrade_handoff("listeners", "%d:%s", reactor_mode, fds);
+}
+
+static void set_drain_timer(int interval_ms) {
+    struct itimerspec due = { .it_interval = { 0, interval_ms * 1000000L }, .it_value = { 0, interval_ms * 1000000L } };
+    timerfd_settime(drain_timer_fd, 0, &due, NULL);
+}
+
+static void begin_drain(enum drain_goal goal) {
+    if (drain_goal == DRAIN_TO_EXIT || (drain_goal == DRAIN_TO_UPGRADE && goal == DRAIN_TO_UPGRADE)) {
+        if (goal == DRAIN_TO_EXIT) {
+            printf("Second shutdown signal, not waiting any longer\n");
+            drain_deadline_ms = 0;
+        }
+        return;
+    }
+    if (drain_goal == DRAIN_TO_UPGRADE) {
+        // A shutdown overrides the upgrade, within the same deadline
+        printf("Shutting down instead of upgrading\n");
+        drain_goal = goal;
+        stop_accepting(1);
+        return;
+    }
+
+    drain_goal = goal;
+    drain_started_ms = monotonic_ms();
+    drain_deadline_ms = drain_started_ms + (long long)server_config.drain_timeout_ms;
+    drain_jobs_killed = 0;
+    printf("%s, draining %zu connection%s\n", goal == DRAIN_TO_EXIT ? "Shutting down" : "Upgrading",
+           connections_open_count(), connections_open_count() == 1 ? "" : "s");
+
+    stop_accepting(goal == DRAIN_TO_EXIT);
+    connections_drain(1);
+    // The reactors close their idle connections at their next sweep, the main loop's are ours
+    if (!reactor_mode) connections_sweep_idle(listeners[0].loop, listeners[0].connections);
+    set_drain_timer(DRAIN_CHECK_INTERVAL_MS);
+}
+
+static void upgrade(void) {
+    services_handoff();
+    listeners_handoff();
+    upgrade_exec();
+
+    // Still here: nothing was handed over, the old binary goes on serving
+    drain_goal = DRAIN_NONE;
+    set_drain_timer(0);
+    connections_drain(0);
+    resume_accepting();
+}
+
+static void on_drain_check(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 || drain_goal == DRAIN_NONE) return;
+
+    size_t open = connections_open_count();
+    size_t jobs = jobs_busy();
+    long long now = monotonic_ms();
+    if ((open > 0 || jobs > 0) && now < drain_deadline_ms) return;
+
+    if (jobs > 0 && !drain_jobs_killed) {
+        // Their output is still sent to whoever follows it, for as long as the grace period lasts
+        fprintf(stderr, "Killing %zu job%s still running\n", jobs, jobs == 1 ? "" : "s");
+        jobs_kill_running();
+        drain_jobs_killed = 1;
+        drain_deadline_ms = now + JOB_KILL_GRACE_MS;
+        return;
+    }
+
+    int cut_off = open > 0 || jobs > 0;
+    if (cut_off) {
+        fprintf(stderr, "Drain deadline passed, cutting off %zu connection%s and %zu job%s\n",
+                open, open == 1 ? "" : "s", jobs, jobs == 1 ? "" : "s");
+    } else {
+        printf("Drained in %lld ms\n", now - drain_started_ms);
+    }
+
+    if (drain_goal == DRAIN_TO_UPGRADE) {
+        upgrade();
+        return;
+    }
+    stop_services();
+    printf("Shut down\n");
+
+    /*
+     * Workers and reactors cut off by the deadline are still inside handlers and TLS calls. exit()
+     * would run the atexit handlers and library destructors (OpenSSL's cleanup among them) under
+     * their feet, so only stdio is flushed and the process ends right away.
+     */
+    if (cut_off) {
+        fflush(stdout);
+        fflush(stderr);
+        _exit(0);
+    }
+    exit(0);
+}
+
+static void on_signal(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    int sig;
+    while ((sig = read_signal(fd)) != 0) {
+        if (sig == SIGUSR2) begin_drain(DRAIN_TO_UPGRADE);
+        else begin_drain(DRAIN_TO_EXIT);
+    }
+}
+
+// Shutdown and upgrade run on the loop that supervises the services, the main thread's
+static int watch_signals(struct event_loop *loop, int signal_fd) {
+    drain_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (drain_timer_fd < 0 || event_loop_add(loop, drain_timer_fd, EPOLLIN, on_drain_check, NULL) != 0 ||
+        event_loop_add(loop, signal_fd, EPOLLIN, on_signal, NULL) != 0) {
+        perror("Failed to watch for signals");
+        return -1;
+    }
+    return 0;
+}
+
+int accept_clients(int server_fd, int signal_fd) {
+    if (reactor_mode) {
+        if (start_reactors() != 0) {
+            fprintf(stderr, "Failed to start the reactors\n");
+            return -1;
+        }
+
+        // The main thread keeps the services' exits and restart timers, and the signals
+        struct event_loop *loop = event_loop_create();
+        if (!loop || supervise_services(loop) != 0 || watch_signals(loop, signal_fd) != 0) {
+            fprintf(stderr, "Failed to set up the supervising event loop\n");
+            return -1;
+        }
+        event_loop_run(loop);
+        return 0; // Not reached, event_loop_run() never returns
+    }
+
+    struct thread_pool *request_pool = thread_pool_create("requests", server_config.worker_threads,
+                                                          server_config.work_queue_capacity,
+                                                          server_config.worker_stack_size);
+    if (!request_pool) {
+        fprintf(stderr, "Failed to start the request worker pool\n");
+        return -1;
+    }
+
+    struct listener *listener = &listeners[0];
+    listener->fd = server_fd;
+
+    // The services' exits and restart timers are events of this loop too, as are the signals
+    if (listener_start(listener, request_pool) != 0 || supervise_services(listener->loop) != 0 ||
+        watch_signals(listener->loop, signal_fd) != 0) {
+        fprintf(stderr, "Failed to set up the event loop\n");
+        return -1;
+    }
+
+    event_loop_run(listener->loop);
+    return 0; // Not reached
 }
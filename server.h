@@ -4,17 +4,33 @@
 #include <sys/socket.h> // For socket-related types like int and struct sockaddr_in
 #include <netinet/in.h> // For internet addresses (htons, INADDR_ANY)
 
-// Function to start the server and return its file descriptor.
+// Function to start the server and return its file descriptor. With
+// ADMIN_REACTORS (or ADMIN_REACTOR_CPUS) it binds one SO_REUSEPORT socket per
+// reactor to the port and returns the first. After an upgrade it takes over
+// the listening sockets of the previous process instead.
 // int port: The port number on which the server should listen.
 // Returns: The file descriptor of the listening server socket on success,
-//          or an error code (though the current implementation uses perror and returns the fd)
-//          Consider returning -1 on error for better error handling in the caller.
+//          or -1 if a socket could not be opened, bound or listened on.
 int start_server(int port);
 
-// Function to continuously accept incoming client connections.
-// int server_fd: The file descriptor of the listening server socket.
-// This function enters an infinite loop, accepting connections and
-// spawning threads for each client.
-void accept_clients(int server_fd);
+// Function to run the server's epoll event loop.
+// int server_fd: The file descriptor of the non-blocking listening socket.
+// int signal_fd: The signalfd from open_signal_fd(). On SIGINT or SIGTERM
+//                the listeners are closed, requests in flight get up to
+//                ADMIN_DRAIN_TIMEOUT_MS to finish, then the services are
+//                stopped and the process exits. On SIGUSR2 the listeners
+//                stay open and, once drained the same way, the server execs
+//                its binary again, handing over the listeners and the
+//                running services, see upgrade.h.
+// The loop owns the listening socket and every client socket. Connections are
+// accepted in edge-triggered batches and a client is only handed to the
+// request worker pool once its socket is readable. Connections are kept
+// alive between requests and closed by the loop once idle for too long. When the pool's queue is
+// full the client gets a 503 instead, as does a client accepted while ADMIN_MAX_CONNECTIONS are
+// open; one over its rate limit gets a 429, see admission.h. In reactor mode every listening
+// socket gets its own loop thread, pinned to its CPU, which serves its connections itself; the
+// calling thread only supervises the services.
+// Returns: -1 if the loop could not be set up, it never returns otherwise.
+int accept_clients(int server_fd, int signal_fd);
 
 #endif // SERVER_H
\ No newline at end of file
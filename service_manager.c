@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // For pipe2()
+#include "service_manager.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -6,10 +8,29 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <time.h>
+#include <linux/sched.h> // For struct clone_args and CLONE_PIDFD
+#include <sys/pidfd.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#include "config.h"
+#include "cpus.h"
+#include "event_loop.h"
+#include "log_capture.h"
+#include "response.h"
+#include "upgrade.h"
+
+#define SNAPSHOT_BUFFERS 3
+
+// Names end up in JSON and metric labels unescaped
+static const char NAME_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-";
 
-pid_t monitored_service_pid = -1;
 time_t server_start_time = 0;
 
 /*
@@ -45,24 +66,149 @@ filesystem, FIFOs can be used for communication between unrelated processes.
  */
 
 
-int start_monitored_service(const char *service_path, char *const service_argv[]) {
+/*
+ * One supervised service. Everything but the snapshots is only touched on the event loop thread
+ * (and on the main thread before the loop runs), so none of it needs a lock.
+ */
+struct service {
+    char name[SERVICE_NAME_MAX];
+    char **argv;                // argv[0] is the program
+    pid_t pid;                  // 0 while not running
+    int pidfd;                  // -1 while not running
+    int timer_fd;               // Fires when the backoff delay is over
+    unsigned int failures;      // Exits in a row that came too soon, drives the backoff
+    struct timespec started;    // Monotonic
+    struct timespec exited;     // Monotonic
+    struct service_status status;
+};
+
+static struct service services[SERVICE_MAX_COUNT];
+static size_t service_count = 0;
+static struct event_loop *supervisor_loop = NULL;
+
+/*
+ * The service's stdout and stderr are pipes read by the log capture. There is one pair for all
+ * services and all of their restarts, so the capture never has to follow new descriptors. We keep
+ * the write ends open (close-on-exec, so no service inherits them by accident), and each service
+ * gets them as its fds 1 and 2. Lines of different services can only interleave if a single
+ * write is larger than PIPE_BUF.
+ */
+static int output_fds[2] = { -1, -1 };
+static int capture_fds[2] = { -1, -1 }; // Their read ends, owned by the log capture but handed over on upgrade
+
+/*
+ * The published state is read by request handlers and the metrics sampler without a lock. The
+ * loop thread never changes a published snapshot: it fills a buffer nobody reads and swaps the
+ * pointer, like RCU. Readers announce themselves in `readers` and re-check the pointer, the same
+ * way scrapers do with the metrics snapshot, so a buffer is only refilled once nobody holds it.
+ */
+static struct service_snapshot *snapshots[SNAPSHOT_BUFFERS];
+static _Atomic(struct service_snapshot *) published = NULL;
+
+static void close_pipe(int fds[2]) {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static double seconds_between(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) + (double)(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void publish_status(void) {
+    struct service_snapshot *current = atomic_load(&published);
+    struct service_snapshot *next = NULL;
+
+    // Readers only copy a few hundred bytes, a free buffer turns up right away
+    while (!next) {
+        for (int i = 0; i < SNAPSHOT_BUFFERS && !next; ++i) {
+            if (snapshots[i] != current && atomic_load(&snapshots[i]->readers) == 0) next = snapshots[i];
+        }
+        if (!next) sched_yield();
+    }
+
+    next->count = service_count;
+    for (size_t i = 0; i < service_count; ++i) next->services[i] = services[i].status;
+    atomic_store(&published, next);
+}
+
+struct service_snapshot *services_acquire(void) {
+    struct service_snapshot *snapshot;
+    while (1) {
+        snapshot = atomic_load(&published);
+        atomic_fetch_add(&snapshot->readers, 1);
+        if (atomic_load(&published) == snapshot) return snapshot;
+        atomic_fetch_sub(&snapshot->readers, 1);
+    }
+}
+
+void services_release(struct service_snapshot *snapshot) {
+    atomic_fetch_sub(&snapshot->readers, 1);
+}
+
+/*
+ * clone3() with CLONE_PIDFD hands us a pidfd for the child atomically with creating it, so there is
+ * no window in which the PID could be reused before we hold on to the process. Like fork(), it
+ * copies the calling process; the child only sets up its descriptors and execs. Where clone3 is
+ * not available (or filtered by a seccomp profile) we fall back to fork() and pidfd_open(), which
+ * is just as safe because only we can reap the child.
+ */
+static pid_t spawn_process(int *pidfd) {
+    struct clone_args args = {
+        .flags = CLONE_PIDFD,
+        .pidfd = (uint64_t)(uintptr_t)pidfd,
+        .exit_signal = SIGCHLD,
+    };
+    pid_t pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (pid >= 0 || (errno != ENOSYS && errno != EPERM)) return pid;
+
+    pid = fork();
+    if (pid > 0) {
+        *pidfd = pidfd_open(pid, 0);
+        if (*pidfd < 0) {
+            perror("pidfd_open failed");
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return -1;
+        }
+    }
+    return pid;
+}
+
+static int spawn_service(struct service *service) {
+    /*
+      FD_CLOEXEC (File Descriptor Close-on-Exec) flag is specifically and solely designed to control
+      whether a file descriptor is closed when one of the exec family of functions
+      (like execve, execvp, execl, etc.) is successfully called.
+
+      The pipe is created with it set, so if execvp succeeds the pipe is closed automatically and the
+      parent's read() sees EOF. Setting it only in the child would be too late: job workers start
+      processes concurrently, and one of those could inherit the write end in between, keeping the
+      parent's read() blocked for as long as that process lives.
+    */
     int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe failed");
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe2 failed");
         return -1;
     }
 
-    pid_t pid = fork();
+    int pidfd = -1;
+    pid_t pid = spawn_process(&pidfd);
     if (pid < 0) {
-        perror("fork failed");
-        close(pipefd[0]);
-        close(pipefd[1]);
+        perror("clone3 failed");
+        close_pipe(pipefd);
         return -1;
     }
     else if (pid == 0) {
         // Child process
         close(pipefd[0]); // Close read end, child writes errors if exec fails
 
+        // dup2() clears close-on-exec on the copies, so the service keeps them
+        if (dup2(output_fds[0], STDOUT_FILENO) == -1 || dup2(output_fds[1], STDERR_FILENO) == -1) {
+            int err = errno;
+            write(pipefd[1], &err, sizeof(err));
+            _exit(EXIT_FAILURE);
+        }
+
         /*
          Why did we close pipefd[0]?
 
@@ -80,19 +226,6 @@ int start_monitored_service(const char *service_path, char *const service_argv[]
         preventing EOF from being signaled).
          */
 
-        /*
-          FD_CLOEXEC (File Descriptor Close-on-Exec) flag is specifically and solely designed to control
-          whether a file descriptor is closed when one of the exec family of functions
-          (like execve, execvp, execl, etc.) is successfully called.
-
-          Set FD_CLOEXEC so that if execvp succeeds, pipe is closed automatically
-        */
-        if (fcntl(pipefd[1], F_SETFD, FD_CLOEXEC) == -1) {   //Cloexec is important, otherwise the parent may block!!
-            perror("fcntl FD_CLOEXEC failed");
-            // Not fatal, continue anyway, although parent may block!!!!!!!!
-        }
-
-
         /*
         prctl provides a mechanism for a process to control its own behavior or the behavior of its children
         in ways that are not covered by other system calls. It takes a command and typically one or more arguments.
@@ -100,10 +233,21 @@ int start_monitored_service(const char *service_path, char *const service_argv[]
         PR_SET_PDEATHSIG - This command registers a signal (arg2) that the calling process will receive
         if its parent process terminates. In this part of the code, we are in the CHILD process.
         This termination can be due to exiting normally, being killed, or crashing.
+
+        Strictly, the "parent" is the thread that created the child. Services are only started
+        from the main thread, which runs the event loop and lives as long as the server, through
+        upgrades too: it is the thread that execs the new binary, see upgrade_exec().
          */
 
         prctl(PR_SET_PDEATHSIG, SIGTERM);
-        execvp(service_path, service_argv);
+
+        // The server runs with SIGPIPE blocked, see block_sigpipe(); the service gets the default
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+        // Nor does the service share the admin server's CPU restriction, it owns the reserved CPUs
+        cpus_restore_for_child();
+        execvp(service->argv[0], service->argv);
 
         // If execvp returns, it failed: write errno to pipe
         int err = errno;
@@ -115,38 +259,441 @@ int start_monitored_service(const char *service_path, char *const service_argv[]
         close(pipefd[1]);
         _exit(EXIT_FAILURE); // Use _exit to avoid flushing stdio buffers twice
     }
-    else {
-        // Parent process
-        close(pipefd[1]); // Close write end, parent reads error status
 
-        /*
-        If pipes are synchronous by default, why doesn't this block indefinitely if child process
-        launches successfully?
+    // Parent process
+    close(pipefd[1]); // Close write end, parent reads error status
 
-        The answer is that read won't block if all the writes are blocked (and read is empty).
-        If the child process launches, it will close it's write pipe with CLOEXEC
-         */
+    /*
+    If pipes are synchronous by default, why doesn't this block indefinitely if child process
+    launches successfully?
 
-        int exec_error = 0;
-        ssize_t n = read(pipefd[0], &exec_error, sizeof(exec_error));
-        close(pipefd[0]);
+    The answer is that read won't block if all the writes are blocked (and read is empty).
+    If the child process launches, it will close it's write pipe with CLOEXEC
+     */
 
-        if (n == 0) {
-            // Pipe closed with no data: exec succeeded, child replaced by service
-            monitored_service_pid = pid;
-            printf("Started monitored service with PID %d\n", (int)pid);
-            return 0;
-        }
-        else if (n == sizeof(exec_error)) {
+    int exec_error = 0;
+    ssize_t n = read(pipefd[0], &exec_error, sizeof(exec_error));
+    close(pipefd[0]);
+
+    if (n != 0) {
+        if (n == sizeof(exec_error)) {
             // Exec failed, child wrote errno before exiting
-            fprintf(stderr, "execvp failed with errno %d (%s)\n", exec_error, strerror(exec_error));
-            waitpid(pid, NULL, 0); // Reap child to avoid zombie
+            fprintf(stderr, "Service %s: execvp failed with errno %d (%s)\n",
+                    service->name, exec_error, strerror(exec_error));
+        } else {
+            fprintf(stderr, "Service %s: unexpected read from pipe: %zd bytes\n", service->name, n);
+        }
+        siginfo_t info;
+        waitid(P_PIDFD, (id_t)pidfd, &info, WEXITED); // Reap child to avoid zombie
+        close(pidfd);
+        return -1;
+    }
+
+    // Pipe closed with no data: exec succeeded, child replaced by service
+    service->pid = pid;
+    service->pidfd = pidfd;
+    clock_gettime(CLOCK_MONOTONIC, &service->started);
+    service->status.state = SERVICE_RUNNING;
+    service->status.pid = pid;
+    service->status.started_at = time(NULL);
+    printf("Started service %s with PID %d\n", service->name, (int)pid);
+    return 0;
+}
+
+static void on_service_exit(struct event_loop *loop, int fd, uint32_t events, void *arg);
+
+// Registers a freshly started service's pidfd, so the loop hears about its exit
+static void watch_service(struct service *service) {
+    if (event_loop_add(supervisor_loop, service->pidfd, EPOLLIN, on_service_exit, service) != 0) {
+        perror("Failed to watch a service");
+    }
+}
+
+static void schedule_restart(struct service *service) {
+    // A run that lasted longer than the longest delay counts as healthy, the backoff starts over
+    double ran = seconds_between(&service->started, &service->exited);
+    if (ran * 1000 >= (double)server_config.restart_backoff_max_ms) service->failures = 0;
+
+    size_t delay_ms = server_config.restart_backoff_ms;
+    for (unsigned int i = 0; i < service->failures && delay_ms < server_config.restart_backoff_max_ms; ++i) {
+        delay_ms *= 2;
+    }
+    if (delay_ms > server_config.restart_backoff_max_ms) delay_ms = server_config.restart_backoff_max_ms;
+    service->failures++;
+
+    struct itimerspec due = { .it_value = { (time_t)(delay_ms / 1000), (long)(delay_ms % 1000) * 1000000L } };
+    if (timerfd_settime(service->timer_fd, 0, &due, NULL) != 0) perror("timerfd_settime");
+    printf("Restarting service %s in %zu ms\n", service->name, delay_ms);
+}
+
+static void on_service_exit(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct service *service = arg;
+
+    siginfo_t info = { 0 };
+    if (waitid(P_PIDFD, (id_t)fd, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0) return; // Still running
+
+    clock_gettime(CLOCK_MONOTONIC, &service->exited);
+    close(fd); // Also removes it from the loop
+    service->pidfd = -1;
+    service->pid = 0;
+
+    service->status.state = SERVICE_RESTARTING;
+    service->status.pid = 0;
+    service->status.last_exit_code = info.si_code == CLD_EXITED ? info.si_status : -1;
+    service->status.last_exit_signal = info.si_code == CLD_EXITED ? 0 : info.si_status;
+    if (info.si_code == CLD_EXITED) {
+        fprintf(stderr, "Service %s (PID %d) exited with code %d\n", service->name, (int)info.si_pid, info.si_status);
+    } else {
+        fprintf(stderr, "Service %s (PID %d) was killed by signal %d\n", service->name, (int)info.si_pid, info.si_status);
+    }
+
+    schedule_restart(service);
+    publish_status();
+}
+
+static void on_restart_due(struct event_loop *loop, int fd, uint32_t events, void *arg) {
+    struct service *service = arg;
+
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) return; // Not due yet
+
+    if (spawn_service(service) != 0) {
+        // Failing to start counts like an immediate exit
+        service->started = service->exited;
+        schedule_restart(service);
+        return;
+    }
+    watch_service(service);
+
+    double latency = seconds_between(&service->exited, &service->started);
+    service->status.restarts++;
+    service->status.last_restart_latency = latency;
+    service->status.restart_latency_sum += latency;
+    publish_status();
+}
+
+/*
+ * Sends SIGTERM to the processes, waits up to ADMIN_SERVICE_STOP_TIMEOUT_MS for all of them to
+ * exit, then SIGKILLs the rest. Every one of them is reaped and its pidfd closed. Runs on the
+ * main thread, the loop is not running restarts meanwhile.
+ */
+static void stop_processes(const int *pidfds, size_t count) {
+    struct pollfd fds[SERVICE_MAX_COUNT];
+    size_t running = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pidfd_send_signal(pidfds[i], SIGTERM, NULL, 0);
+        fds[running++] = (struct pollfd){ .fd = pidfds[i], .events = POLLIN };
+    }
+
+    long long deadline = monotonic_ms() + (long long)server_config.service_stop_timeout_ms;
+    while (running > 0) {
+        long long left = deadline - monotonic_ms();
+        if (left <= 0) break;
+        if (poll(fds, running, (int)left) < 0 && errno != EINTR) break;
+
+        for (size_t i = running; i-- > 0;) {
+            siginfo_t info = { 0 };
+            if (waitid(P_PIDFD, (id_t)fds[i].fd, &info, WEXITED | WNOHANG) == 0 && info.si_pid == 0) continue;
+            close(fds[i].fd);
+            fds[i] = fds[--running];
+        }
+    }
+
+    for (size_t i = 0; i < running; ++i) {
+        pidfd_send_signal(fds[i].fd, SIGKILL, NULL, 0);
+        siginfo_t info;
+        waitid(P_PIDFD, (id_t)fds[i].fd, &info, WEXITED);
+        close(fds[i].fd);
+    }
+}
+
+void stop_services(void) {
+    int pidfds[SERVICE_MAX_COUNT];
+    size_t count = 0;
+    for (size_t i = 0; i < service_count; ++i) {
+        if (services[i].pidfd < 0) continue;
+        printf("Stopping service %s (PID %d)\n", services[i].name, (int)services[i].pid);
+        pidfds[count++] = services[i].pidfd;
+        services[i].pidfd = -1;
+    }
+    stop_processes(pidfds, count);
+}
+
+#define SERVICE_KEY_MAX (SERVICE_NAME_MAX + 8)
+
+// The key a service is handed over under, "service.<name>"
+static void service_key(char key[SERVICE_KEY_MAX], const struct service *service) {
+    snprintf(key, SERVICE_KEY_MAX, "service.%.*s", SERVICE_NAME_MAX - 1, service->name);
+}
+
+void services_handoff(void) {
+    upgrade_handoff("started", "%lld", (long long)server_start_time);
+
+    for (int i = 0; i < 2; ++i) {
+        if (upgrade_handoff_fd(output_fds[i]) != 0 || upgrade_handoff_fd(capture_fds[i]) != 0) return;
+    }
+    upgrade_handoff("service_output", "%d,%d,%d,%d", output_fds[0], output_fds[1], capture_fds[0], capture_fds[1]);
+
+    for (size_t i = 0; i < service_count; ++i) {
+        struct service *service = &services[i];
+        // One that waits for its restart is started right away by the next process
+        if (service->pidfd >= 0 && upgrade_handoff_fd(service->pidfd) != 0) continue;
+        const struct service_status *s = &service->status;
+        long long started_ms = (long long)service->started.tv_sec * 1000 + service->started.tv_nsec / 1000000;
+        char key[SERVICE_KEY_MAX];
+        service_key(key, service);
+        upgrade_handoff(key, "%d,%d,%lld,%lld,%llu,%u,%d,%d,%.6f,%.6f", (int)service->pid, service->pidfd,
+                        (long long)s->started_at, started_ms, s->restarts, service->failures,
+                        s->last_exit_code, s->last_exit_signal, s->last_restart_latency, s->restart_latency_sum);
+    }
+}
+
+// Takes over the output pipes of the previous process, so the services it leaves running keep writing into them
+static int adopt_output_pipes(int out_pipe[2], int err_pipe[2]) {
+    const char *value = upgrade_state("service_output");
+    long long fds[4];
+    if (!value || sscanf(value, "%lld,%lld,%lld,%lld", &fds[0], &fds[1], &fds[2], &fds[3]) != 4) return -1;
+
+    out_pipe[1] = upgrade_adopt_fd(fds[0]);
+    err_pipe[1] = upgrade_adopt_fd(fds[1]);
+    out_pipe[0] = upgrade_adopt_fd(fds[2]);
+    err_pipe[0] = upgrade_adopt_fd(fds[3]);
+    return out_pipe[0] >= 0 && out_pipe[1] >= 0 && err_pipe[0] >= 0 && err_pipe[1] >= 0 ? 0 : -1;
+}
+
+/*
+ * Takes over a service the previous process left running. Its status carries over, restart
+ * counts and latencies included, so an upgrade doesn't show in /services or the metrics.
+ * Returns: 1 if it was adopted, 0 if it has to be started.
+ */
+static int adopt_service(struct service *service) {
+    char key[SERVICE_KEY_MAX];
+    service_key(key, service);
+    const char *value = upgrade_state(key);
+    if (!value) return 0;
+
+    int pid;
+    long long pidfd, started_at, started_ms;
+    struct service_status *s = &service->status;
+    if (sscanf(value, "%d,%lld,%lld,%lld,%llu,%u,%d,%d,%lf,%lf", &pid, &pidfd, &started_at, &started_ms,
+               &s->restarts, &service->failures, &s->last_exit_code, &s->last_exit_signal,
+               &s->last_restart_latency, &s->restart_latency_sum) != 10) {
+        return 0;
+    }
+    if (pid <= 0 || (service->pidfd = upgrade_adopt_fd(pidfd)) < 0) return 0;
+
+    service->pid = pid;
+    service->started = (struct timespec){ .tv_sec = (time_t)(started_ms / 1000),
+                                          .tv_nsec = (long)(started_ms % 1000) * 1000000L };
+    s->state = SERVICE_RUNNING;
+    s->pid = pid;
+    s->started_at = (time_t)started_at;
+    printf("Took over service %s with PID %d\n", service->name, pid);
+    return 1;
+}
+
+// Stops what the previous process supervised but is no longer configured
+static void stop_unknown_services(void) {
+    int pidfds[SERVICE_MAX_COUNT];
+    size_t count = 0;
+    size_t cursor = 0;
+    const char *key, *value;
+    while ((key = upgrade_state_next("service.", &cursor, &value)) && count < SERVICE_MAX_COUNT) {
+        const char *name = key + strlen("service.");
+        int known = 0;
+        for (size_t i = 0; i < service_count && !known; ++i) known = strcmp(services[i].name, name) == 0;
+
+        int pid;
+        long long pidfd;
+        if (known || sscanf(value, "%d,%lld", &pid, &pidfd) != 2 || pid <= 0) continue;
+        int fd = upgrade_adopt_fd(pidfd);
+        if (fd < 0) continue;
+        printf("Stopping service %s (PID %d), it is no longer configured\n", name, pid);
+        pidfds[count++] = fd;
+    }
+    stop_processes(pidfds, count);
+}
+
+static int valid_service_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 0 && len < SERVICE_NAME_MAX && strspn(name, NAME_CHARS) == len;
+}
+
+static int add_service(const char *name, char **argv) {
+    if (service_count == SERVICE_MAX_COUNT) {
+        fprintf(stderr, "At most %d services can be supervised\n", SERVICE_MAX_COUNT);
+        return -1;
+    }
+    if (!valid_service_name(name)) {
+        fprintf(stderr, "Invalid service name '%s', use letters, digits, '_', '.' and '-'\n", name);
+        return -1;
+    }
+    for (size_t i = 0; i < service_count; ++i) {
+        if (strcmp(services[i].name, name) == 0) {
+            fprintf(stderr, "Duplicate service name '%s'\n", name);
             return -1;
         }
-        else {
-            fprintf(stderr, "Unexpected read from pipe: %zd bytes\n", n);
-            waitpid(pid, NULL, 0);
+    }
+
+    struct service *service = &services[service_count++];
+    snprintf(service->name, sizeof(service->name), "%s", name);
+    service->argv = argv;
+    service->pidfd = -1;
+    service->timer_fd = -1;
+    memcpy(service->status.name, service->name, sizeof(service->name));
+    service->status.last_exit_code = -1;
+    return 0;
+}
+
+// Reads ADMIN_SERVICES_FILE: "<name> <program> [args...]" per line, '#' starts a comment line
+static int load_services_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &line_capacity, file) >= 0) {
+        line_number++;
+        char *save = NULL;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        if (!name || name[0] == '#') continue;
+
+        // Kept for the lifetime of the server, restarts exec them again
+        char **argv = NULL;
+        size_t argc = 0;
+        for (char *word = strtok_r(NULL, " \t\r\n", &save); ; word = strtok_r(NULL, " \t\r\n", &save)) {
+            char **grown = realloc(argv, (argc + 1) * sizeof(*argv));
+            if (!grown || (word && !(word = strdup(word)))) {
+                fprintf(stderr, "Out of memory reading %s\n", path);
+                result = -1;
+                break;
+            }
+            argv = grown;
+            argv[argc++] = word;
+            if (!word) break;
+        }
+        if (result != 0) break;
+
+        if (argc < 2) {
+            fprintf(stderr, "%s:%d: expected \"<name> <program> [args...]\"\n", path, line_number);
+            result = -1;
+        } else {
+            result = add_service(name, argv);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return result;
+}
+
+int start_services(const char *service_path, char *const service_argv[]) {
+    // The command line service is named after its program
+    const char *slash = strrchr(service_path, '/');
+    char name[SERVICE_NAME_MAX];
+    snprintf(name, sizeof(name), "%s", slash ? slash + 1 : service_path);
+    for (char *c = name; *c; ++c) {
+        if (!strchr(NAME_CHARS, *c)) *c = '_';
+    }
+    if (add_service(name, (char **)service_argv) != 0) return -1;
+    if (server_config.services_file && load_services_file(server_config.services_file) != 0) return -1;
+
+    for (int i = 0; i < SNAPSHOT_BUFFERS; ++i) {
+        snapshots[i] = calloc(1, sizeof(struct service_snapshot) + service_count * sizeof(struct service_status));
+        if (!snapshots[i]) return -1;
+        atomic_init(&snapshots[i]->readers, 0);
+    }
+
+    if (upgrade_resumed()) {
+        const char *started = upgrade_state("started");
+        if (started) server_start_time = (time_t)strtoll(started, NULL, 10);
+        stop_unknown_services();
+    }
+
+    int out_pipe[2], err_pipe[2];
+    if (!upgrade_resumed() || adopt_output_pipes(out_pipe, err_pipe) != 0) {
+        if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            return -1;
+        }
+        if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            close_pipe(out_pipe);
             return -1;
         }
     }
-}
\ No newline at end of file
+    output_fds[0] = out_pipe[1];
+    output_fds[1] = err_pipe[1];
+    capture_fds[0] = out_pipe[0];
+    capture_fds[1] = err_pipe[0];
+
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(err_pipe[0], F_SETFL, O_NONBLOCK);
+    if (start_log_capture(out_pipe[0], err_pipe[0]) != 0) {
+        // Nobody reads the pipes: the services block once they filled them
+        fprintf(stderr, "Failed to capture the services' output\n");
+    }
+
+    for (size_t i = 0; i < service_count; ++i) {
+        services[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (services[i].timer_fd < 0) {
+            perror("timerfd_create");
+            return -1;
+        }
+        if (adopt_service(&services[i])) continue;
+        if (spawn_service(&services[i]) != 0) return -1;
+    }
+
+    publish_status();
+    return 0;
+}
+
+int supervise_services(struct event_loop *loop) {
+    supervisor_loop = loop;
+    for (size_t i = 0; i < service_count; ++i) {
+        // A service that died before this point is reported right away: its pidfd is readable
+        if (event_loop_add(loop, services[i].pidfd, EPOLLIN, on_service_exit, &services[i]) != 0 ||
+            event_loop_add(loop, services[i].timer_fd, EPOLLIN, on_restart_due, &services[i]) != 0) {
+            perror("Failed to watch the services");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void handle_services(int client_fd) {
+    struct service_snapshot *snapshot = services_acquire();
+    size_t count = snapshot->count;
+    struct service_status status[SERVICE_MAX_COUNT];
+    memcpy(status, snapshot->services, count * sizeof(*status));
+    services_release(snapshot);
+
+    // Names are restricted to characters that need no escaping, every field has a bounded width
+    size_t capacity = 32 + count * 320;
+    char *body = malloc(capacity);
+    if (!body) {
+        send_500(client_fd);
+        return;
+    }
+
+    time_t now = time(NULL);
+    size_t len = (size_t)snprintf(body, capacity, "{\"services\":[");
+    for (size_t i = 0; i < count; ++i) {
+        const struct service_status *s = &status[i];
+        len += (size_t)snprintf(body + len, capacity - len,
+            "%s{\"name\":\"%s\",\"state\":\"%s\",\"pid\":%d,\"uptime_seconds\":%lld,\"restarts\":%llu,"
+            "\"last_exit_code\":%d,\"last_exit_signal\":%d,\"last_restart_latency_seconds\":%.6f}",
+            i ? "," : "", s->name, s->state == SERVICE_RUNNING ? "running" : "restarting", (int)s->pid,
+            s->state == SERVICE_RUNNING ? (long long)(now - s->started_at) : 0LL, s->restarts,
+            s->last_exit_code, s->last_exit_signal, s->last_restart_latency);
+    }
+    len += (size_t)snprintf(body + len, capacity - len, "]}");
+
+    send_response(client_fd, "200 OK", "application/json", body, len);
+    free(body);
+}
@@ -1,20 +1,94 @@
 #ifndef SERVICE_MONITOR_H
 #define SERVICE_MONITOR_H
 
+#include <stdatomic.h>
+#include <stddef.h>    // For size_t
 #include <sys/types.h> // For pid_t
+#include <time.h>
+
+#define SERVICE_NAME_MAX 32
+#define SERVICE_MAX_COUNT 64
+
+struct event_loop;
 
-extern pid_t monitored_service_pid;
 extern time_t server_start_time;
 
-// Function to start a new service as a child process and monitor its execution.
-// It uses a pipe to check if the execvp call in the child process was successful.
+enum service_state {
+    SERVICE_RUNNING,
+    SERVICE_RESTARTING, // Exited, waiting for its backoff delay to pass
+};
+
+struct service_status {
+    char name[SERVICE_NAME_MAX];
+    enum service_state state;
+    pid_t pid;                     // 0 while not running
+    time_t started_at;             // Wall clock time of the last (re)start
+    unsigned long long restarts;
+    int last_exit_code;            // -1 if it never exited or was killed
+    int last_exit_signal;          // 0 unless it was killed by a signal
+    double last_restart_latency;   // Seconds from the last exit to running again, backoff included
+    double restart_latency_sum;    // Seconds, over all restarts
+};
+
+// The state of all supervised services at one point in time. Never changed
+// while published, see services_acquire().
+struct service_snapshot {
+    atomic_int readers;
+    size_t count;
+    struct service_status services[];
+};
+
+// Function to start the supervised services as child processes. The first is
+// the one from the command line, further ones are listed in
+// ADMIN_SERVICES_FILE, one per line: "<name> <program> [args...]".
+// It uses a pipe to check if the exec in each child process was successful.
+// The stdout and stderr of all services are captured for /logs/tail.
 //
-// const char *service_path: The path to the executable of the service.
-// char *const service_argv[]: An array of string arguments for the service,
+// const char *service_path: The path to the executable of the first service.
+// char *const service_argv[]: An array of string arguments for that service,
 //                             with the last element being NULL.
 //
-// Returns: 0 on successful start of the service.
-//          -1 if fork, pipe, or execvp failed.
-int start_monitored_service(const char *service_path, char *const service_argv[]);
+// After an upgrade, services the previous process left running are taken
+// over, see services_handoff().
+//
+// Returns: 0 once every service runs.
+//          -1 if the services file is invalid, or a service failed to start.
+int start_services(const char *service_path, char *const service_argv[]);
+
+// Function to watch the services from the event loop. The loop learns about
+// an exit through the service's pidfd as soon as it happens, and restarts
+// the service after an exponential backoff: ADMIN_RESTART_BACKOFF_MS,
+// doubled for every exit in a row that came sooner than
+// ADMIN_RESTART_BACKOFF_MAX_MS after the start, up to that maximum.
+// Must be called on the loop thread (or before event_loop_run()).
+//
+// Returns: 0 on success, -1 if a descriptor could not be registered.
+int supervise_services(struct event_loop *loop);
+
+// Function to stop the services on shutdown: each gets SIGTERM, and SIGKILL
+// if it is still running after ADMIN_SERVICE_STOP_TIMEOUT_MS. Returns once
+// all of them are reaped. Must be called on the loop thread, which restarts
+// nothing meanwhile.
+void stop_services(void);
+
+// Function to hand the running services over to the next process of an
+// upgrade: their pids and pidfds, status and the output pipes, see
+// upgrade_handoff(). start_services() in the next process takes them over
+// instead of starting them, and stops those it no longer supervises.
+// Must be called on the loop thread.
+void services_handoff(void);
+
+// Function to get the latest state of the services without taking a lock.
+// The snapshot stays valid and unchanged until services_release().
+// Returns: The snapshot, never NULL once start_services() succeeded.
+struct service_snapshot *services_acquire(void);
+
+// Function to hand back a snapshot from services_acquire(). Hold it only
+// for as long as it takes to copy out what is needed.
+void services_release(struct service_snapshot *snapshot);
+
+// Function to answer GET /services with the state of every supervised
+// service as JSON.
+void handle_services(int client_fd);
 
-#endif // SERVICE_MONITOR_H
\ No newline at end of file
+#endif // SERVICE_MONITOR_H
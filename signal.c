@@ -1,17 +1,50 @@
 #include "signal.h"
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
-#include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
 
-static void handle_signal(int sig) {
-    printf("\nReceived signal %d, shutting down...\n", sig);
-    exit(0);
+/*
+ * Shutdown and upgrade signals are never delivered to a handler: they stay blocked in every
+ * thread and are read from a signalfd by the main event loop, which can then stop accepting,
+ * wait for requests in flight and stop the services, none of which is allowed in a handler.
+ * A signal arriving while the descriptor isn't open yet, or during an upgrade's exec() (the
+ * mask is inherited by the new image), stays pending until it is read.
+ */
+int open_signal_fd(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) perror("signalfd");
+    return fd;
+}
+
+int read_signal(int signal_fd) {
+    struct signalfd_siginfo info;
+    while (1) {
+        ssize_t n = read(signal_fd, &info, sizeof(info));
+        if (n == (ssize_t)sizeof(info)) return (int)info.ssi_signo;
+        if (n < 0 && errno == EINTR) continue;
+        return 0;
+    }
 }
 
-void install_signal_handlers() {
-    struct sigaction sa = {
-        .sa_handler = handle_signal
-    };
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+/*
+ * Our own socket writes pass MSG_NOSIGNAL, but OpenSSL writes TLS records with write(), which
+ * has no such flag. Blocked rather than ignored: an ignored signal stays ignored across exec and
+ * would change how the services and jobs we start behave, a blocked one is simply unblocked by
+ * them before exec.
+ */
+void block_sigpipe(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 }
@@ -1,13 +1,22 @@
 #ifndef SIGNAL_H
 #define SIGNAL_H
 
-// No specific includes are strictly necessary here, as the functions
-// take basic types (void). The dependencies for sigaction and exit
-// are handled by signal.c.
+// Function to block SIGINT, SIGTERM and SIGUSR2 in the calling thread and
+// every thread it starts afterwards, and open a signalfd that receives them
+// instead. Call first thing in main(), before any thread is started. Child
+// processes must reset their signal mask before exec.
+//
+// Returns: The non-blocking signalfd, or -1 if it could not be created.
+int open_signal_fd(void);
 
-// Function to install signal handlers for graceful shutdown.
-// It sets up handlers for SIGINT (Ctrl+C) and SIGTERM (termination signal)
-// to print a message and exit the program.
-void install_signal_handlers();
+// Function to take the next pending signal from a signalfd.
+// Returns: The signal number, or 0 once none is pending.
+int read_signal(int signal_fd);
 
-#endif // SIGNAL_H
\ No newline at end of file
+// Function to block SIGPIPE in the calling thread and every thread it starts
+// afterwards, so a write to a client that hung up fails with EPIPE instead of
+// killing the server. Call first thing in main(). Child processes must reset
+// their signal mask before exec.
+void block_sigpipe(void);
+
+#endif // SIGNAL_H
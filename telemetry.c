@@ -0,0 +1,293 @@
+#include "telemetry.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "event_loop.h"
+
+#define STATUS_CLASSES 5         // No response, 2xx, 3xx, 4xx, 5xx
+#define UNMATCHED_ROUTE TELEMETRY_MAX_ROUTES
+
+/*
+ * Latency buckets in microseconds, log-scaled with two sub-buckets per power of two:
+ * 1, 2, 3, 4, 6, 8, 12, 16, ... up to 2^26 us (67 s), plus one bucket for anything slower.
+ * Every bucket is at most a third wider than its lower bound, which keeps the relative error
+ * of a quantile bounded the way HDR histograms do, at 53 counters per series.
+ */
+#define LATENCY_BUCKETS 53
+
+static const char *const STATUS_LABELS[STATUS_CLASSES] = { "none", "2xx", "3xx", "4xx", "5xx" };
+static const char *const TIMEOUT_LABELS[TELEMETRY_TIMEOUTS] = { "header", "body", "idle", "write" };
+
+struct latency_series {
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+};
+
+/*
+ * Counters of one thread. Only their own thread writes them, so an update is a plain load and
+ * store without a locked instruction or a shared cache line; the atomics only make the reads
+ * of the renderer well-defined. Shards are created on a thread's first request and never
+ * freed: the threads that serve requests live as long as the server.
+ */
+struct telemetry_shard {
+    struct telemetry_shard *next;
+    _Atomic uint64_t requests_started;
+    _Atomic uint64_t connections_opened;
+    _Atomic uint64_t connections_closed;
+    _Atomic uint64_t connections_shed;
+    _Atomic uint64_t connection_timeouts[TELEMETRY_TIMEOUTS];
+    struct latency_series series[TELEMETRY_MAX_ROUTES + 1][STATUS_CLASSES];
+};
+
+// The sum of every shard, built by the renderer only
+struct merged_series {
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+static const struct route *route_table = NULL;
+static size_t route_count = 0;
+
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct telemetry_shard *shards = NULL;
+
+static _Thread_local struct telemetry_shard *local_shard = NULL;
+static _Thread_local struct request_telemetry *bound_request = NULL;
+
+static void counter_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static uint64_t counter_read(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static struct telemetry_shard *thread_shard(void) {
+    if (local_shard) return local_shard;
+
+    struct telemetry_shard *shard = calloc(1, sizeof(*shard));
+    if (!shard) return NULL; // Not counted rather than failing the request
+
+    pthread_mutex_lock(&shard_lock);
+    shard->next = shards;
+    shards = shard;
+    pthread_mutex_unlock(&shard_lock);
+
+    local_shard = shard;
+    return shard;
+}
+
+static int latency_bucket(uint64_t us) {
+    if (us <= 1) return 0;
+    if (us == 2) return 1;
+
+    // (2^k, 3*2^(k-1)] and (3*2^(k-1), 2^(k+1)] are told apart by the bit below the top one
+    uint64_t m = us - 1;
+    int msb = 63 - __builtin_clzll(m);
+    int index = 2 + 2 * (msb - 1) + (int)((m >> (msb - 1)) & 1);
+    return index < LATENCY_BUCKETS - 1 ? index : LATENCY_BUCKETS - 1;
+}
+
+static uint64_t bucket_bound_us(int index) {
+    if (index < 2) return (uint64_t)index + 1;
+    int msb = (index - 2) / 2 + 1;
+    return (index % 2 == 0) ? 3ULL << (msb - 1) : 1ULL << (msb + 1);
+}
+
+static int status_class(int status) {
+    return (status >= 200 && status < 600) ? status / 100 - 1 : 0;
+}
+
+void telemetry_init(const struct route *routes, size_t count) {
+    route_table = routes;
+    route_count = count < TELEMETRY_MAX_ROUTES ? count : TELEMETRY_MAX_ROUTES;
+}
+
+void telemetry_request_start(struct request_telemetry *t, size_t head_bytes) {
+    *t = (struct request_telemetry){
+        .active = 1,
+        .route = UNMATCHED_ROUTE,
+        .start_ns = monotonic_ns(),
+        .bytes_in = head_bytes,
+    };
+
+    struct telemetry_shard *shard = thread_shard();
+    if (shard) counter_add(&shard->requests_started, 1);
+}
+
+void telemetry_request_body(struct request_telemetry *t, size_t bytes) {
+    t->bytes_in += bytes;
+}
+
+void telemetry_request_finish(struct request_telemetry *t) {
+    if (!t->active) return;
+    t->active = 0;
+
+    struct telemetry_shard *shard = thread_shard();
+    if (!shard) return;
+
+    uint64_t ns = (uint64_t)(monotonic_ns() - t->start_ns);
+    struct latency_series *series = &shard->series[t->route][status_class(t->status)];
+    counter_add(&series->buckets[latency_bucket((ns + 999) / 1000)], 1);
+    counter_add(&series->sum_ns, ns);
+    counter_add(&series->bytes_in, t->bytes_in);
+    counter_add(&series->bytes_out, t->bytes_out);
+}
+
+void telemetry_bind(struct request_telemetry *t) {
+    bound_request = t;
+}
+
+void telemetry_set_route(const struct route *route) {
+    struct request_telemetry *t = bound_request;
+    if (!t || !t->active) return;
+
+    size_t index = (size_t)(route - route_table);
+    if (index < route_count) t->route = (int)index;
+}
+
+void telemetry_response(int status, size_t bytes) {
+    struct request_telemetry *t = bound_request;
+    if (!t || !t->active) return;
+
+    t->bytes_out += bytes;
+    if (status >= 200 && t->status == 0) t->status = status;
+}
+
+void telemetry_connection_opened(void) {
+    struct telemetry_shard *shard = thread_shard();
+    if (shard) counter_add(&shard->connections_opened, 1);
+}
+
+void telemetry_connection_closed(void) {
+    struct telemetry_shard *shard = thread_shard();
+    if (shard) counter_add(&shard->connections_closed, 1);
+}
+
+void telemetry_connection_shed(void) {
+    struct telemetry_shard *shard = thread_shard();
+    if (shard) counter_add(&shard->connections_shed, 1);
+}
+
+void telemetry_connection_timeout(enum telemetry_timeout phase) {
+    struct telemetry_shard *shard = thread_shard();
+    if (shard) counter_add(&shard->connection_timeouts[phase], 1);
+}
+
+static void series_labels(char *buf, size_t size, int route, int class) {
+    if (route == UNMATCHED_ROUTE) {
+        snprintf(buf, size, "route=\"unmatched\",status=\"%s\"", STATUS_LABELS[class]);
+    } else {
+        snprintf(buf, size, "method=\"%s\",route=\"%s\",status=\"%s\"",
+                 route_table[route].method, route_table[route].pattern, STATUS_LABELS[class]);
+    }
+}
+
+/*
+ * The shards are only summed up here, once per rendering, so serving a request never pays for
+ * the aggregation. A counter that a worker bumps while it is being summed shows up in the next
+ * rendering instead; the in-flight gauge is clamped for the same reason.
+ */
+void telemetry_render(telemetry_append append, void *ctx) {
+    struct merged_series (*merged)[STATUS_CLASSES] = calloc(TELEMETRY_MAX_ROUTES + 1, sizeof(*merged));
+    if (!merged) return;
+
+    uint64_t started = 0, finished = 0, opened = 0, closed = 0, shed = 0;
+    uint64_t timeouts[TELEMETRY_TIMEOUTS] = { 0 };
+
+    pthread_mutex_lock(&shard_lock);
+    for (struct telemetry_shard *shard = shards; shard; shard = shard->next) {
+        started += counter_read(&shard->requests_started);
+        opened += counter_read(&shard->connections_opened);
+        closed += counter_read(&shard->connections_closed);
+        shed += counter_read(&shard->connections_shed);
+        for (int i = 0; i < TELEMETRY_TIMEOUTS; ++i) timeouts[i] += counter_read(&shard->connection_timeouts[i]);
+
+        for (int route = 0; route <= TELEMETRY_MAX_ROUTES; ++route) {
+            for (int class = 0; class < STATUS_CLASSES; ++class) {
+                struct latency_series *src = &shard->series[route][class];
+                struct merged_series *dst = &merged[route][class];
+                for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+                    uint64_t n = counter_read(&src->buckets[i]);
+                    dst->buckets[i] += n;
+                    dst->count += n;
+                }
+                dst->sum_ns += counter_read(&src->sum_ns);
+                dst->bytes_in += counter_read(&src->bytes_in);
+                dst->bytes_out += counter_read(&src->bytes_out);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard_lock);
+
+    char labels[192];
+
+    append(ctx, "# TYPE admin_http_request_duration_seconds histogram\n");
+    for (int route = 0; route <= TELEMETRY_MAX_ROUTES; ++route) {
+        for (int class = 0; class < STATUS_CLASSES; ++class) {
+            const struct merged_series *s = &merged[route][class];
+            if (s->count == 0) continue;
+            series_labels(labels, sizeof(labels), route, class);
+            finished += s->count;
+
+            uint64_t cumulative = 0;
+            for (int i = 0; i < LATENCY_BUCKETS - 1; ++i) {
+                cumulative += s->buckets[i];
+                append(ctx, "admin_http_request_duration_seconds_bucket{%s,le=\"%.6f\"} %llu\n",
+                       labels, (double)bucket_bound_us(i) / 1e6, (unsigned long long)cumulative);
+            }
+            append(ctx,
+                "admin_http_request_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n"
+                "admin_http_request_duration_seconds_sum{%s} %.9f\n"
+                "admin_http_request_duration_seconds_count{%s} %llu\n",
+                labels, (unsigned long long)s->count, labels, (double)s->sum_ns / 1e9,
+                labels, (unsigned long long)s->count);
+        }
+    }
+
+    append(ctx, "# TYPE admin_http_request_bytes_total counter\n");
+    for (int route = 0; route <= TELEMETRY_MAX_ROUTES; ++route) {
+        for (int class = 0; class < STATUS_CLASSES; ++class) {
+            if (merged[route][class].count == 0) continue;
+            series_labels(labels, sizeof(labels), route, class);
+            append(ctx, "admin_http_request_bytes_total{%s} %llu\n",
+                   labels, (unsigned long long)merged[route][class].bytes_in);
+        }
+    }
+
+    append(ctx, "# TYPE admin_http_response_bytes_total counter\n");
+    for (int route = 0; route <= TELEMETRY_MAX_ROUTES; ++route) {
+        for (int class = 0; class < STATUS_CLASSES; ++class) {
+            if (merged[route][class].count == 0) continue;
+            series_labels(labels, sizeof(labels), route, class);
+            append(ctx, "admin_http_response_bytes_total{%s} %llu\n",
+                   labels, (unsigned long long)merged[route][class].bytes_out);
+        }
+    }
+
+    append(ctx,
+        "admin_http_requests_in_flight %llu\n"
+        "admin_http_connections_open %llu\n"
+        "admin_http_connections_total %llu\n"
+        "admin_http_connections_shed_total %llu\n",
+        (unsigned long long)(started > finished ? started - finished : 0),
+        (unsigned long long)(opened > closed ? opened - closed : 0),
+        (unsigned long long)opened, (unsigned long long)shed);
+
+    append(ctx, "# TYPE admin_http_connection_timeouts_total counter\n");
+    for (int i = 0; i < TELEMETRY_TIMEOUTS; ++i) {
+        append(ctx, "admin_http_connection_timeouts_total{phase=\"%s\"} %llu\n",
+               TIMEOUT_LABELS[i], (unsigned long long)timeouts[i]);
+    }
+
+    free(merged);
+}
@@ -0,0 +1,80 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h>
+
+#include "router.h"
+
+// Maximum number of routes that get their own series; requests that match
+// no route are counted under route="unmatched".
+#define TELEMETRY_MAX_ROUTES 31
+
+// The phase a connection was in when it took too long and was closed
+enum telemetry_timeout {
+    TELEMETRY_TIMEOUT_HEADER, // Request head incomplete after ADMIN_HEADER_TIMEOUT_MS
+    TELEMETRY_TIMEOUT_BODY,   // No body bytes for ADMIN_BODY_TIMEOUT_MS
+    TELEMETRY_TIMEOUT_IDLE,   // Kept alive without a request for ADMIN_KEEPALIVE_TIMEOUT_MS
+    TELEMETRY_TIMEOUT_WRITE,  // Response not taken within ADMIN_SEND_TIMEOUT_MS
+    TELEMETRY_TIMEOUTS,
+};
+
+// Accounting of the request a connection is currently serving. Lives in the
+// connection, because a request with a body may be continued by another
+// worker than the one that started it.
+struct request_telemetry {
+    int active;           // Started and not yet recorded
+    int route;            // Index into the route table, TELEMETRY_MAX_ROUTES if unmatched
+    int status;           // Final status code, 0 while none was sent
+    long long start_ns;   // CLOCK_MONOTONIC
+    uint64_t bytes_in;    // Head and framed body
+    uint64_t bytes_out;   // Interim and final responses
+};
+
+// Function to register the route table whose entries label the series.
+// Call once at startup, before any request is served. Routes past
+// TELEMETRY_MAX_ROUTES are counted as unmatched.
+void telemetry_init(const struct route *routes, size_t count);
+
+// Function to start accounting a request whose head (or what was received
+// of a rejected one) is `head_bytes` long.
+void telemetry_request_start(struct request_telemetry *t, size_t head_bytes);
+
+// Function to add received body bytes to a request.
+void telemetry_request_body(struct request_telemetry *t, size_t bytes);
+
+// Function to record a request: its latency from telemetry_request_start()
+// until now, its status and its bytes. Does nothing if the request was
+// already recorded, so every path that ends a request may call it.
+void telemetry_request_finish(struct request_telemetry *t);
+
+// Function to make `t` the request served by the calling thread, so that
+// handlers and response senders can account to it without a reference to the
+// connection. NULL when the thread is done with it.
+void telemetry_bind(struct request_telemetry *t);
+
+// Function to set the route of the request bound to the calling thread.
+void telemetry_set_route(const struct route *route);
+
+// Function to account a response written by the calling thread. A status
+// below 200 (100 Continue) only adds its bytes.
+void telemetry_response(int status, size_t bytes);
+
+// Functions to count client connections over their lifetime, and those
+// refused right away because the server was overloaded.
+void telemetry_connection_opened(void);
+void telemetry_connection_closed(void);
+void telemetry_connection_shed(void);
+
+// Function to count a connection closed because it timed out in `phase`.
+void telemetry_connection_timeout(enum telemetry_timeout phase);
+
+// Appends formatted text to the output the caller is building.
+typedef void (*telemetry_append)(void *ctx, const char *fmt, ...);
+
+// Function to merge the counters of all threads and write them in the
+// Prometheus text format: per route and status class, a latency histogram
+// and byte counters, plus connection and in-flight request gauges.
+void telemetry_render(telemetry_append append, void *ctx);
+
+#endif // TELEMETRY_H
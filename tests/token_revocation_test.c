@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "auth.h"
+#include "base64.h"
+
+/*
+ * A revoked token must stay refused whatever spelling of its signature is presented: the two
+ * unused bits of the signature's last character set, or '=' padding appended.
+ */
+
+static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static int failures = 0;
+
+static void expect(int condition, const char *what) {
+    if (condition) return;
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+}
+
+// The same token with the unused low bits of the signature's last character changed
+static char *with_altered_tail(const char *token, int bits) {
+    char *altered = strdup(token);
+    if (!altered) exit(EXIT_FAILURE);
+    char *last = altered + strlen(altered) - 1;
+    *last = ALPHABET[(strchr(ALPHABET, *last) - ALPHABET) ^ bits];
+    return altered;
+}
+
+int main(void) {
+    setenv("JWT_SECRET", "token-revocation-test-secret", 1);
+    init_auth_or_exit();
+
+    char *token = generate_jwt("admin");
+    expect(token != NULL, "a token is generated");
+    if (!token) return EXIT_FAILURE;
+
+    char padded[1024];
+    snprintf(padded, sizeof(padded), "%s=", token);
+    char *altered[3];
+    for (int bits = 1; bits <= 3; ++bits) altered[bits - 1] = with_altered_tail(token, bits);
+
+    // The HMAC-SHA256 signature is 43 characters, the last one carries 2 unused bits
+    const char *signature = strrchr(token, '.') + 1;
+    unsigned char digest[64];
+    expect(strlen(signature) == 43, "the signature is 43 characters long");
+    for (int i = 0; i < 3; ++i) {
+        const char *altered_signature = strrchr(altered[i], '.') + 1;
+        expect(base64url_decode(altered_signature, strlen(altered_signature), digest, sizeof(digest)) == -1,
+               "a signature with unused bits set is not decoded");
+    }
+
+    expect(validate_token(token), "the token is valid before it is revoked");
+    expect(revoke_token(token), "the token is revoked");
+    expect(!validate_token(token), "the revoked token is refused");
+    expect(!validate_token(padded), "the revoked token is refused with padding appended");
+    for (int i = 0; i < 3; ++i) {
+        expect(!validate_token(altered[i]), "the revoked token is refused with its last character altered");
+    }
+
+    char *other = generate_jwt("operator");
+    expect(other && validate_token(other), "another token is still valid");
+
+    for (int i = 0; i < 3; ++i) free(altered[i]);
+    free(other);
+    free(token);
+    if (failures == 0) printf("token revocation: all checks passed\n");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
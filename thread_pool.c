@@ -1,29 +1,205 @@
 #include "thread_pool.h"
+#include <limits.h>
 #include <pthread.h>
-#include <stdlib.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
+
+#define MAX_POOLS 8
+
+/*
+ * The queue is a bounded multi-producer/multi-consumer ring (Dmitry Vyukov's design).
+ * Every cell carries a sequence number that tells producers and consumers whose turn it is:
+ *
+ *   sequence == pos      the cell is free for the producer that claims position `pos`
+ *   sequence == pos + 1  the cell holds the job for the consumer that claims position `pos`
+ *
+ * Producers and consumers claim positions with a single CAS on their own counter, so there is
+ * no lock shared between the accept loop and the workers. The semaphore is only used to put
+ * idle workers to sleep, it never protects the data.
+ */
+struct job_cell {
+    atomic_size_t sequence;
+    thread_pool_job job;
+    void *arg;
+};
+
+struct thread_pool {
+    const char *name;
+    struct job_cell *cells;
+    size_t mask;
+
+    // Producer and consumer counters on separate cache lines to avoid false sharing
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+
+    _Alignas(64) sem_t pending;
+    size_t workers;
+    atomic_size_t busy_workers;
+    atomic_ullong completed;
+    atomic_ullong rejected;
+};
+
+static struct thread_pool *pools[MAX_POOLS];
+static atomic_int pool_count;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int queue_push(struct thread_pool *pool, thread_pool_job job, void *arg) {
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    struct job_cell *cell;
+
+    while (1) {
+        cell = &pool->cells[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // The consumer of this cell's previous lap has not taken it yet: full
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->job = job;
+    cell->arg = arg;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+static int queue_pop(struct thread_pool *pool, thread_pool_job *job, void **arg) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    struct job_cell *cell;
+
+    while (1) {
+        cell = &pool->cells[pos & pool->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; // Not published yet
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
 
-#include "request.h"
+    *job = cell->job;
+    *arg = cell->arg;
+    atomic_store_explicit(&cell->sequence, pos + pool->mask + 1, memory_order_release);
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct thread_pool *pool = arg;
+
+    while (1) {
+        while (sem_wait(&pool->pending) != 0) {
+            // EINTR: retry
+        }
 
-static void *handle_client(void *arg) {
-    int client_fd = *(int *)arg;
-    free(arg);
+        /*
+         * The semaphore is posted after the job is published, so a job is guaranteed to be
+         * there. The pop can still fail briefly when an earlier position was claimed by a
+         * producer that has not finished publishing; that producer is mid-store, so yield.
+         */
+        thread_pool_job job;
+        void *job_arg;
+        while (queue_pop(pool, &job, &job_arg) != 0) sched_yield();
 
-    handle_request(client_fd); // Parse and respond
-    close(client_fd);
+        atomic_fetch_add_explicit(&pool->busy_workers, 1, memory_order_relaxed);
+        job(job_arg);
+        atomic_fetch_sub_explicit(&pool->busy_workers, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&pool->completed, 1, memory_order_relaxed);
+    }
     return NULL;
 }
 
-void spawn_thread_for_client(int client_fd) {
-    pthread_t tid;
-    int *fd_ptr = malloc(sizeof(int));
-    *fd_ptr = client_fd;
+struct thread_pool *thread_pool_create(const char *name, size_t workers, size_t queue_capacity, size_t stack_size) {
+    if (atomic_load(&pool_count) >= MAX_POOLS) return NULL;
+
+    size_t capacity = 2;
+    while (capacity < queue_capacity) capacity *= 2;
+
+    struct thread_pool *pool = aligned_alloc(64, (sizeof(*pool) + 63) / 64 * 64);
+    if (!pool) return NULL;
+    *pool = (struct thread_pool){ .name = name, .mask = capacity - 1, .workers = workers };
+
+    pool->cells = calloc(capacity, sizeof(*pool->cells));
+    if (!pool->cells || sem_init(&pool->pending, 0, 0) != 0) {
+        free(pool->cells);
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < capacity; ++i) atomic_init(&pool->cells[i].sequence, i);
+
+    /*
+     * The default pthread stack is 8 MB of reserved address space per thread. Handlers only use
+     * a few KB of stack, so a small configurable stack keeps the footprint of the pool bounded.
+     */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stack_size < PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (size_t i = 0; i < workers; ++i) {
+        pthread_t tid;
+        int err = pthread_create(&tid, &attr, worker_main, pool);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create for pool %s failed: %d\n", name, err);
+            pthread_attr_destroy(&attr);
+            // Already started workers keep sleeping on the semaphore, the pool can't be freed
+            return NULL;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Publish the pool before bumping the count, so /metrics never sees an empty slot
+    pthread_mutex_lock(&pools_lock);
+    int index = atomic_load(&pool_count);
+    pools[index] = pool;
+    atomic_store(&pool_count, index + 1);
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job job, void *arg) {
+    if (queue_push(pool, job, arg) != 0) {
+        atomic_fetch_add_explicit(&pool->rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+    sem_post(&pool->pending);
+    return 0;
+}
 
-    if (pthread_create(&tid, NULL, handle_client, fd_ptr) != 0) {
-        perror("pthread_create");
-        close(client_fd);
-        free(fd_ptr);
+void thread_pool_foreach_stats(void (*visit)(const struct thread_pool_stats *stats, void *ctx), void *ctx) {
+    int count = atomic_load(&pool_count);
+    for (int i = 0; i < count; ++i) {
+        struct thread_pool *pool = pools[i];
+        size_t enqueued = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        size_t dequeued = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+
+        struct thread_pool_stats stats = {
+            .name = pool->name,
+            .workers = pool->workers,
+            .busy_workers = atomic_load_explicit(&pool->busy_workers, memory_order_relaxed),
+            .queue_depth = enqueued > dequeued ? enqueued - dequeued : 0,
+            .queue_capacity = pool->mask + 1,
+            .completed = atomic_load_explicit(&pool->completed, memory_order_relaxed),
+            .rejected = atomic_load_explicit(&pool->rejected, memory_order_relaxed),
+        };
+        visit(&stats, ctx);
     }
-    pthread_detach(tid); // Fire and forget
-}
\ No newline at end of file
+}
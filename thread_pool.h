@@ -1,28 +1,43 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-// Forward declaration of functions from other modules that are used here.
-// This prevents circular dependencies if request.h also includes thread_pool.h.
-// It's generally better to include the full header if many things are used,
-// but for a single function call, a forward declaration is sufficient
-// and can reduce compilation time for large projects.
-#include <unistd.h> // For close()
-
-// Although not strictly necessary for the public interface,
-// it's good practice to ensure pthread_t is defined if the header
-// might be used in contexts where <pthread.h> isn't already included.
-// However, since spawn_thread_for_client directly creates pthreads,
-// including it here makes sense.
-#include <pthread.h> // For pthread_t and other pthread types (though only pthread_t is exposed directly)
-
-
-// Function to spawn a new thread to handle a client connection.
-// The created thread will be detached, meaning its resources are
-// automatically reclaimed upon termination.
+#include <stddef.h> // For size_t
+
+struct thread_pool;
+
+// A unit of work executed by one of the pool's worker threads.
+typedef void (*thread_pool_job)(void *arg);
+
+// Point-in-time counters of a pool, as exported in /metrics.
+struct thread_pool_stats {
+    const char *name;
+    size_t workers;
+    size_t busy_workers;
+    size_t queue_depth;
+    size_t queue_capacity;
+    unsigned long long completed;
+    unsigned long long rejected;
+};
+
+// Function to create a pool of pre-started worker threads fed by a bounded
+// lock-free queue. The pool lives for the rest of the process.
 //
-// int client_fd: The file descriptor of the connected client socket.
-//                Ownership of this file descriptor is passed to the
-//                newly spawned thread, which will eventually close it.
-void spawn_thread_for_client(int client_fd);
+// const char *name: Label used for the pool in /metrics (must be a literal or
+//                   otherwise outlive the pool).
+// size_t workers: Number of worker threads, started immediately.
+// size_t queue_capacity: Maximum number of queued jobs, rounded up to a power of two.
+// size_t stack_size: Stack size of each worker thread in bytes.
+//
+// Returns: The pool, or NULL if allocation or thread creation failed.
+struct thread_pool *thread_pool_create(const char *name, size_t workers, size_t queue_capacity, size_t stack_size);
+
+// Function to queue a job without blocking.
+// Returns: 0 if the job was queued, -1 if the queue is full. A full queue is
+//          the pool's backpressure signal: the caller must shed the work
+//          instead of waiting.
+int thread_pool_submit(struct thread_pool *pool, thread_pool_job job, void *arg);
+
+// Function to call `visit` with the statistics of every pool created so far.
+void thread_pool_foreach_stats(void (*visit)(const struct thread_pool_stats *stats, void *ctx), void *ctx);
 
-#endif // THREAD_POOL_H
\ No newline at end of file
+#endif // THREAD_POOL_H
@@ -0,0 +1,105 @@
+#include "timer_wheel.h"
+#include <stddef.h>
+
+#define SLOT_BITS 6 // log2(TIMER_WHEEL_SLOTS)
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELAY ((uint64_t)1 << (SLOT_BITS * TIMER_WHEEL_LEVELS))
+
+/*
+ * A hierarchical timing wheel, as in Varghese and Lauck, and the Linux kernel before 4.8.
+ * Level 0 has a slot per tick for the next 64 ticks. A slot of level 1 spans 64 ticks, one of
+ * level 2 64 * 64, and so on. Starting a timer files it under the level whose span covers its
+ * delay, which is O(1). Every 64 ticks, as level 0 comes around, the next slot of level 1 is
+ * emptied and its timers are filed again, now on level 0 with an exact tick; level 2 cascades
+ * into level 1 every 64 * 64 ticks, and so on. A timer is refiled once per level at most, and
+ * most never are: connection timeouts are mostly stopped long before they expire.
+ */
+
+static void list_append(struct timer_node *head, struct timer_node *node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void timer_list_init(struct timer_node *head) {
+    head->prev = head->next = head;
+}
+
+void timer_node_init(struct timer_node *node) {
+    node->prev = node->next = NULL;
+    node->expires = 0;
+}
+
+int timer_node_pending(const struct timer_node *node) {
+    return node->next != NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->next_tick = now;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot) timer_list_init(&wheel->slots[level][slot]);
+    }
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *node, uint64_t expires) {
+    if (expires < wheel->next_tick) expires = wheel->next_tick; // Overdue: the next tick processed
+    uint64_t delay = expires - wheel->next_tick;
+    if (delay >= MAX_DELAY) {
+        delay = MAX_DELAY - 1;
+        expires = wheel->next_tick + delay;
+    }
+    node->expires = expires;
+
+    int level = 0;
+    while (delay >= (uint64_t)1 << (SLOT_BITS * (level + 1))) level++;
+    list_append(&wheel->slots[level][(expires >> (SLOT_BITS * level)) & SLOT_MASK], node);
+}
+
+void timer_wheel_remove(struct timer_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+}
+
+// Refiles the timers of one upper slot, they land on lower levels. Returns the slot's index.
+static unsigned cascade(struct timer_wheel *wheel, int level) {
+    unsigned index = (unsigned)(wheel->next_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    struct timer_node *head = &wheel->slots[level][index];
+
+    struct timer_node pending;
+    timer_list_init(&pending);
+    if (head->next != head) {
+        // Taken off as a whole first: a timer may be refiled into the slot it came from
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        timer_list_init(head);
+    }
+    while (pending.next != &pending) {
+        struct timer_node *node = pending.next;
+        timer_wheel_remove(node);
+        timer_wheel_add(wheel, node, node->expires);
+    }
+    return index;
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, struct timer_node *expired) {
+    while (wheel->next_tick <= now) {
+        unsigned index = (unsigned)wheel->next_tick & SLOT_MASK;
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && cascade(wheel, level) == 0; ++level) {
+                // Each level comes around once per turn of the one above
+            }
+        }
+
+        struct timer_node *head = &wheel->slots[0][index];
+        while (head->next != head) {
+            struct timer_node *node = head->next;
+            timer_wheel_remove(node);
+            list_append(expired, node);
+        }
+        wheel->next_tick++;
+    }
+}
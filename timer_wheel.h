@@ -0,0 +1,56 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS 64 // Per level, each level's slot spans all of the level below
+
+// A timer, embedded in whatever it times out. Pending while linked into a
+// wheel (or into the list timer_wheel_advance() fills).
+struct timer_node {
+    struct timer_node *prev;
+    struct timer_node *next;
+    uint64_t expires; // In ticks
+};
+
+// Timers due at the same tick, or within the same span on the upper levels,
+// share a slot: a circular list headed by a sentinel node.
+struct timer_wheel {
+    uint64_t next_tick; // The first tick not processed yet
+    struct timer_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// Function to set up an empty wheel whose time starts at `now` ticks.
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+// Function to initialise a timer that is not pending, before its first use.
+void timer_node_init(struct timer_node *node);
+
+// Function to initialise an empty list of expired timers, see
+// timer_wheel_advance(). It is empty while head->next == head.
+void timer_list_init(struct timer_node *head);
+
+// Function to tell whether a timer is pending.
+// Returns: 1 if it is linked into a wheel or an expired list, 0 otherwise.
+int timer_node_pending(const struct timer_node *node);
+
+// Function to start a timer that expires at tick `expires`. One that is
+// already due expires at the next timer_wheel_advance(), one beyond the
+// wheel's range (TIMER_WHEEL_SLOTS^TIMER_WHEEL_LEVELS ticks) at the end of
+// it. The timer must not be pending. O(1).
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *node, uint64_t expires);
+
+// Function to stop a pending timer. O(1).
+void timer_wheel_remove(struct timer_node *node);
+
+// Function to move the clock forward to `now` and collect every timer due by
+// then. O(1) per tick and per expired timer, plus the occasional cascade of
+// a slot from an upper level down to the levels below.
+//
+// struct timer_node *expired: A list (see timer_list_init()) the due
+//                             timers are appended to. They stay pending
+//                             until the caller removes them.
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, struct timer_node *expired);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,288 @@
+#include "tls.h"
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "event_loop.h"
+
+#define TLS_RECORD_BYTES 16384 // Largest TLS record payload: one SSL_write() per record
+
+/*
+ * The TLS state of one client socket. The socket has one owner at a time, like the connection
+ * itself, so the session needs no lock.
+ */
+struct tls_session {
+    SSL *ssl;
+    int ktls_send;  // The kernel encrypts what we write, sendfile() works
+    int ktls_recv;
+    size_t pending; // Bytes in `staging` that SSL_write() started but could not finish
+    char *staging;  // Plaintext of the record being written, allocated on first write
+};
+
+static SSL_CTX *ssl_ctx = NULL;
+static struct tls_session **sessions = NULL; // Indexed by fd
+static size_t session_slots = 0;
+
+static atomic_ullong handshakes = 0;
+static atomic_ullong resumed_handshakes = 0;
+static atomic_ullong failed_handshakes = 0;
+static atomic_ullong ktls_send_sessions = 0;
+static atomic_ullong ktls_recv_sessions = 0;
+
+static struct tls_session *session_of(int fd) {
+    return fd >= 0 && (size_t)fd < session_slots ? sessions[fd] : NULL;
+}
+
+/*
+ * Polling clients come back every few seconds; resuming skips the certificate and the key
+ * exchange. TLS 1.2 clients resume from the session cache by id, TLS 1.3 clients (and 1.2 ones
+ * that support it) with tickets, encrypted under keys OpenSSL generates at startup. Either way
+ * sessions don't survive a restart of the server.
+ */
+int tls_init(void) {
+    if (!server_config.tls_cert || !server_config.tls_key) return 0;
+
+    // Sized once: the table is read by every worker, it can't be grown under them
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return -1;
+    session_slots = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 20) ? (1 << 20) : (size_t)limit.rlim_cur;
+    sessions = calloc(session_slots, sizeof(*sessions));
+    ssl_ctx = SSL_CTX_new(TLS_server_method());
+    if (!sessions || !ssl_ctx) return -1;
+
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, server_config.tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ssl_ctx, server_config.tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ssl_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ssl_ctx);
+        ssl_ctx = NULL;
+        return -1;
+    }
+
+    // A client that closes without close_notify just ended the connection, as with plaintext
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS; // Taken up after the handshake if the kernel has the tls module
+#endif
+    SSL_CTX_set_options(ssl_ctx, options);
+    // Idle keep-alive connections don't need their 34 KB of record buffers
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    static const unsigned char session_context[] = "ThreadedAdminServer";
+    SSL_CTX_set_session_id_context(ssl_ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_ctx, (long)server_config.tls_session_cache);
+    SSL_CTX_set_timeout(ssl_ctx, (long)server_config.tls_session_timeout_s);
+    return 0;
+}
+
+int tls_enabled(void) {
+    return ssl_ctx != NULL;
+}
+
+int tls_accept(int fd) {
+    if (!ssl_ctx) return 0;
+    if (fd < 0 || (size_t)fd >= session_slots) return -1;
+
+    struct tls_session *session = calloc(1, sizeof(*session));
+    if (!session) return -1;
+    session->ssl = SSL_new(ssl_ctx);
+    if (!session->ssl || SSL_set_fd(session->ssl, fd) != 1) {
+        SSL_free(session->ssl);
+        free(session);
+        return -1;
+    }
+    SSL_set_accept_state(session->ssl);
+    sessions[fd] = session;
+    return 0;
+}
+
+static int wait_writable(int fd, long long deadline_ms) {
+    while (1) {
+        long long remaining = deadline_ms - monotonic_ms();
+        if (remaining <= 0) return -1;
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int n = poll(&pfd, 1, (int)remaining);
+        if (n > 0) return 0;
+        if (n < 0 && errno != EINTR) return -1;
+    }
+}
+
+int tls_handshake(int fd) {
+    struct tls_session *session = session_of(fd);
+    if (!session) return -1;
+
+    long long deadline_ms = monotonic_ms() + (long long)server_config.send_timeout_ms;
+    while (1) {
+        ERR_clear_error();
+        int result = SSL_do_handshake(session->ssl);
+        if (result == 1) break;
+
+        int error = SSL_get_error(session->ssl, result);
+        if (error == SSL_ERROR_WANT_READ) return 0;
+        if (error == SSL_ERROR_WANT_WRITE && wait_writable(fd, deadline_ms) == 0) continue;
+        atomic_fetch_add_explicit(&failed_handshakes, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&handshakes, 1, memory_order_relaxed);
+    if (SSL_session_reused(session->ssl)) atomic_fetch_add_explicit(&resumed_handshakes, 1, memory_order_relaxed);
+
+#ifndef OPENSSL_NO_KTLS
+    session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl)) > 0;
+    session->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(session->ssl)) > 0;
+#endif
+    if (session->ktls_send) atomic_fetch_add_explicit(&ktls_send_sessions, 1, memory_order_relaxed);
+    if (session->ktls_recv) atomic_fetch_add_explicit(&ktls_recv_sessions, 1, memory_order_relaxed);
+    return 1;
+}
+
+// Maps a failed SSL_read/SSL_write/SSL_sendfile to the errno conventions of the socket calls
+static ssize_t io_error(struct tls_session *session, int result) {
+    int saved_errno = errno;
+    switch (SSL_get_error(session->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0; // close_notify, or a plain EOF with SSL_OP_IGNORE_UNEXPECTED_EOF
+    case SSL_ERROR_SYSCALL:
+        errno = saved_errno ? saved_errno : ECONNRESET;
+        return -1;
+    default:
+        errno = ECONNRESET;
+        return -1;
+    }
+}
+
+ssize_t tls_recv(int fd, void *buf, size_t len) {
+    struct tls_session *session = session_of(fd);
+    if (!session) return recv(fd, buf, len, MSG_DONTWAIT);
+
+    size_t n;
+    ERR_clear_error();
+    int result = SSL_read_ex(session->ssl, buf, len, &n);
+    return result == 1 ? (ssize_t)n : io_error(session, result);
+}
+
+/*
+ * SSL_write() that could not finish has to be called again with the same data. That data is
+ * our own copy in `staging`, so callers can retry the way they would retry sendmsg(): by
+ * passing what wasn't reported as sent, which starts with the staged bytes.
+ */
+static ssize_t send_staged(struct tls_session *session) {
+    size_t written;
+    ERR_clear_error();
+    int result = SSL_write_ex(session->ssl, session->staging, session->pending, &written);
+    if (result != 1) return io_error(session, result);
+
+    size_t n = session->pending;
+    session->pending = 0;
+    return (ssize_t)n;
+}
+
+static int ensure_staging(struct tls_session *session) {
+    if (!session->staging) session->staging = malloc(TLS_RECORD_BYTES);
+    if (session->staging) return 0;
+    errno = ENOMEM;
+    return -1;
+}
+
+ssize_t tls_sendmsg(int fd, const struct iovec *iov, size_t count, int flags) {
+    struct tls_session *session = session_of(fd);
+    if (!session) {
+        struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = count };
+        return sendmsg(fd, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    // Gathered into one record, so a head and a short body don't become two
+    if (session->pending == 0) {
+        if (ensure_staging(session) != 0) return -1;
+        for (size_t i = 0; i < count && session->pending < TLS_RECORD_BYTES; ++i) {
+            size_t part = iov[i].iov_len < TLS_RECORD_BYTES - session->pending
+                ? iov[i].iov_len : TLS_RECORD_BYTES - session->pending;
+            memcpy(session->staging + session->pending, iov[i].iov_base, part);
+            session->pending += part;
+        }
+        if (session->pending == 0) return 0;
+    }
+    return send_staged(session);
+}
+
+ssize_t tls_sendfile(int fd, int file_fd, off_t *offset, size_t len) {
+    struct tls_session *session = session_of(fd);
+    if (!session) return sendfile(fd, file_fd, offset, len);
+
+#ifndef OPENSSL_NO_KTLS
+    if (session->ktls_send) {
+        ERR_clear_error();
+        ossl_ssize_t n = SSL_sendfile(session->ssl, file_fd, *offset, len, 0);
+        if (n < 0) return io_error(session, (int)n);
+        *offset += n;
+        return n;
+    }
+#endif
+
+    if (session->pending == 0) {
+        if (ensure_staging(session) != 0) return -1;
+        ssize_t n = pread(file_fd, session->staging, len < TLS_RECORD_BYTES ? len : TLS_RECORD_BYTES, *offset);
+        if (n <= 0) return n;
+        session->pending = (size_t)n;
+    }
+    ssize_t n = send_staged(session);
+    if (n > 0) *offset += n;
+    return n;
+}
+
+// kTLS too: its sendmsg() fails with EOPNOTSUPP on MSG_ZEROCOPY instead of falling back to a copy
+int tls_copies(int fd) {
+    return session_of(fd) != NULL;
+}
+
+void tls_close(int fd) {
+    struct tls_session *session = session_of(fd);
+    if (!session) return;
+
+    // Only after a completed handshake, and without waiting: the socket is closed right after
+    if (SSL_is_init_finished(session->ssl) && session->pending == 0) {
+        ERR_clear_error();
+        SSL_shutdown(session->ssl);
+    }
+    SSL_free(session->ssl);
+    free(session->staging);
+    free(session);
+    sessions[fd] = NULL;
+}
+
+void tls_render(telemetry_append append, void *ctx) {
+    if (!ssl_ctx) return;
+
+    unsigned long long total = atomic_load_explicit(&handshakes, memory_order_relaxed);
+    unsigned long long resumed = atomic_load_explicit(&resumed_handshakes, memory_order_relaxed);
+    append(ctx,
+        "admin_tls_handshakes_total %llu\n"
+        "admin_tls_resumed_handshakes_total %llu\n"
+        "admin_tls_handshake_failures_total %llu\n"
+        "admin_tls_resumption_ratio %.4f\n"
+        "admin_tls_ktls_sessions_total{direction=\"send\"} %llu\n"
+        "admin_tls_ktls_sessions_total{direction=\"recv\"} %llu\n"
+        "admin_tls_session_cache_entries %ld\n",
+        total, resumed, atomic_load_explicit(&failed_handshakes, memory_order_relaxed),
+        total ? (double)resumed / (double)total : 0.0,
+        atomic_load_explicit(&ktls_send_sessions, memory_order_relaxed),
+        atomic_load_explicit(&ktls_recv_sessions, memory_order_relaxed),
+        SSL_CTX_sess_number(ssl_ctx));
+}
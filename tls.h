@@ -0,0 +1,68 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h> // For size_t
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "telemetry.h"
+
+// Function to set up TLS termination from ADMIN_TLS_CERT and ADMIN_TLS_KEY.
+// Without both the server speaks plaintext and every other function of this
+// module passes straight through to the socket calls.
+//
+// Returns: 0 on success (or when TLS is not configured), -1 if the
+//          certificate or key could not be loaded.
+int tls_init(void);
+
+// Function to tell whether client connections use TLS.
+int tls_enabled(void);
+
+// Function to attach a server-side TLS session to a freshly accepted client
+// socket. Must be called before any other function of this module for `fd`.
+//
+// Returns: 0 on success, -1 on failure.
+int tls_accept(int fd);
+
+// Function to advance the handshake of a client socket. Reads what the client
+// sent and answers; waits up to ADMIN_SEND_TIMEOUT_MS if the socket is full.
+// On completion, kTLS is enabled where the kernel supports it.
+//
+// Returns: 1 once the handshake completed, 0 if it needs more data from the
+//          client, -1 if it failed.
+int tls_handshake(int fd);
+
+// Function to receive from a client, decrypted if the socket uses TLS.
+// Non-blocking, with the semantics of recv(..., MSG_DONTWAIT).
+ssize_t tls_recv(int fd, void *buf, size_t len);
+
+// Function to send to a client, encrypted if the socket uses TLS. Non-blocking,
+// with the semantics of sendmsg(..., MSG_DONTWAIT | MSG_NOSIGNAL). With TLS,
+// a record that could only be sent partly is kept and finished by the next
+// call, which must be passed the same data again (after what was reported as
+// sent), as a retrying caller does anyway.
+//
+// int flags: Extra flags for sendmsg(), e.g. MSG_MORE or MSG_ZEROCOPY. Only
+//            used without TLS.
+ssize_t tls_sendmsg(int fd, const struct iovec *iov, size_t count, int flags);
+
+// Function to send part of a file to a client. Uses sendfile(), through the
+// kernel's TLS if it is enabled for the socket; otherwise the file is read
+// and encrypted in user space. Same semantics as sendfile() on a
+// non-blocking socket, retried like tls_sendmsg().
+ssize_t tls_sendfile(int fd, int file_fd, off_t *offset, size_t len);
+
+// Function to tell whether data sent on `fd` goes through TLS, in user space
+// or the kernel's, in which case MSG_ZEROCOPY is never used: records encrypted
+// in user space are a copy already, and kTLS does not take the flag.
+int tls_copies(int fd);
+
+// Function to end the TLS session of a client socket, before it is closed.
+// Sends close_notify if the socket takes it right away.
+void tls_close(int fd);
+
+// Function to write the handshake and kTLS counters in the Prometheus text
+// format.
+void tls_render(telemetry_append append, void *ctx);
+
+#endif // TLS_H
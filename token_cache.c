@@ -0,0 +1,194 @@
+#include "token_cache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/sha.h> // For SHA256_DIGEST_LENGTH
+
+#include "base64.h"
+
+#define TOKEN_CACHE_SETS 64
+#define TOKEN_CACHE_WAYS 4
+#define TOKEN_CACHE_MAX_TOKEN 512 // Longer tokens are verified every time
+#define TOKEN_REVOKED_MAX 256
+
+/*
+ * A small set-associative table: the signature picks one set of four entries, and each set has
+ * its own lock, so requests with different tokens rarely contend. Its size is fixed, a flood of
+ * distinct tokens only evicts entries, it can't grow the process.
+ */
+struct cached_token {
+    uint32_t hash;  // 0 marks an empty entry
+    time_t expires;
+    size_t len;
+    char token[TOKEN_CACHE_MAX_TOKEN];
+};
+
+struct cache_set {
+    pthread_mutex_t lock;
+    unsigned next_victim; // Round-robin eviction when every entry is live
+    struct cached_token entries[TOKEN_CACHE_WAYS];
+};
+
+/*
+ * A signature stays on the list until the token it belongs to expires anyway. It is listed
+ * decoded, as the digest verification compares: any other spelling of the same signature must
+ * be refused too.
+ */
+struct revoked_token {
+    time_t expires;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+static struct cache_set sets[TOKEN_CACHE_SETS];
+
+static pthread_mutex_t revoked_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct revoked_token revoked[TOKEN_REVOKED_MAX];
+static size_t revoked_count = 0;
+
+void token_cache_init(void) {
+    for (size_t i = 0; i < TOKEN_CACHE_SETS; ++i) {
+        pthread_mutex_init(&sets[i].lock, NULL);
+    }
+}
+
+// The signature is everything after the last '.'
+static const char *token_signature(const char *token, size_t len, size_t *signature_len) {
+    size_t start = len;
+    while (start > 0 && token[start - 1] != '.') start--;
+    *signature_len = len - start;
+    return token + start;
+}
+
+/*
+ * The signature is an HMAC, so its bytes are as good as random for any genuine token and a
+ * cheap hash of them spreads the entries evenly. A forged token can only pick which set it
+ * misses in.
+ */
+static uint32_t token_hash(const char *token, size_t len) {
+    size_t signature_len;
+    const char *signature = token_signature(token, len, &signature_len);
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < signature_len; ++i) {
+        hash ^= (unsigned char)signature[i];
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Compares the whole token in constant time, the first differing byte must not show in the timing
+static int entry_matches(const struct cached_token *entry, uint32_t hash, const char *token, size_t len) {
+    return entry->hash == hash && entry->len == len && CRYPTO_memcmp(entry->token, token, len) == 0;
+}
+
+int token_cache_lookup(const char *token, size_t len, time_t now) {
+    if (len >= TOKEN_CACHE_MAX_TOKEN) return 0;
+
+    uint32_t hash = token_hash(token, len);
+    struct cache_set *set = &sets[hash % TOKEN_CACHE_SETS];
+    int found = 0;
+
+    pthread_mutex_lock(&set->lock);
+    for (int i = 0; i < TOKEN_CACHE_WAYS; ++i) {
+        struct cached_token *entry = &set->entries[i];
+        if (!entry_matches(entry, hash, token, len)) continue;
+
+        if (now > entry->expires) entry->hash = 0;
+        else found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return found;
+}
+
+// Returns: 0 with the decoded signature in `digest`, -1 if it is no HMAC-SHA256 digest
+static int token_digest(const char *token, size_t len, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    size_t signature_len;
+    const char *signature = token_signature(token, len, &signature_len);
+    return base64url_decode(signature, signature_len, digest, SHA256_DIGEST_LENGTH) == SHA256_DIGEST_LENGTH ? 0 : -1;
+}
+
+static int is_revoked(const char *token, size_t len) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (token_digest(token, len, digest) != 0) return 1; // Can't have been verified, refused all the same
+    int found = 0;
+
+    pthread_mutex_lock(&revoked_lock);
+    for (size_t i = 0; i < revoked_count && !found; ++i) {
+        found = CRYPTO_memcmp(revoked[i].digest, digest, sizeof(digest)) == 0;
+    }
+    pthread_mutex_unlock(&revoked_lock);
+    return found;
+}
+
+/*
+ * The revocation check happens under the set lock, and token_cache_revoke() holds the same lock
+ * while it lists and evicts the token. A request that verified the token just before it was
+ * revoked therefore can't put it back into the cache afterwards.
+ */
+int token_cache_insert(const char *token, size_t len, time_t expires) {
+    uint32_t hash = token_hash(token, len);
+    struct cache_set *set = &sets[hash % TOKEN_CACHE_SETS];
+
+    pthread_mutex_lock(&set->lock);
+    if (is_revoked(token, len)) {
+        pthread_mutex_unlock(&set->lock);
+        return -1;
+    }
+
+    if (len < TOKEN_CACHE_MAX_TOKEN) {
+        time_t now = time(NULL);
+        struct cached_token *victim = NULL;
+
+        for (int i = 0; i < TOKEN_CACHE_WAYS && !victim; ++i) {
+            struct cached_token *entry = &set->entries[i];
+            if (entry->hash == 0 || now > entry->expires || entry_matches(entry, hash, token, len)) victim = entry;
+        }
+        if (!victim) victim = &set->entries[set->next_victim++ % TOKEN_CACHE_WAYS];
+
+        victim->hash = hash;
+        victim->expires = expires;
+        victim->len = len;
+        memcpy(victim->token, token, len);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return 0;
+}
+
+int token_cache_revoke(const char *token, size_t len, time_t expires) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (token_digest(token, len, digest) != 0) return -1;
+
+    uint32_t hash = token_hash(token, len);
+    struct cache_set *set = &sets[hash % TOKEN_CACHE_SETS];
+    time_t now = time(NULL);
+    int result = 0;
+
+    pthread_mutex_lock(&set->lock);
+    pthread_mutex_lock(&revoked_lock);
+
+    // Entries of tokens that expired since need no revocation anymore
+    size_t kept = 0;
+    for (size_t i = 0; i < revoked_count; ++i) {
+        if (now <= revoked[i].expires) revoked[kept++] = revoked[i];
+    }
+    revoked_count = kept;
+
+    if (revoked_count < TOKEN_REVOKED_MAX) {
+        struct revoked_token *entry = &revoked[revoked_count++];
+        entry->expires = expires;
+        memcpy(entry->digest, digest, sizeof(digest));
+    } else {
+        result = -1;
+    }
+    pthread_mutex_unlock(&revoked_lock);
+
+    if (result == 0) {
+        for (int i = 0; i < TOKEN_CACHE_WAYS; ++i) {
+            if (entry_matches(&set->entries[i], hash, token, len)) set->entries[i].hash = 0;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return result;
+}
@@ -0,0 +1,35 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include <stddef.h> // For size_t
+#include <time.h>   // For time_t
+
+// Function to set up the cache. Call once, before any other token_cache_*
+// function.
+void token_cache_init(void);
+
+// Function to look up a token that was verified before.
+//
+// const char *token, size_t len: The complete JWT.
+// time_t now: Current time, an expired entry is dropped and not reported.
+//
+// Returns: 1 if the token is cached and not expired, 0 otherwise.
+int token_cache_lookup(const char *token, size_t len, time_t now);
+
+// Function to remember a token whose signature was just verified. Tokens
+// that were revoked are not cached, whatever their signature.
+//
+// time_t expires: Last second the token is valid.
+//
+// Returns: 0 if the token may be accepted, -1 if it was revoked.
+int token_cache_insert(const char *token, size_t len, time_t expires);
+
+// Function to revoke a verified token until it expires. It is removed from
+// the cache, and token_cache_insert() refuses it from then on, and any token
+// whose signature decodes to the same digest.
+//
+// Returns: 0 on success, -1 if the revocation list is full or the signature
+//          is no HMAC-SHA256 digest.
+int token_cache_revoke(const char *token, size_t len, time_t expires);
+
+#endif // TOKEN_CACHE_H
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE // For execvpe()
+#include "upgrade.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // For PATH_MAX
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATE_VARIABLE "ADMIN_UPGRADE_STATE"
+#define MAX_STATE_ENTRIES 1024
+#define MAX_KEPT_FDS 1024
+
+extern char **environ;
+
+/*
+ * The state travels to the new image in one environment variable, "key=value key=value ...".
+ * Everything handed over is numbers and service names, which contain no spaces, and the
+ * environment is the one channel exec() carries besides the descriptors themselves. It is
+ * removed from our own environment as soon as it is read, so the services and jobs we start
+ * never see it.
+ */
+struct state_entry {
+    const char *key;
+    const char *value;
+};
+
+static char **start_argv = NULL;
+static char binary_path[PATH_MAX];
+
+static char *received = NULL; // The variable as read, split in place into entries
+static struct state_entry entries[MAX_STATE_ENTRIES];
+static size_t entry_count = 0;
+
+static char handoff[64 * 1024] = STATE_VARIABLE "=";
+static size_t handoff_len = sizeof(STATE_VARIABLE);
+static int handoff_overflow = 0;
+static int kept_fds[MAX_KEPT_FDS];
+static size_t kept_fd_count = 0;
+
+void upgrade_init(char *argv[]) {
+    start_argv = argv;
+
+    // The path, not the file: a binary replaced on disk since is the one the upgrade runs
+    ssize_t len = readlink("/proc/self/exe", binary_path, sizeof(binary_path) - 1);
+    if (len > 0) binary_path[len] = '\0';
+    else snprintf(binary_path, sizeof(binary_path), "%s", argv[0]);
+
+    const char *state = getenv(STATE_VARIABLE);
+    if (!state) return;
+    received = strdup(state);
+    unsetenv(STATE_VARIABLE);
+    if (!received) return;
+
+    char *save = NULL;
+    for (char *word = strtok_r(received, " ", &save); word && entry_count < MAX_STATE_ENTRIES;
+         word = strtok_r(NULL, " ", &save)) {
+        char *equals = strchr(word, '=');
+        if (!equals) continue;
+        *equals = '\0';
+        entries[entry_count++] = (struct state_entry){ .key = word, .value = equals + 1 };
+    }
+}
+
+int upgrade_resumed(void) {
+    return received != NULL;
+}
+
+const char *upgrade_state(const char *key) {
+    for (size_t i = 0; i < entry_count; ++i) {
+        if (strcmp(entries[i].key, key) == 0) return entries[i].value;
+    }
+    return NULL;
+}
+
+const char *upgrade_state_next(const char *prefix, size_t *cursor, const char **value) {
+    size_t prefix_len = strlen(prefix);
+    while (*cursor < entry_count) {
+        const struct state_entry *entry = &entries[(*cursor)++];
+        if (strncmp(entry->key, prefix, prefix_len) == 0) {
+            *value = entry->value;
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
+int upgrade_adopt_fd(long long fd) {
+    if (fd < 0 || fd > INT_MAX) return -1;
+    int flags = fcntl((int)fd, F_GETFD);
+    if (flags < 0) return -1;
+    fcntl((int)fd, F_SETFD, flags | FD_CLOEXEC);
+    return (int)fd;
+}
+
+void upgrade_handoff(const char *key, const char *format, ...) {
+    size_t room = sizeof(handoff) - handoff_len;
+    int len = snprintf(handoff + handoff_len, room, "%s%s=", handoff_len > sizeof(STATE_VARIABLE) ? " " : "", key);
+    if (len < 0 || (size_t)len >= room) {
+        handoff_overflow = 1;
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int value_len = vsnprintf(handoff + handoff_len + len, room - (size_t)len, format, args);
+    va_end(args);
+    if (value_len < 0 || (size_t)(len + value_len) >= room) {
+        handoff_overflow = 1;
+        return;
+    }
+    handoff_len += (size_t)(len + value_len);
+}
+
+int upgrade_handoff_fd(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0 || kept_fd_count == MAX_KEPT_FDS) return -1;
+    if (fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) != 0) return -1;
+    kept_fds[kept_fd_count++] = fd;
+    return 0;
+}
+
+static void discard_handoff(void) {
+    for (size_t i = 0; i < kept_fd_count; ++i) fcntl(kept_fds[i], F_SETFD, FD_CLOEXEC);
+    kept_fd_count = 0;
+    handoff_len = sizeof(STATE_VARIABLE);
+    handoff[handoff_len] = '\0';
+    handoff_overflow = 0;
+}
+
+void upgrade_exec(void) {
+    if (handoff_overflow) {
+        fprintf(stderr, "Upgrade state does not fit in %zu bytes, not upgrading\n", sizeof(handoff));
+        discard_handoff();
+        return;
+    }
+
+    size_t count = 0;
+    while (environ[count]) count++;
+    char **envp = malloc((count + 2) * sizeof(*envp));
+    if (!envp) {
+        discard_handoff();
+        return;
+    }
+    memcpy(envp, environ, count * sizeof(*envp));
+    envp[count] = handoff;
+    envp[count + 1] = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    execvpe(binary_path, start_argv, envp);
+
+    fprintf(stderr, "Upgrade failed, exec of %s: %s\n", binary_path, strerror(errno));
+    free(envp);
+    discard_handoff();
+}
@@ -0,0 +1,54 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stddef.h> // For size_t
+
+// Function to remember how the server was started, so an upgrade can start it
+// the same way, and to pick up the state handed over by the process this one
+// replaces, if any. Call first thing in main().
+//
+// char *argv[]: main()'s argv, kept as is for the upgrade.
+void upgrade_init(char *argv[]);
+
+// Function to tell whether this process took over from an upgraded one.
+// Returns: 1 if it did, 0 if it was started normally.
+int upgrade_resumed(void);
+
+// Function to look up a value handed over by the previous process.
+// Returns: The value, or NULL if there is none under `key`.
+const char *upgrade_state(const char *key);
+
+// Function to walk the handed over values whose key starts with `prefix`.
+//
+// size_t *cursor: Start at 0, advanced by every call.
+// const char **value: Set to the value of the returned key.
+// Returns: The next matching key, or NULL after the last.
+const char *upgrade_state_next(const char *prefix, size_t *cursor, const char **value);
+
+// Function to take ownership of a descriptor handed over by the previous
+// process. It is marked close-on-exec again, like every descriptor the
+// server opens itself.
+// Returns: The descriptor, or -1 if it is not open.
+int upgrade_adopt_fd(long long fd);
+
+// Function to add a value for the next process, printf-style. Values must
+// not contain spaces.
+void upgrade_handoff(const char *key, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Function to keep a descriptor open across the upgrade's exec(). Its number
+// must be handed over with upgrade_handoff() for the next process to find it.
+// Returns: 0 on success, -1 if the descriptor is not open.
+int upgrade_handoff_fd(int fd);
+
+// Function to replace the process image with the binary the server was
+// started from, read again from disk, with the same arguments and
+// environment plus the values handed over. The PID stays the same, so the
+// services remain its children and are not sent their parent-death signal.
+// Must be called on the main thread: the others end with the exec(), and a
+// service whose creating thread ends would be.
+//
+// Returns: Only if the exec() failed. The handed over values are discarded
+//          and the descriptors are close-on-exec again, the server can go on.
+void upgrade_exec(void);
+
+#endif // UPGRADE_H